@@ -0,0 +1,181 @@
+#ifndef SMC_CONTROL_LOOP_H_
+#define SMC_CONTROL_LOOP_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "smc.h"
+
+/**
+ * Bytes of stack the loop thread touches before its first tick, so
+ * with locked memory a tick never faults a stack page in
+ */
+#define SMC_LOOP_STACK_PREFAULT (64 * 1024)
+
+/**
+ * Counters of a ControlLoop
+ */
+struct ControlLoopStats {
+  uint64_t ticks;               /**< Ticks run */
+  uint64_t overruns;            /**< Periods whose tick and send ran past the next period */
+  uint64_t skipped;             /**< Periods left out to get back in phase after an overrun */
+  uint64_t lateSends;           /**< Sends that started after their phase */
+  uint64_t sendFailures;        /**< Staged setpoints that were not sent */
+  long maxJitterUs;             /**< Worst wake up lateness */
+  HistogramSnapshot jitter;     /**< Wake up lateness of every tick */
+  HistogramSnapshot runtime;    /**< Time from wake up until the tick returned */
+  HistogramSnapshot sendJitter; /**< Lateness of every send against its phase */
+};
+
+/**
+ * Called once per period on the loop thread
+ * @param tick number of the period since start
+ */
+typedef std::function<void(uint64_t tick)> ControlTick;
+
+/**
+ * Runs a tick at a fixed period on a thread of its own
+ * Periods are absolute CLOCK_MONOTONIC times slept to with
+ * clock_nanosleep, so lateness never adds up. A tick that overruns
+ * leaves out the periods it ran into, the loop stays in phase.
+ *
+ * Setpoints staged by the tick go out in one setFleetSpeeds call at a
+ * fixed phase into the period, not whenever the tick happens to finish,
+ * so the controllers see them evenly spaced however long the tick took.
+ * The phase should cover the slowest tick, a later send is counted.
+ *
+ * Optionally the thread runs SCHED_FIFO, pinned to a CPU, with all
+ * memory of the process locked. Everything the loop uses is allocated
+ * before the first tick. Configure before start().
+ */
+class ControlLoop {
+private:
+
+  long _periodUs;
+  ControlTick _tick;
+  int _priority;                        /**< SCHED_FIFO priority, 0 for the default policy */
+  int _cpu;                             /**< CPU to run on, -1 for any */
+  bool _lockMemory;
+
+  SMC *_smc;
+  long _phaseUs;
+  FLEET_FORMAT _format;
+  SMCSetpoint _staged[SMC_MAX_FLEET];   /**< Written by the tick, sent at the phase */
+  int _stagedCount;
+
+  std::thread _thread;
+  std::mutex _lock;
+  std::condition_variable _started;
+  std::atomic<bool> _running;
+  int _setup;                           /**< -1 while the thread sets up, then 1 or 0 */
+
+  std::atomic<uint64_t> _ticks;
+  std::atomic<uint64_t> _overruns;
+  std::atomic<uint64_t> _skipped;
+  std::atomic<uint64_t> _lateSends;
+  std::atomic<uint64_t> _sendFailures;
+  std::atomic<long> _maxJitterUs;
+  Histogram _jitter;
+  Histogram _runtime;
+  Histogram _sendJitter;
+
+  int setup();
+  void run();
+  void send(int64_t phase);
+
+public:
+
+  /**
+   * @param periodUs time between ticks, microseconds
+   */
+  ControlLoop(long periodUs);
+
+  /**
+   * Stops the loop
+   */
+  ~ControlLoop();
+
+  ControlLoop(const ControlLoop&) = delete;
+  ControlLoop& operator=(const ControlLoop&) = delete;
+
+  /**
+   * @param periodUs time between ticks, microseconds
+   * @return 1 if set, 0 while running, not positive or not above the
+   * output phase
+   */
+  int setPeriod(long periodUs);
+
+  /**
+   * @param tick called once per period on the loop thread
+   * @return 1 if set, 0 while running
+   */
+  int setTick(ControlTick tick);
+
+  /**
+   * Runs the loop thread SCHED_FIFO, needs CAP_SYS_NICE or an rtprio limit
+   * @param priority 1-99, 0 for the default policy
+   * @return 1 if set, 0 while running or out of range
+   */
+  int setPriority(int priority);
+
+  /**
+   * Pins the loop thread to a CPU
+   * @param cpu CPU number, -1 for any
+   * @return 1 if set, 0 while running
+   */
+  int setCpu(int cpu);
+
+  /**
+   * Locks all current and future memory of the process on start, needs
+   * CAP_IPC_LOCK or a large enough memlock limit
+   * @param enabled lock memory
+   * @return 1 if set, 0 while running
+   */
+  int setLockMemory(bool enabled);
+
+  /**
+   * Sends the setpoints a tick stages at a fixed phase of its period
+   * @param smc controller connection, NULL to stop sending
+   * @param phaseUs time after the start of the period, less than it
+   * @param format frame format of the setpoints
+   * @return 1 if set, 0 while running or phaseUs is out of range
+   */
+  int setOutput(SMC *smc, long phaseUs, FLEET_FORMAT format = FLEET_FORMAT::POLOLU);
+
+  /**
+   * Stages the setpoints to send at this period's phase, replacing any
+   * staged before. Call from the tick only.
+   * @param setpoints count device and speed pairs
+   * @param count number of setpoints, at most SMC_MAX_FLEET
+   * @return 1 if staged
+   */
+  int stage(const SMCSetpoint *setpoints, int count);
+
+  /**
+   * Starts the loop thread, the first period begins right away
+   * @return 1 if running, 0 if the memory lock, priority or CPU could
+   * not be set
+   */
+  int start();
+
+  /**
+   * Stops the loop, waits for the current period to end
+   */
+  void stop();
+
+  /**
+   * @return 1 if the loop is running
+   */
+  int isRunning();
+
+  /**
+   * Copies the counters, safe while running
+   */
+  void getStats(ControlLoopStats &stats);
+};
+
+#endif /* SMC_CONTROL_LOOP_H_ */
@@ -0,0 +1,266 @@
+#ifndef SMC_DISPATCHER_H_
+#define SMC_DISPATCHER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "SerialPort.h"
+#include "defs.h"
+#include "frames.h"
+#include "spsc_queue.h"
+#include "mpsc_queue.h"
+
+/**
+ * Most requests sent but not yet answered
+ */
+#define SMC_MAX_IN_FLIGHT 16
+
+/**
+ * Most requests submitted but not yet sent, a power of two
+ */
+#define SMC_MAX_QUEUE 128
+
+/**
+ * Setpoint slot of compact format commands, which reach every device
+ * Slots 0-127 hold the setpoint of the device with that ID
+ */
+#define SMC_BROADCAST 128
+
+/**
+ * Most bytes of stop, brake and speed frames gathered into one write
+ */
+#define SMC_MAX_BURST 256
+
+/**
+ * Most bytes of a group of setpoints, which always leave in one write
+ */
+#define SMC_MAX_GROUP 192
+
+/**
+ * Called on an I/O thread when a request finishes
+ * @param ctx context pointer given with the request
+ * @param status 1 if the frame was sent and the full response read
+ * @param response received bytes, responseLen long when status is 1
+ */
+typedef void (*SMCCompletion)(void *ctx, int status, const char *response);
+
+/**
+ * A single command frame and the response it expects
+ */
+struct SMCRequest {
+  char frame[SMC_MAX_FRAME];    /**< Encoded command */
+  uint8_t frameLen;             /**< Bytes used in frame */
+  uint8_t responseLen;          /**< COM_RES_BYTES for the command */
+  SMCCompletion done;           /**< Completion, may be NULL */
+  void *ctx;                    /**< Passed to done */
+};
+
+/**
+ * A request that was sent and waits for its response
+ */
+struct SMCPending {
+  uint8_t responseLen;
+  SMCCompletion done;
+  void *ctx;
+};
+
+/**
+ * Runs all traffic of a serial port on dedicated I/O threads
+ * Any number of threads submit requests through a lock-free queue that
+ * a single writer thread drains. The writer sends requests in order without waiting
+ * for answers, up to SMC_MAX_IN_FLIGHT at a time. The controller answers
+ * in request order, so a reader thread matches the incoming bytes
+ * against the FIFO of sent requests. Requests with a response complete
+ * on the reader thread, write-only requests on the writer thread.
+ * While the dispatcher is running it is the only user of the port, so
+ * the port's io_service is only ever run on the reader thread.
+ * The writer and reader thread use the same SerialPort at once. That is
+ * safe because both backends write straight to the file descriptor and
+ * share no state between the two directions but atomic counters and the
+ * recorder's single producer, single consumer queue. With the asio
+ * backend only the reader thread touches the serial_port object. A
+ * backend that can't write and read concurrently must not be run here.
+ *
+ * Speed and brake commands go through per-device setpoint slots instead
+ * of the request queue. A slot keeps only the newest frame, the writer
+ * gathers all pending setpoints into a single write ahead of queued
+ * requests and paces every write
+ * to the wire time at the port's baud rate, so the kernel never buffers
+ * more than one frame and a setpoint is at most one frame time stale.
+ *
+ * Stop and brake commands take a priority lane ahead of everything
+ * else. An emergency stop drops all pending setpoints and queued
+ * write-only requests, flushes the kernel send buffer and puts the
+ * compact MOTOR_STOP frame on the wire next. Its latency from the call
+ * until the byte has left the port is recorded. Queued reads are carried
+ * past the stop, but reads already in flight may fail: their request can
+ * be flushed before it reaches the wire, and a missing answer fails
+ * everything in flight while the reader resyncs.
+ *
+ * A group of setpoints, such as the wheels of one vehicle, has a lane of
+ * its own. The newest group replaces a pending one and is written whole,
+ * in the same write as the frames around it, so nothing else on the
+ * port gets between its members.
+ */
+class Dispatcher {
+private:
+
+  SerialPort* _conn;            /**< Port driven by the I/O threads */
+  std::thread _writer;
+  std::thread _reader;
+  std::mutex _mutex;
+  std::condition_variable _cond;        /**< Wakes the writer */
+  std::condition_variable _readCond;    /**< Wakes the reader */
+  MpscQueue<SMCRequest, SMC_MAX_QUEUE> _queue;  /**< Requests waiting to be sent */
+  SMCRequest _carry[SMC_MAX_QUEUE];     /**< Writer side requests served before _queue */
+  int _carryHead;
+  int _carryCount;
+  SpscQueue<SMCPending, SMC_MAX_IN_FLIGHT> _inFlight;  /**< Sent, in answer order */
+  std::atomic<bool> _writerWaiting;     /**< Writer sleeps on a full _inFlight */
+  std::atomic<bool> _readerWaiting;     /**< Reader sleeps on an empty _inFlight */
+  std::atomic<bool> _writerIdle;        /**< Writer sleeps with nothing to send */
+  std::atomic<bool> _running;
+  std::atomic<int> _submitting;         /**< submit calls between their _running check and push */
+
+  std::atomic<uint64_t> _setpoints[SMC_BROADCAST + 1];  /**< Packed newest frame per slot, 0 if none */
+  std::atomic<int> _pendingSetpoints;   /**< Non empty slots */
+  std::atomic<unsigned long> _coalesced;  /**< Setpoints replaced before being sent */
+  int _nextSlot;                        /**< Round robin start of the slot scan */
+  std::chrono::steady_clock::time_point _wireFree;  /**< When the last write leaves the wire */
+
+  std::atomic<uint64_t> _urgent[SMC_BROADCAST + 1];  /**< Priority lane stop and brake frames */
+  std::atomic<int> _pendingUrgent;
+  int _nextUrgent;
+  std::atomic<bool> _stopRequested;     /**< Emergency stop not yet on the wire */
+  std::atomic<long long> _stopCalled;   /**< steady_clock ns of the first unserved emergencyStop, 0 if none */
+  std::atomic<long> _lastStopUs;        /**< Latency of the last emergency stop */
+  std::atomic<long> _maxStopUs;         /**< Worst emergency stop latency */
+
+  std::mutex _groupLock;
+  char _group[SMC_MAX_GROUP];           /**< Newest group of back to back frames */
+  int _groupLen;
+  uint8_t _groupSlots[SMC_MAX_GROUP];   /**< Slots the group's frames are for */
+  int _groupCount;
+  std::atomic<bool> _pendingGroup;
+  Histogram _groupWrite;                /**< Time in the writes that carried a group */
+
+  int store(uint8_t slot, const char *frame, int len);
+  void wakeWriter();
+  static uint64_t pack(const char *frame, int len);
+  static int unpack(uint64_t packed, char *frame);
+  uint64_t take(std::atomic<uint64_t> *slots, std::atomic<int> &pending, int &next);
+  void clear(std::atomic<uint64_t> *slots, std::atomic<int> &pending);
+  int takeGroup(char *frames, int room);
+  void dropGroup(uint8_t slot);
+  bool nextRequest(SMCRequest &req);
+  void carry(const SMCRequest &req, bool front);
+  void sendStop();
+  int write(const char *frame, int len, Histogram *timing = NULL);
+  void writeLoop();
+  void readLoop();
+  void failInFlight();
+
+public:
+
+  /**
+   * Create a dispatcher for an open serial port
+   * @param conn pointer to an open serial port
+   */
+  Dispatcher(SerialPort* conn);
+
+  /**
+   * Stops the I/O threads if running
+   */
+  ~Dispatcher();
+
+  /**
+   * Starts the I/O threads
+   * @return 1 if the threads are running
+   */
+  int start();
+
+  /**
+   * Stops the I/O threads, requests still queued or in flight
+   * complete with status 0
+   */
+  void stop();
+
+  /**
+   * @return 1 if the I/O threads are running
+   */
+  int isRunning();
+
+  /**
+   * Queues a request for the writer thread, safe from any thread
+   * @param request frame, response length and completion
+   * @return 1 if queued, 0 if the queue is full or the I/O threads
+   * are not running
+   */
+  int submit(const SMCRequest &request);
+
+  /**
+   * Replaces the pending speed or brake command of a slot
+   * The previous frame is dropped if it was not sent yet
+   * @param slot ID of device, or SMC_BROADCAST for compact format frames
+   * @param frame encoded command, at most 7 bytes
+   * @param len bytes in frame
+   * @return 1 if stored, 0 if the I/O threads are not running
+   */
+  int setpoint(uint8_t slot, const char *frame, int len);
+
+  /**
+   * Replaces the pending group of setpoints
+   * The group is written whole, in one write, and drops the pending
+   * setpoints of its slots
+   * @param slots count slot IDs, the devices the frames are for
+   * @param count number of frames
+   * @param frames back to back frames
+   * @param len bytes in frames, at most SMC_MAX_GROUP
+   * @return 1 if stored, 0 if the I/O threads are not running
+   */
+  int group(const uint8_t *slots, int count, const char *frames, int len);
+
+  /**
+   * Time spent in the writes that carried a group, how far apart the
+   * host put its first and last byte
+   * @param out ref for the histogram
+   */
+  void groupWriteTime(HistogramSnapshot &out);
+
+  /**
+   * @return number of setpoints dropped because a newer one replaced them
+   */
+  unsigned long coalescedCount();
+
+  /**
+   * Sends a stop or brake frame through the priority lane
+   * Drops the slot's pending setpoint, and a pending group with the
+   * slot in it, so they can't override the frame
+   * @param slot ID of device, or SMC_BROADCAST for compact format frames
+   * @param frame encoded command, at most 7 bytes
+   * @param len bytes in frame
+   * @return 1 if stored, 0 if the I/O threads are not running
+   */
+  int urgent(uint8_t slot, const char *frame, int len);
+
+  /**
+   * Stops every device ahead of all other traffic
+   * Safe to call from any thread. Reads already sent may complete with
+   * status 0, queued reads are sent after the stop
+   * @return 1 if the stop was scheduled, 0 if the I/O threads are not running
+   */
+  int emergencyStop();
+
+  /**
+   * Emergency stop latency, from the call until the frame left the port
+   * @param maxUs ref for the worst latency seen, microseconds
+   * @return latency of the last emergency stop, microseconds
+   */
+  long stopLatency(long &maxUs);
+};
+
+#endif /* SMC_DISPATCHER_H_ */
@@ -0,0 +1,85 @@
+#ifndef SMC_MOTOR_GROUP_H_
+#define SMC_MOTOR_GROUP_H_
+
+#include <stdint.h>
+#include <atomic>
+
+#include "smc.h"
+
+/**
+ * Counters of a MotorGroup
+ */
+struct MotorGroupStats {
+  uint64_t updates;             /**< Groups sent or stored */
+  uint64_t failures;            /**< Groups not sent */
+  long wireSkewUs;              /**< Time from the first to the last member's frame on the wire */
+  HistogramSnapshot hostSkew;   /**< Time in the write that carried a group */
+};
+
+/**
+ * Motors that always change speed together, like the wheels of a
+ * vehicle with one controller each
+ * Every update encodes all members into one buffer that goes out in a
+ * single write, so nothing else on the port can get between them and
+ * the last member starts moving at most wireSkewUs after the first.
+ *
+ * The host side of the skew is measured as the time in that write. With
+ * the I/O thread running the writer measures it, for every group on the
+ * port. On a reactor the frames are queued as one run and the time
+ * covers queueing it.
+ */
+class MotorGroup {
+private:
+
+  SMC *_smc;
+  SMCSetpoint _members[SMC_MAX_FLEET];
+  int _count;
+  FLEET_FORMAT _format;
+  long _wireSkewUs;
+  Histogram _hostSkew;
+  std::atomic<uint64_t> _updates;
+  std::atomic<uint64_t> _failures;
+
+public:
+
+  /**
+   * @param smc controller connection of every member
+   * @param baud baud rate of the link
+   * @param devices IDs of the members, in the order of their speeds
+   * @param count number of members, at most SMC_MAX_FLEET
+   * @param format frame format, MINI_SSC has the least skew
+   */
+  MotorGroup(SMC *smc, int baud, const uint8_t *devices, int count,
+             FLEET_FORMAT format = FLEET_FORMAT::POLOLU);
+
+  MotorGroup(const MotorGroup&) = delete;
+  MotorGroup& operator=(const MotorGroup&) = delete;
+
+  /**
+   * @return number of members, 0 if the devices given were not valid
+   */
+  int size();
+
+  /**
+   * Sets the speed of every member in one write
+   * @param speeds one per member, -3200 (full reverse) to 3200 (full forward)
+   * @return 1 if sent or stored, 0 if a speed is out of range or it failed
+   */
+  int set(const int16_t *speeds);
+
+  /**
+   * Sets the speeds of a two member group, such as left and right wheel
+   * @param first speed of the first member
+   * @param second speed of the second member
+   * @return 1 if sent or stored, 0 if the group doesn't have two
+   * members, a speed is out of range or it failed
+   */
+  int set(int16_t first, int16_t second);
+
+  /**
+   * Copies the counters
+   */
+  void getStats(MotorGroupStats &stats);
+};
+
+#endif /* SMC_MOTOR_GROUP_H_ */
@@ -0,0 +1,200 @@
+#ifndef SMC_POLL_SCHEDULER_H_
+#define SMC_POLL_SCHEDULER_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "smc.h"
+#include "TelemetryCache.h"
+#include "TimerWheel.h"
+
+/**
+ * Most polls a scheduler keeps on the wire with an I/O thread or reactor
+ */
+#define SMC_POLL_IN_FLIGHT 4
+
+/**
+ * A variable that doesn't change slows down to its target rate divided
+ * by this
+ */
+#define SMC_POLL_BACKOFF 8
+
+/**
+ * Polls in a row without a change that halve a variable's rate
+ */
+#define SMC_POLL_STEADY 8
+
+/**
+ * Rate of one polled variable
+ */
+struct PollRate {
+  uint8_t device;
+  uint8_t variableID;
+  uint8_t priority;
+  double targetHz;              /**< Rate asked for */
+  double wantHz;                /**< Rate after adapting to observed change */
+  double plannedHz;             /**< Rate the budget allows */
+  uint64_t polls;               /**< Answered polls */
+  uint64_t changes;             /**< Answers that moved more than the deadband */
+  uint64_t failures;            /**< Polls without an answer */
+};
+
+/**
+ * Called with every polled value, on the I/O thread if there is one
+ * and on the scheduler thread otherwise
+ */
+typedef std::function<void(uint8_t device, uint8_t variableID, uint16_t value)> PollCallback;
+
+/**
+ * Polls variables of every device on a link at rates that fit a share of
+ * its bandwidth
+ * Each variable has a target rate and a priority. The budget, a share
+ * of the bytes the baud rate carries, goes to the highest priority first,
+ * a priority that doesn't fit is scaled down as a whole and lower ones
+ * get what is left. Each poll's next due time is a timer on a
+ * TimerWheel, due polls go out highest priority first, paced so the
+ * budget holds even when many fall due at once.
+ *
+ * Rates adapt to the data. A value that stays within its deadband for
+ * SMC_POLL_STEADY polls halves its rate, down to a SMC_POLL_BACKOFF
+ * fraction of its target, which frees
+ * budget for lower priorities, and snaps back to its target as soon as
+ * it moves.
+ *
+ * Configure before start(). Polled values go to an optional
+ * TelemetryCache and callback.
+ */
+class PollScheduler {
+private:
+
+  struct Rate {
+    bool set;
+    double targetHz;
+    uint8_t priority;
+    uint16_t deadband;
+  };
+
+  struct Item {
+    uint8_t device;
+    uint8_t variableID;
+    uint8_t priority;
+    uint16_t deadband;
+    double targetHz;
+    double wantHz;
+    double plannedHz;
+    std::chrono::steady_clock::time_point next;
+    uint32_t timer;                     /**< Wheel timer of next, 0 if none */
+    bool due;                           /**< In _ready */
+    bool inFlight;
+    bool haveValue;
+    uint16_t last;
+    int steady;                         /**< Polls since the last change, up to SMC_POLL_STEADY */
+    uint64_t polls;
+    uint64_t changes;
+    uint64_t failures;
+  };
+
+  SMC *_smc;
+  double _budget;
+  long _pollUs;                         /**< Wire time of one request and response */
+  Rate _rates[SMC_CACHE_VARS];
+  std::vector<uint8_t> _devices;
+  std::vector<Item> _items;
+  TimerWheel *_timers;                  /**< Due times, sized to _items on start */
+  std::vector<size_t> _ready;           /**< Items whose timer fired, not yet sent */
+  TelemetryCache *_cache;
+  PollCallback _callback;
+
+  std::thread _thread;
+  std::mutex _lock;
+  std::condition_variable _wake;
+  bool _running;
+  bool _replan;
+  int _inFlight;
+
+  void plan();
+  void arm(std::chrono::steady_clock::time_point now);
+  static void fire(void *ctx, uint32_t index);
+  void run();
+  int poll(size_t index, std::chrono::steady_clock::time_point sent);
+  void complete(size_t index, std::chrono::steady_clock::time_point sent, int status, uint16_t value);
+
+public:
+
+  /**
+   * @param smc controller connection the polls go through
+   * @param baud baud rate of the link
+   */
+  PollScheduler(SMC *smc, int baud);
+
+  /**
+   * Stops polling
+   */
+  ~PollScheduler();
+
+  PollScheduler(const PollScheduler&) = delete;
+  PollScheduler& operator=(const PollScheduler&) = delete;
+
+  /**
+   * Polls a variable on every added device
+   * @param variable variable to poll
+   * @param targetHz polls per second while it changes
+   * @param priority higher gets budget first
+   * @param deadband change that doesn't count as one
+   * @return 1 if set, 0 while running
+   */
+  int setRate(SMC_VAR variable, double targetHz, uint8_t priority = 0, uint16_t deadband = 0);
+
+  /**
+   * Adds a device to poll every variable with a rate on
+   * @param device ID of device
+   * @return 1 if added, 0 while running
+   */
+  int addDevice(uint8_t device);
+
+  /**
+   * @param share part of the link's bytes polls may use, 0 to 1
+   * @return 1 if set, 0 while running
+   */
+  int setBudget(double share);
+
+  /**
+   * @param cache receives every polled value, NULL for none
+   * @return 1 if set, 0 while running
+   */
+  int setCache(TelemetryCache *cache);
+
+  /**
+   * @param callback called with every polled value, empty for none
+   * @return 1 if set, 0 while running
+   */
+  int setCallback(PollCallback callback);
+
+  /**
+   * Plans the rates and starts polling on a thread
+   * @return 1 if running
+   */
+  int start();
+
+  /**
+   * Stops polling and waits for polls on the wire
+   */
+  void stop();
+
+  /**
+   * @return 1 if polling
+   */
+  int isRunning();
+
+  /**
+   * Copies the rates of every polled variable
+   */
+  void getRates(std::vector<PollRate> &rates);
+};
+
+#endif /* SMC_POLL_SCHEDULER_H_ */
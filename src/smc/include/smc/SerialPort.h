@@ -7,28 +7,84 @@
 #include <unistd.h>
 #include <string>
 
-#include <boost/asio/serial_port.hpp> 
-#include <boost/asio.hpp>
-#include <boost/asio/deadline_timer.hpp> 
-#include <boost/bind.hpp>
+#include "smc/Stats.h"
 
-#include "smc/blocking_reader.h"
+class SerialBackend;
+class WireRecorder;
+
+/**
+ * Implementation behind a SerialPort
+ */
+enum class SERIAL_BACKEND: uint8_t {
+  ASIO,                         /**< boost::asio, the default when built with SMC_SERIAL_ASIO */
+  POSIX                         /**< open/termios/poll, two syscalls per short read */
+};
  
 class SerialPort {
  private:
-  boost::asio::io_service io;
-  boost::asio::serial_port *port;
-  blocking_reader *reader;
+  SerialBackend *backend;
+  int baud;
+
+  Histogram writeTime;
+  Histogram readTime;
+  std::atomic<uint64_t> txBytes;
+  std::atomic<uint64_t> rxBytes;
+  std::atomic<uint64_t> timeouts;
+  std::atomic<uint64_t> shortReads;
+  SERIAL_BACKEND type;
+  WireRecorder *recorder;
 public:
     SerialPort();
+
+  /**
+   * @param type backend to use, POSIX if ASIO was not built
+   */
+  explicit SerialPort(SERIAL_BACKEND type);
+  ~SerialPort();
+
+  SerialPort(const SerialPort &) = delete;
+  SerialPort& operator=(const SerialPort &) = delete;
   
-  int connect (std::string device, int baud, size_t timeout);
+  /**
+   * Opens a serial device
+   * @param timeout read deadline in milliseconds
+   * @param lowLatency set raw 8N1 explicitly and ask the driver to pass
+   * received bytes on at once (ASYNC_LOW_LATENCY), instead of batching
+   * them on a USB adapter's latency timer
+   * @return 1 if open, low latency is best effort, see isLowLatency
+   */
+  int connect (std::string device, int baud, size_t timeout, bool lowLatency = false);
   void disconnect(void);
 
   int sendArray(char *buffer, int len);
   int sendString(std::string msg);
   int getArray (char *buffer, int len);
+
+  /**
+   * Reads whatever arrives until a deadline, for answers whose length is
+   * not known. Not while an I/O thread or reactor uses the port.
+   * @param buffer room for len bytes
+   * @param len most bytes to read, returns once they are in
+   * @param timeoutUs deadline from the call, microseconds
+   * @return bytes read
+   */
+  int getAvailable(char *buffer, int len, long timeoutUs);
+  int lastReadTimedOut();
   int isOpen();
+  int getBaud();
+  SERIAL_BACKEND getBackend();
+
+  /**
+   * @return 1 if the driver has ASYNC_LOW_LATENCY set
+   */
+  int isLowLatency();
+
+  /**
+   * @return file descriptor of the open device, -1 if closed
+   * For an external event loop, which must then be the only reader and
+   * writer of the port
+   */
+  int getFd();
 
   enum flush_type
   {
@@ -38,6 +94,25 @@ public:
   };
 
   void flushPort(flush_type what);
+  void drain();
+
+  /**
+   * Records every frame sent and received, off by default
+   * Set while no I/O thread or reactor is using the port
+   * @param recorder open recorder, NULL to stop recording
+   */
+  void setRecorder(WireRecorder *recorder);
+
+  /**
+   * @return the recorder, NULL if not recording
+   */
+  WireRecorder* getRecorder();
+
+  /**
+   * Copies the byte counts, read failures and write and read times
+   * Lock free, any thread
+   */
+  void getStats(SerialStats &stats);
 
   
 };
@@ -0,0 +1,192 @@
+#ifndef SMC_SERIAL_REACTOR_H_
+#define SMC_SERIAL_REACTOR_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "SerialPort.h"
+#include "Dispatcher.h"
+#include "TimerWheel.h"
+#include "mpsc_queue.h"
+
+/**
+ * Most ports served by one reactor
+ */
+#define SMC_MAX_PORTS 16
+
+/**
+ * Most periodic requests of one reactor
+ */
+#define SMC_MAX_PERIODIC 64
+
+/**
+ * Runs the traffic of several serial ports on a single thread
+ * Each port has its own lock-free request queue that any thread can
+ * submit to. The reactor thread waits on all port descriptors at once
+ * with epoll, writes requests without blocking and pipelines up to
+ * SMC_MAX_IN_FLIGHT of them per port, matching responses in request
+ * order as the Dispatcher does.
+ *
+ * Every request with a response gets a deadline of the port's timeout
+ * plus the wire time of the bytes ahead of it. When one expires the
+ * port's in-flight requests fail and its receive side is flushed, since
+ * later bytes can no longer be matched. Write-only requests complete
+ * once their frame is queued for the wire.
+ *
+ * Deadlines and periodic requests, such as keepalives and polls, share
+ * one TimerWheel, so arming a deadline per request and cancelling it on
+ * the answer stays constant time however many are in flight.
+ *
+ * Add ports before start(). While a port is registered the reactor is
+ * its only reader and writer.
+ */
+class SerialReactor {
+private:
+
+  struct Port {
+    SerialPort *conn;
+    int fd;
+    long timeoutUs;
+    int baud;
+    std::atomic<bool> failed;
+    bool writeWait;                     /**< EPOLLOUT armed, kernel send buffer full */
+
+    MpscQueue<SMCRequest, SMC_MAX_QUEUE> queue;
+    SMCRequest next;                    /**< Taken from queue, waiting for room */
+    bool hasNext;
+
+    SMCPending inFlight[SMC_MAX_IN_FLIGHT];
+    uint32_t timers[SMC_MAX_IN_FLIGHT]; /**< Deadline of each in-flight request */
+    int head;
+    int count;
+
+    char tx[SMC_MAX_BURST];
+    int txLen;
+    char rx[SMC_MAX_IN_FLIGHT * SMC_MAX_RESPONSE];
+    int rxLen;
+  };
+
+  enum class PERIODIC: int {
+    FREE,
+    CLAIMED,                            /**< Being filled in by every() */
+    ADDED,                              /**< Waits for the reactor to arm it */
+    ACTIVE,
+    CANCELLED                           /**< Waits for the reactor to disarm it */
+  };
+
+  struct Periodic {
+    std::atomic<PERIODIC> state;
+    int port;
+    long periodUs;
+    SMCRequest request;
+    uint32_t timer;
+  };
+
+  Port *_ports[SMC_MAX_PORTS];
+  int _portCount;
+  int _epoll;
+  int _wake;                            /**< eventfd that interrupts epoll_wait */
+  std::thread _thread;
+  std::atomic<bool> _running;
+  std::atomic<int> _submitting;         /**< submit calls between their _running check and push */
+  std::atomic<bool> _sleeping;          /**< Reactor blocks in epoll_wait */
+  TimerWheel _timers;
+  Periodic _periodic[SMC_MAX_PERIODIC];
+  std::atomic<bool> _periodicChanged;   /**< A schedule waits to be armed or disarmed */
+
+  static void deadline(void *ctx, uint32_t port);
+  static void period(void *ctx, uint32_t slot);
+  void wake();
+  void updatePeriodic();
+  void run();
+  void fill(int index);
+  void flush(int index);
+  void receive(int index);
+  void failInFlight(Port &port);
+  void fail(int index);
+  void watchWrite(int index, bool on);
+  long wireUs(const Port &port, int bytes);
+
+public:
+
+  SerialReactor();
+
+  /**
+   * Stops the reactor thread if running
+   */
+  ~SerialReactor();
+
+  /**
+   * Registers a connected port, before start()
+   * @param conn open serial port, not used by anything else afterwards
+   * @param timeout response deadline in milliseconds
+   * @return index of the port for submit, -1 if it can't be added
+   */
+  int addPort(SerialPort *conn, size_t timeout);
+
+  /**
+   * @return number of registered ports
+   */
+  int portCount();
+
+  /**
+   * Starts the reactor thread
+   * @return 1 if running
+   */
+  int start();
+
+  /**
+   * Stops the reactor thread, requests still queued or in flight
+   * complete with status 0
+   */
+  void stop();
+
+  /**
+   * @return 1 if the reactor thread is running
+   */
+  int isRunning();
+
+  /**
+   * Queues a request on a port, safe from any thread
+   * @param port index returned by addPort
+   * @param request frame, response length and completion
+   * @return 1 if queued, 0 if the queue is full, the port failed or
+   * the reactor is not running
+   */
+  int submit(int port, const SMCRequest &request);
+
+  /**
+   * Queues several requests on a port as one run, safe from any thread
+   * Nothing submitted from another thread gets between them, so their
+   * frames reach the wire back to back
+   * @param port index returned by addPort
+   * @param requests count requests, in wire order
+   * @param count number of requests, at most SMC_MAX_QUEUE
+   * @return 1 if all were queued, 0 if none were because the queue
+   * lacks room, the port failed or the reactor is not running
+   */
+  int submit(int port, const SMCRequest *requests, int count);
+
+  /**
+   * Queues a copy of a request on a port every period, safe from any
+   * thread, for keepalives and telemetry polls. The completion runs
+   * for every copy, a copy is skipped while the port's queue is full.
+   * @param port index returned by addPort
+   * @param request frame, response length and completion
+   * @param periodMs period in milliseconds
+   * @return schedule id for cancel, 0 if the table is full
+   */
+  int every(int port, const SMCRequest &request, size_t periodMs);
+
+  /**
+   * Stops a periodic request, safe from any thread
+   * A copy already queued is still sent
+   * @param id returned by every
+   * @return 1 if it was scheduled
+   */
+  int cancel(int id);
+};
+
+#endif /* SMC_SERIAL_REACTOR_H_ */
@@ -0,0 +1,145 @@
+#ifndef SMC_SETPOINT_ENCODER_H_
+#define SMC_SETPOINT_ENCODER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+#include "Dispatcher.h"
+#include "frames.h"
+
+/**
+ * Default time after which an unchanged speed is sent again
+ */
+#define SMC_SETPOINT_REFRESH_MS 100
+
+/**
+ * Most devices one encode call reaches
+ */
+#define SMC_MAX_SETPOINT_DEVICES 32
+
+/**
+ * Frame format chosen for a speed
+ */
+enum class SETPOINT_FORMAT: uint8_t {
+  COMPACT,                      /**< 3 bytes to every device, full resolution */
+  COMPACT_7BIT,                 /**< 2 bytes to every device, 127 steps each way */
+  POLOLU,                       /**< 5 bytes per device, full resolution */
+  POLOLU_7BIT,                  /**< 4 bytes per device, 127 steps each way */
+  MINI_SSC                      /**< 3 bytes per device, 127 steps each way */
+};
+
+/**
+ * Counters of a SetpointEncoder
+ */
+struct SetpointEncoderStats {
+  uint64_t frames;              /**< Frames encoded */
+  uint64_t suppressed;          /**< Frames left out, the device already has that speed */
+  uint64_t bytes;               /**< Bytes encoded */
+  uint64_t fullBytes;           /**< Bytes full resolution Pololu frames would have taken */
+  uint64_t formats[5];          /**< Frames per SETPOINT_FORMAT */
+};
+
+/**
+ * Picks the shortest frames that bring devices to a speed
+ * A speed every device on the bus should take goes out as one compact
+ * frame. Otherwise each device gets its own frame. A 7-bit frame, or a
+ * Mini SSC one if the controllers listen for it, is used when its
+ * nearest step is within the tolerance of the speed asked for.
+ *
+ * The encoder remembers the speed it last sent each device and leaves
+ * out frames that would repeat it, until the refresh time has passed so
+ * a controller's command timeout still sees traffic. Anything else that
+ * changes a motor must call forget.
+ *
+ * Safe to use from several threads, a race costs at most a frame that
+ * could have been left out.
+ */
+class SetpointEncoder {
+private:
+
+  std::atomic<uint8_t> _bus[SMC_MAX_SETPOINT_DEVICES];
+  std::atomic<int> _busCount;
+  std::atomic<uint16_t> _tolerance;
+  std::atomic<uint32_t> _refreshMs;
+  std::atomic<bool> _ssc;
+  std::atomic<uint8_t> _sscOffset;
+
+  /**
+   * Last speed sent per device, bit 63 valid, bits 16-62 ms since the
+   * encoder was made, low 16 the speed. Index 128 is the last broadcast.
+   */
+  std::atomic<uint64_t> _last[SMC_BROADCAST + 1];
+  std::chrono::steady_clock::time_point _origin;
+
+  std::atomic<uint64_t> _frames;
+  std::atomic<uint64_t> _suppressed;
+  std::atomic<uint64_t> _bytes;
+  std::atomic<uint64_t> _fullBytes;
+  std::atomic<uint64_t> _formats[5];
+
+  uint64_t now();
+  bool current(int index, int16_t speed, uint64_t now);
+  void remember(int index, int16_t speed, uint64_t now);
+  bool isBus(const uint8_t *devices, int count);
+  int encode7Bit(char *frame, int device, int16_t speed, int16_t &sent);
+  void tally(SETPOINT_FORMAT format, int len, int fullLen);
+
+public:
+
+  SetpointEncoder();
+
+  /**
+   * @param tolerance largest difference from the speed asked for a
+   * shorter frame may have, 0 for exact speeds only
+   */
+  void setTolerance(uint16_t tolerance);
+
+  /**
+   * @param ms time after which an unchanged speed is sent again, 0 to
+   * never send it again
+   */
+  void setRefresh(uint32_t ms);
+
+  /**
+   * Devices on the bus, a speed for all of them is broadcast
+   * @param devices IDs of devices
+   * @param count number of devices, at most SMC_MAX_SETPOINT_DEVICES
+   * @return 1 if set
+   */
+  int setBus(const uint8_t *devices, int count);
+
+  /**
+   * Lets single device frames use Mini SSC
+   * @param enabled controllers listen for Mini SSC frames
+   * @param offset servo number of device 0
+   */
+  void setMiniSsc(bool enabled, uint8_t offset);
+
+  /**
+   * Encodes the frames that bring devices to a speed
+   * @param devices IDs of devices, NULL for every device
+   * @param count number of devices, at most SMC_MAX_SETPOINT_DEVICES
+   * @param speed -3200 (full reverse) to 3200 (full forward)
+   * @param frames count frames of SMC_MAX_FRAME bytes each
+   * @param lens returns the length of each frame
+   * @param slots returns the device of each frame, SMC_BROADCAST for a
+   * compact one
+   * @return number of frames, 0 if all were left out, -1 if an argument
+   * is out of range
+   */
+  int encode(const uint8_t *devices, int count, int16_t speed, char *frames, int *lens, uint8_t *slots);
+
+  /**
+   * Forgets the speed sent to a device so the next one is not left out
+   * @param device ID of device, SMC_BROADCAST for every device
+   */
+  void forget(uint8_t device);
+
+  /**
+   * Copies the counters
+   */
+  void getStats(SetpointEncoderStats &stats);
+};
+
+#endif /* SMC_SETPOINT_ENCODER_H_ */
@@ -0,0 +1,194 @@
+#ifndef SMC_SIMULATOR_H_
+#define SMC_SIMULATOR_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "defs.h"
+
+/**
+ * Counters kept by the simulator
+ */
+struct SimStats {
+  unsigned long frames;         /**< Complete frames decoded */
+  unsigned long responses;      /**< Responses written */
+  unsigned long dropped;        /**< Responses lost to fault injection */
+  unsigned long corrupted;      /**< Responses damaged by fault injection */
+  unsigned long collisions;     /**< Compact reads answered by several devices */
+  unsigned long serialErrors;   /**< Malformed bytes or frames */
+};
+
+/**
+ * Simulated Pololu Simple Motor Controllers behind a pseudo-terminal
+ * The slave side of the pty is a serial device that SerialPort::connect
+ * can open. The simulator decodes the compact, Pololu and Mini SSC
+ * formats for any number of device IDs, keeps the SMC_VAR variables of
+ * each device and answers GET_SMC_VAR, SET_LIMIT and GET_FIRMWARE.
+ *
+ * At a nonzero baud rate every byte costs ten bit times in each
+ * direction, as on a real 8N1 line. Compact format reads are answered
+ * by every device at once and the replies are combined as on a wired-AND
+ * TX line. Responses can be delayed, dropped or corrupted.
+ *
+ * Answers to GET_SMC_VAR can also be queued ahead, one per read, so a
+ * host that pipelines reads of a changing variable gets each the value
+ * meant for it.
+ *
+ * Configure devices and faults before start().
+ */
+class Simulator {
+private:
+
+  struct Device {
+    bool present;
+    bool safeStart;             /**< Safe start violation, motor held at 0 */
+    uint16_t productID;
+    uint8_t major;              /**< Firmware version, BCD */
+    uint8_t minor;
+    uint16_t vars[128];         /**< Indexed by SMC_VAR */
+  };
+
+  struct Output {
+    std::chrono::steady_clock::time_point due;  /**< When the last byte has left */
+    uint8_t bytes[8];
+    int len;
+  };
+
+  Device _devices[128];
+  std::map<uint16_t, std::deque<uint16_t>> _answers;  /**< Queued GET_SMC_VAR answers by device << 7 | variable */
+  std::mutex _mutex;            /**< Guards _devices and _answers once started */
+
+  int _master;                  /**< pty master, the simulator's end */
+  int _slave;                   /**< Kept open so the line settings persist */
+  std::string _path;
+  std::thread _thread;
+  std::atomic<bool> _running;
+
+  int _baud;                    /**< 0 for no wire time */
+  long _delayUs;                /**< Processing time before each response */
+  uint8_t _sscOffset;
+  double _dropRate;
+  double _corruptRate;
+  std::mt19937 _random;
+  std::chrono::steady_clock::time_point _started;
+  std::chrono::steady_clock::time_point _rxWire;  /**< When the last received byte finished arriving */
+  std::chrono::steady_clock::time_point _txWire;  /**< When the last response byte finishes leaving */
+
+  // decoder state
+  uint8_t _frame[8];
+  int _frameLen;
+  int _frameNeed;               /**< Total bytes of the frame being decoded, 0 if none */
+  std::deque<Output> _outputs;  /**< Scheduled responses, simulator thread only */
+
+  std::atomic<unsigned long> _frames;
+  std::atomic<unsigned long> _responses;
+  std::atomic<unsigned long> _dropped;
+  std::atomic<unsigned long> _corrupted;
+  std::atomic<unsigned long> _collisions;
+  std::atomic<unsigned long> _serialErrors;
+
+  void run();
+  void receive(uint8_t byte);
+  void execute(bool compact, uint8_t device, uint8_t command, const uint8_t *data);
+  int apply(Device &dev, uint8_t command, const uint8_t *data, uint8_t *response);
+  void setSpeed(Device &dev, int speed);
+  void respond(const uint8_t *response, int len);
+  void serialError(uint16_t bit);
+  void serialErrorLocked(uint16_t bit);
+  long wireUs(int bytes);
+
+public:
+
+  Simulator();
+
+  /**
+   * Stops the simulator if running
+   */
+  ~Simulator();
+
+  /**
+   * Adds a device, all devices start in safe start
+   * @param device ID of device, 0-127
+   * @param productID reported by GET_FIRMWARE
+   * @param major firmware major version, BCD
+   * @param minor firmware minor version, BCD
+   */
+  void addDevice(uint8_t device, uint16_t productID = 0x98, uint8_t major = 0x01, uint8_t minor = 0x04);
+
+  /**
+   * Removes a device, it stops answering
+   * @param device ID of device
+   */
+  void removeDevice(uint8_t device);
+
+  /**
+   * Emulates the wire time of a baud rate, 0 to disable
+   */
+  void setBaud(int baud);
+
+  /**
+   * Time the device takes before it starts a response
+   * @param us microseconds
+   */
+  void setResponseDelay(long us);
+
+  /**
+   * Mini SSC servo number of device 0
+   */
+  void setMiniSscOffset(uint8_t offset);
+
+  /**
+   * Fault injection
+   * @param dropRate probability that a response is never sent
+   * @param corruptRate probability that one bit of a response is flipped
+   * @param seed random seed, for repeatable runs
+   */
+  void setFaults(double dropRate, double corruptRate, unsigned seed = 1);
+
+  /**
+   * Sets a variable of a device, for example INPUT_VOLTAGE
+   */
+  void setVariable(uint8_t device, SMC_VAR variable, uint16_t val);
+
+  /**
+   * @return a variable of a device as the host would read it
+   */
+  uint16_t getVariable(uint8_t device, SMC_VAR variable);
+
+  /**
+   * Queues the answer to a later GET_SMC_VAR of a variable
+   * Queued answers go out in order, one per read and ahead of the
+   * variable's value, which they leave as it is
+   */
+  void queueAnswer(uint8_t device, SMC_VAR variable, uint16_t val);
+
+  /**
+   * Opens the pseudo-terminal and starts serving it
+   * @return 1 if running
+   */
+  int start();
+
+  /**
+   * Stops serving and closes the pseudo-terminal
+   */
+  void stop();
+
+  /**
+   * @return path of the serial device to connect to, empty until started
+   */
+  std::string getPath();
+
+  /**
+   * @return a copy of the counters
+   */
+  SimStats getStats();
+};
+
+#endif /* SMC_SIMULATOR_H_ */
@@ -0,0 +1,162 @@
+#ifndef SMC_STATS_H_
+#define SMC_STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+/**
+ * Number of latency buckets, bucket i counts samples of at most 2^i us,
+ * the bound being inclusive like a Prometheus le, and the last one
+ * everything slower
+ */
+#define SMC_HISTOGRAM_BUCKETS 24
+
+/**
+ * Command types with their own latency histogram, the POLOLU_COM
+ * commands and Mini SSC
+ */
+#define SMC_STAT_COMMANDS 11
+
+/**
+ * Copy of a Histogram
+ */
+struct HistogramSnapshot {
+  uint64_t count;
+  uint64_t sumUs;
+  uint64_t buckets[SMC_HISTOGRAM_BUCKETS];  /**< Not cumulative */
+};
+
+/**
+ * Log2 bucketed latency histogram, recorded and read without locks
+ * The count is the sum of the buckets, a snapshot taken during a record
+ * may have that sample's bucket without its time or the other way round
+ */
+class Histogram {
+private:
+  std::atomic<uint64_t> _sumUs;
+  std::atomic<uint64_t> _buckets[SMC_HISTOGRAM_BUCKETS];
+
+public:
+
+  Histogram();
+
+  /**
+   * Adds a sample
+   * @param us latency in microseconds
+   */
+  void record(uint64_t us){
+    // bucket 0 takes 0 and 1 us, clz of 0 is undefined
+    int i = us > 1 ? 64 - __builtin_clzll(us - 1) : 0;
+    if(i >= SMC_HISTOGRAM_BUCKETS)
+      i = SMC_HISTOGRAM_BUCKETS - 1;
+    _buckets[i].fetch_add(1, std::memory_order_relaxed);
+    _sumUs.fetch_add(us, std::memory_order_relaxed);
+  }
+
+  /**
+   * Adds the time since start
+   */
+  void record(std::chrono::steady_clock::time_point start){
+    record(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count());
+  }
+
+  void snapshot(HistogramSnapshot &out) const;
+
+  /**
+   * @return inclusive upper bound of a bucket in us, 0 for the last one
+   */
+  static uint64_t bound(int bucket);
+};
+
+/**
+ * Counters of a SerialPort
+ */
+struct SerialStats {
+  uint64_t txBytes;
+  uint64_t rxBytes;
+  uint64_t timeouts;            /**< Reads that ran out of time */
+  uint64_t shortReads;          /**< Reads that returned fewer bytes than asked */
+  HistogramSnapshot write;      /**< Time in sendArray */
+  HistogramSnapshot read;       /**< Time waiting in getArray */
+};
+
+/**
+ * Counters of one command type
+ */
+struct CommandStats {
+  uint8_t command;              /**< POLOLU_COM value, or SSC_COM::SSC_PWM */
+  const char *name;
+  uint64_t failures;
+  HistogramSnapshot latency;    /**< Time spent in the call, including retries */
+};
+
+/**
+ * Everything an SMC counts
+ */
+struct SMCStats {
+  SerialStats serial;
+  CommandStats commands[SMC_STAT_COMMANDS];
+  uint64_t retries;
+};
+
+/**
+ * Per command counters kept by SMC
+ */
+class CommandMetrics {
+private:
+  Histogram _latency[SMC_STAT_COMMANDS];
+  std::atomic<uint64_t> _failures[SMC_STAT_COMMANDS];
+  std::atomic<uint64_t> _retries;
+
+public:
+
+  CommandMetrics();
+
+  /**
+   * @return index of a command type, -1 if not counted
+   */
+  static int index(uint8_t command);
+
+  /**
+   * @return command type of an encoded frame
+   */
+  static uint8_t command(const char *frame);
+
+  /**
+   * @return name of a command type, NULL if not counted
+   */
+  static const char* name(uint8_t command);
+
+  /**
+   * Records a finished call
+   * @param command POLOLU_COM value, or SSC_COM::SSC_PWM
+   * @param status 1 if the call succeeded
+   */
+  void record(uint8_t command, int status, std::chrono::steady_clock::time_point start){
+    int i = index(command);
+    if(i < 0)
+      return;
+    _latency[i].record(start);
+    if(!status)
+      _failures[i].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void retried(){
+    _retries.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void snapshot(SMCStats &out) const;
+};
+
+/**
+ * Writes stats in the Prometheus text format
+ * The file is replaced in one rename, so a collector never reads half
+ * of it
+ * @param path file to write, e.g. for the node exporter textfile collector
+ * @return 1 if written
+ */
+int writePrometheus(const SMCStats &stats, const char *path);
+
+#endif /* SMC_STATS_H_ */
@@ -0,0 +1,151 @@
+#ifndef SMC_TELEMETRY_CACHE_H_
+#define SMC_TELEMETRY_CACHE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "smc.h"
+
+/**
+ * Devices and variables per device a cache holds, both IDs are 7 bit
+ */
+#define SMC_CACHE_DEVICES 128
+#define SMC_CACHE_VARS 128
+
+/**
+ * What a read does with a cached value older than the caller accepts
+ */
+enum class CACHE_READ: uint8_t {
+  BLOCK,                        /**< Wait for a fresh value */
+  STALE                         /**< Return the old value, refresh in the background */
+};
+
+/**
+ * Counters of a TelemetryCache
+ */
+struct TelemetryCacheStats {
+  uint64_t hits;                /**< Reads served from memory within their max age */
+  uint64_t misses;              /**< Reads that sent a request and waited for it */
+  uint64_t merged;              /**< Reads that waited for a request someone else sent */
+  uint64_t stale;               /**< Reads served an old value while it refreshes */
+  uint64_t refreshes;           /**< Background refreshes sent */
+  uint64_t failures;            /**< Requests that got no answer */
+};
+
+/**
+ * Caches the variables of every device behind an SMC
+ * A read names the oldest value it accepts. A value young enough comes
+ * from memory without a lock or a round trip. Otherwise only one request
+ * per variable is on the wire at a time, every caller that needs the
+ * same variable meanwhile waits for that request instead of sending its
+ * own.
+ *
+ * Values are stamped with the time their request was sent, so an age
+ * is never understated. Read-to-clear variables (ERRORS, SERIAL_ERRORS)
+ * hand the same bits to every caller a read is shared with.
+ *
+ * Invalidating a variable starts a new generation of it. A value read
+ * before then, by a request still on the wire or a poller, is dropped
+ * when it arrives.
+ *
+ * Any thread may read if the SMC runs its I/O thread or a reactor,
+ * otherwise reads must come from one thread at a time like the SMC's.
+ */
+class TelemetryCache {
+private:
+
+  struct Device {
+    std::atomic<uint64_t> entries[SMC_CACHE_VARS];    /**< Stamp << 16 | value, 0 if never read */
+    std::atomic<uint64_t> generations[SMC_CACHE_VARS];  /**< Stamp of the last invalidate, 0 if none */
+    std::atomic<bool> refreshing[SMC_CACHE_VARS];     /**< A request is on the wire */
+    bool failed[SMC_CACHE_VARS];                      /**< Last request got no answer, under lock */
+    std::mutex lock;
+    std::condition_variable refreshed;
+  };
+
+  SMC *_smc;
+  std::atomic<Device*> _devices[SMC_CACHE_DEVICES];      /**< Allocated on first use */
+  std::chrono::steady_clock::time_point _origin;
+
+  std::atomic<int> _background;         /**< Background refreshes not completed */
+  std::mutex _backgroundLock;
+  std::condition_variable _backgroundDone;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+  std::atomic<uint64_t> _merged;
+  std::atomic<uint64_t> _stale;
+  std::atomic<uint64_t> _refreshes;
+  std::atomic<uint64_t> _failures;
+
+  Device* device(uint8_t device);
+  uint64_t stamp(std::chrono::steady_clock::time_point at);
+  void store(Device *dev, uint8_t variableID, uint64_t stamp, uint16_t value);
+  void forget(Device *dev, uint8_t variableID, uint64_t stamp);
+  void finish(Device *dev, uint8_t variableID, uint64_t stamp, int status, uint16_t value);
+  int refresh(uint8_t device, Device *dev, uint8_t variableID, uint64_t oldest, uint16_t &value);
+  int refreshBackground(uint8_t device, Device *dev, uint8_t variableID);
+
+public:
+
+  /**
+   * @param smc controller connection the requests go through
+   */
+  TelemetryCache(SMC *smc);
+
+  /**
+   * Waits for background refreshes still on the wire
+   */
+  ~TelemetryCache();
+
+  TelemetryCache(const TelemetryCache&) = delete;
+  TelemetryCache& operator=(const TelemetryCache&) = delete;
+
+  /**
+   * Reads a variable no older than maxAgeMs
+   * A STALE read of a variable that was never read waits like a BLOCK
+   * read. Without an I/O thread or reactor a background refresh can't
+   * run, STALE reads then wait too.
+   * @param device ID of device
+   * @param variableID ID of variable
+   * @param maxAgeMs oldest acceptable value, 0 always reads the device
+   * @param variableVal returns the value
+   * @param mode what to do with an older value
+   * @return 1 if variableVal was set
+   */
+  int get(uint8_t device, uint8_t variableID, uint32_t maxAgeMs, uint16_t &variableVal,
+          CACHE_READ mode = CACHE_READ::BLOCK);
+
+  /**
+   * Stores a value read some other way, such as by a poller
+   * @param device ID of device
+   * @param variableID ID of variable
+   * @param variableVal value
+   * @param readAt when the request for it was sent
+   */
+  void update(uint8_t device, uint8_t variableID, uint16_t variableVal,
+              std::chrono::steady_clock::time_point readAt);
+
+  /**
+   * Forgets every variable of a device, for example after setMotorLimit
+   * @param device ID of device
+   */
+  void invalidate(uint8_t device);
+
+  /**
+   * Forgets one variable of a device
+   * @param device ID of device
+   * @param variableID ID of variable
+   */
+  void invalidate(uint8_t device, uint8_t variableID);
+
+  /**
+   * Copies the counters
+   */
+  void getStats(TelemetryCacheStats &stats);
+};
+
+#endif /* SMC_TELEMETRY_CACHE_H_ */
@@ -0,0 +1,116 @@
+#ifndef SMC_TIMER_WHEEL_H_
+#define SMC_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+/**
+ * Slots of a TimerWheel, a power of two
+ */
+#define SMC_WHEEL_SLOTS 256
+
+/**
+ * Length of one wheel tick in microseconds
+ */
+#define SMC_WHEEL_TICK_US 1000
+
+/**
+ * Called when a timer expires
+ * @param ctx context pointer given with the timer
+ * @param arg value given with the timer
+ */
+typedef void (*SMCTimerFn)(void *ctx, uint32_t arg);
+
+/**
+ * Hashed timing wheel
+ * A timer goes in the slot of its expiry tick modulo the wheel size and
+ * is fired once the wheel has turned to that tick, timers further out
+ * than one turn wait in their slot until their turn comes. Scheduling
+ * and cancelling are a list insert and unlink on a preallocated node,
+ * so they cost the same whether one or hundreds of timers are pending.
+ * Timers never fire early and at most one tick late.
+ *
+ * Not thread safe, it is meant to be owned by one event loop.
+ */
+class TimerWheel {
+private:
+
+  struct Node {
+    uint64_t tick;                      /**< Expiry tick */
+    uint64_t periodTicks;               /**< 0 for a one shot */
+    SMCTimerFn fn;
+    void *ctx;
+    uint32_t arg;
+    uint16_t generation;                /**< Bumped on free, makes old ids stale */
+    bool pending;                       /**< Allocated */
+    bool linked;                        /**< In a slot list, not taken out to fire */
+    int prev;
+    int next;
+  };
+
+  std::vector<Node> _nodes;
+  int _free;                            /**< Free list through Node::next */
+  int _slots[SMC_WHEEL_SLOTS];          /**< List heads, -1 if empty */
+  uint64_t _occupied[SMC_WHEEL_SLOTS / 64];
+  std::chrono::steady_clock::time_point _origin;
+  uint64_t _tick;                       /**< Next tick to process */
+  int _pending;
+  std::vector<uint32_t> _due;           /**< Ids taken out of a slot to fire */
+
+  uint64_t toTick(std::chrono::steady_clock::time_point at);
+  void link(int node);
+  void unlink(int node);
+  void release(int node);
+  uint32_t add(uint64_t tick, uint64_t periodTicks, SMCTimerFn fn, void *ctx, uint32_t arg);
+  int nextSlot();
+
+public:
+
+  /**
+   * @param capacity most timers pending at once
+   */
+  TimerWheel(int capacity);
+
+  /**
+   * Fires a callback once at a point in time
+   * @return timer id, 0 if the wheel is full
+   */
+  uint32_t schedule(std::chrono::steady_clock::time_point at, SMCTimerFn fn, void *ctx, uint32_t arg);
+
+  /**
+   * Fires a callback every period, the first time one period from now
+   * Expiries are counted from the schedule, a late tick doesn't shift
+   * the ones after it
+   * @param periodUs period in microseconds, at least one tick
+   * @return timer id, 0 if the wheel is full
+   */
+  uint32_t every(long periodUs, SMCTimerFn fn, void *ctx, uint32_t arg);
+
+  /**
+   * Stops a timer, may be called from a timer callback, also for the
+   * timer that is firing
+   * @return 1 if the timer was pending
+   */
+  int cancel(uint32_t id);
+
+  /**
+   * Fires every timer that is due, callbacks may schedule and cancel
+   * but not advance
+   * @return number of callbacks run
+   */
+  int advance(std::chrono::steady_clock::time_point now);
+
+  /**
+   * @return ms until the next occupied slot is due, rounded up, -1 if
+   * no timer is pending. May be early for a timer more than a turn away.
+   */
+  int waitMs(std::chrono::steady_clock::time_point now);
+
+  /**
+   * @return number of pending timers
+   */
+  int pending();
+};
+
+#endif /* SMC_TIMER_WHEEL_H_ */
@@ -0,0 +1,148 @@
+#ifndef SMC_TRAJECTORY_H_
+#define SMC_TRAJECTORY_H_
+
+#include <stdint.h>
+#include <atomic>
+
+#include "smc.h"
+#include "ControlLoop.h"
+
+/**
+ * Shortest step of a streamed trajectory, us
+ */
+#define SMC_TRAJECTORY_MIN_STEP_US 500
+
+/**
+ * Speed and acceleration of one motor of a trajectory
+ */
+struct TrajectoryState {
+  uint8_t device;
+  int16_t target;               /**< Speed asked for */
+  int16_t speed;                /**< Speed of the profile now */
+  double accel;                 /**< Speed units per second */
+};
+
+/**
+ * Jerk limited speed profiles streamed to several motors
+ * Each motor moves toward its target speed with its acceleration
+ * limited and its acceleration changing at most by the jerk limit, an
+ * S-curve instead of the controller's own trapezoidal ramp. Targets and
+ * limits change at any time without a SET_LIMIT round trip.
+ *
+ * The profile is computed one step ahead on a ControlLoop whose period is
+ * the wire time of a frame per motor, within the budget, and each step
+ * goes out as MOTOR_FORWARD or MOTOR_REVERSE frames in one write, so
+ * reversing is just a frame of the other direction. Motors whose speed
+ * didn't change are left out until SMC_SETPOINT_REFRESH_MS has passed.
+ *
+ * The controllers' own acceleration limits should be at least as loose
+ * as these.
+ */
+class Trajectory {
+private:
+
+  struct Motor {
+    uint8_t device;
+    std::atomic<int16_t> target;
+    std::atomic<double> maxAccel;
+    std::atomic<double> maxJerk;
+    double speed;
+    double accel;
+    std::atomic<int16_t> shownSpeed;    /**< speed and accel for other threads */
+    std::atomic<double> shownAccel;
+    int16_t sent;
+    uint64_t sentTick;
+    bool haveSent;
+  };
+
+  SMC *_smc;
+  Motor _motors[SMC_MAX_FLEET];
+  int _count;
+  long _frameUs;                        /**< Wire time of one frame */
+  double _budget;
+  ControlLoop _loop;
+  long _stepUs;
+  uint64_t _lastTick;
+
+  int find(uint8_t device);
+  bool step(Motor &motor, double dt);
+  void tick(uint64_t tick);
+
+public:
+
+  /**
+   * @param smc controller connection of every motor
+   * @param baud baud rate of the link
+   * @param devices IDs of the motors
+   * @param count number of motors, at most SMC_MAX_FLEET
+   */
+  Trajectory(SMC *smc, int baud, const uint8_t *devices, int count);
+
+  /**
+   * Stops streaming
+   */
+  ~Trajectory();
+
+  Trajectory(const Trajectory&) = delete;
+  Trajectory& operator=(const Trajectory&) = delete;
+
+  /**
+   * Limits how fast a motor's speed changes, safe while streaming
+   * @param device ID of device
+   * @param maxAccel speed units per second, 3200 reaches full speed in 1 s
+   * @param maxJerk speed units per second squared, 0 for a trapezoidal ramp
+   * @return 1 if set, 0 if the device is not a motor of the trajectory
+   * or maxAccel is not positive
+   */
+  int setLimits(uint8_t device, double maxAccel, double maxJerk);
+
+  /**
+   * @param share part of the link's bytes the stream may use, 0 to 1
+   * @return 1 if set, 0 while streaming
+   */
+  int setBudget(double share);
+
+  /**
+   * Sets the speed a motor moves to, safe while streaming
+   * @param device ID of device
+   * @param speed -3200 (full reverse) to 3200 (full forward)
+   * @return 1 if set, 0 if out of range or not a motor of the trajectory
+   */
+  int setTarget(uint8_t device, int16_t speed);
+
+  /**
+   * Computes one step of every motor's profile without sending it, for
+   * planning offline, not while streaming
+   * @param dt step length in seconds
+   * @return 1 if every motor is at its target
+   */
+  int advance(double dt);
+
+  /**
+   * Copies the state of a motor
+   * @param device ID of device
+   * @param state ref for the state
+   * @return 1 if set, 0 if not a motor of the trajectory
+   */
+  int getState(uint8_t device, TrajectoryState &state);
+
+  /**
+   * The loop the stream runs on, for its priority, CPU and stats
+   * @return the loop
+   */
+  ControlLoop* getLoop();
+
+  /**
+   * Starts streaming from the speeds the motors have now, 0 unless
+   * advanced before
+   * @return 1 if streaming
+   */
+  int start();
+
+  /**
+   * Stops streaming, the motors keep their last speed
+   */
+  void stop();
+};
+
+#endif /* SMC_TRAJECTORY_H_ */
@@ -0,0 +1,199 @@
+#ifndef SMC_WIRE_RECORDER_H_
+#define SMC_WIRE_RECORDER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "frames.h"
+#include "spsc_queue.h"
+
+/**
+ * Identifies a wire recording, the first bytes of the file
+ */
+#define SMC_WIRE_MAGIC "SMCWIRE1"
+
+/**
+ * Bytes before the first record, one page
+ */
+#define SMC_WIRE_HEADER_BYTES 4096
+
+/**
+ * Most bytes one record holds, longer runs of raw bytes are split
+ */
+#define SMC_WIRE_DATA 12
+
+/**
+ * Device or command of a record that could not be decoded
+ */
+#define SMC_WIRE_UNKNOWN 0xFF
+
+/**
+ * Responses a recorder expects but has not seen yet
+ */
+#define SMC_WIRE_EXPECTED 64
+
+/**
+ * Direction of a recorded frame
+ */
+enum class WIRE_DIR: uint8_t {
+  TX,                           /**< Sent to the controllers */
+  RX                            /**< Received from them */
+};
+
+/**
+ * One frame in a wire recording
+ * A slot is free or being written while seq is 0. Readers copy it and
+ * check seq again, a record overwritten meanwhile is left out.
+ */
+struct WireRecord {
+  std::atomic<uint64_t> seq;    /**< Position in the recording plus one */
+  uint64_t timeNs;              /**< CLOCK_MONOTONIC ns since the recording was opened */
+  uint8_t dir;                  /**< WIRE_DIR */
+  uint8_t device;               /**< ID of device, SMC_BROADCAST for compact frames,
+                                     the servo number for Mini SSC, or SMC_WIRE_UNKNOWN */
+  uint8_t command;              /**< POLOLU_COM, SSC_COM::SSC_PWM or SMC_WIRE_UNKNOWN.
+                                     A response has the command it answers */
+  uint8_t len;                  /**< Bytes in data */
+  char data[SMC_WIRE_DATA];
+};
+
+static_assert(sizeof(WireRecord) == 32, "WireRecord is not 32 bytes");
+
+/**
+ * Start of a wire recording file, records follow at SMC_WIRE_HEADER_BYTES
+ */
+struct WireHeader {
+  char magic[8];                /**< SMC_WIRE_MAGIC without its terminator */
+  uint32_t recordSize;          /**< sizeof(WireRecord) */
+  uint32_t baud;                /**< Baud rate of the port, 0 if unknown */
+  uint64_t capacity;            /**< Records the ring holds */
+  std::atomic<uint64_t> next;   /**< Records ever appended, the oldest kept is next - capacity */
+  int64_t openedNs;             /**< CLOCK_REALTIME ns when the recording was opened */
+};
+
+static_assert(sizeof(WireHeader) <= SMC_WIRE_HEADER_BYTES, "WireHeader does not fit SMC_WIRE_HEADER_BYTES");
+
+/**
+ * A record read back from a wire recording
+ */
+struct WireFrame {
+  uint64_t seq;                 /**< Position in the recording */
+  uint64_t timeNs;              /**< CLOCK_MONOTONIC ns since the recording was opened */
+  WIRE_DIR dir;
+  uint8_t device;               /**< As in WireRecord */
+  uint8_t command;              /**< As in WireRecord */
+  uint8_t len;
+  char data[SMC_WIRE_DATA];
+};
+
+/**
+ * Records every frame crossing a serial port into a memory mapped ring
+ * file
+ * Sent bytes are split into frames and tagged with their device and
+ * command. Received bytes are matched to the requests that expect an
+ * answer, in order, and tagged like them. When a read comes up short the
+ * match starts over, as the I/O paths do.
+ *
+ * Appending takes a slot with one atomic add and writes it in place, no
+ * allocation and no syscall, so it can stay on in production. The
+ * kernel writes the pages back on its own and they survive a crash of
+ * the process. The oldest records are overwritten once the ring is full.
+ *
+ * One thread may send while another receives, as the I/O threads do.
+ */
+class WireRecorder {
+private:
+
+  struct Expected {
+    uint8_t device;
+    uint8_t command;
+    uint8_t left;                       /**< Response bytes still to come */
+  };
+
+  int _fd;
+  size_t _mapLen;
+  WireHeader *_header;
+  WireRecord *_records;
+  uint64_t _capacity;
+  int64_t _originNs;                    /**< CLOCK_MONOTONIC ns of timeNs 0 */
+
+  SpscQueue<Expected, SMC_WIRE_EXPECTED> _expected;  /**< Pushed by the sender, popped by the receiver */
+  Expected _answering;                  /**< Receiver side, the response being read */
+  bool _haveAnswering;
+
+  uint64_t now();
+
+  void append(WIRE_DIR dir, uint8_t device, uint8_t command, const char *data, int len, uint64_t timeNs);
+  void appendRaw(WIRE_DIR dir, const char *data, int len, uint64_t timeNs);
+
+public:
+
+  WireRecorder();
+
+  /**
+   * Unmaps the file, the recording stays on disk
+   */
+  ~WireRecorder();
+
+  WireRecorder(const WireRecorder&) = delete;
+  WireRecorder& operator=(const WireRecorder&) = delete;
+
+  /**
+   * Creates a recording file, replacing any at path
+   * @param path file to map
+   * @param records records the ring holds
+   * @param baud baud rate of the port, stored for replay
+   * @return 1 if open
+   */
+  int open(const std::string &path, size_t records, int baud = 0);
+
+  /**
+   * Unmaps the file, not while a port still records to it
+   */
+  void close();
+
+  /**
+   * @return 1 if a file is mapped
+   */
+  int isOpen();
+
+  /**
+   * Appends bytes written to the port
+   * @param data bytes as written
+   * @param len number of bytes
+   */
+  void sent(const char *data, int len);
+
+  /**
+   * Appends bytes read from the port
+   * @param data bytes as read
+   * @param len number of bytes
+   */
+  void received(const char *data, int len);
+
+  /**
+   * Forgets the answers still expected, after a short read or a flush
+   * of the receive buffer. Call from the receiving thread.
+   */
+  void resync();
+
+  /**
+   * @return records appended since open, including overwritten ones
+   */
+  uint64_t count();
+
+  /**
+   * Reads the records still in a recording, oldest first
+   * Safe while a process is still recording to it, records being
+   * written are left out
+   * @param path recording file
+   * @param frames ref for the records
+   * @param baud ref for the baud rate of the port, 0 if unknown
+   * @return 1 if the file is a recording
+   */
+  static int load(const std::string &path, std::vector<WireFrame> &frames, int &baud);
+};
+
+#endif /* SMC_WIRE_RECORDER_H_ */
@@ -1,101 +1,206 @@
 //
-// blocking_reader.h - a class that provides basic support for  
-// blocking & time-outable single character reads from 
-// boost::asio::serial_port.
+// blocking_reader.h - a class that provides blocking & time-outable
+// bulk reads from boost::asio::serial_port.
 //
 // use like this:
-// 
-// 	blocking_reader reader(port, 500);
 //
-//	char c;
+// 	blocking_reader reader(port, io, 500);
 //
-//	if (!reader.read_char(c))
+//	char buf[4];
+//
+//	if (reader.read(buf, 4) != 4)
 //		return false;
 //
+// A whole response is read under a single deadline. Bytes that arrive
+// beyond the requested length are kept in an internal ring buffer and
+// returned by the next read. A read asks the port for no more than the
+// ring has room for, so nothing is dropped; a request longer than the
+// ring fails outright.
+//
+// Based on the single character reader by
 // Kevin Godden, www.ridgesolutions.ie
 //
 
 #ifndef BLOCKING_READER_H
 #define BLOCKING_READER_H
-#include <boost/asio/serial_port.hpp> 
+#include <boost/asio/serial_port.hpp>
+#include <boost/asio/deadline_timer.hpp>
 #include <boost/bind.hpp>
- 
+
 class blocking_reader
 {
+  static const size_t ring_size = 256;
+
   boost::asio::serial_port * port;
+  boost::asio::io_service & io;
   size_t timeout;
-  char c;
   boost::asio::deadline_timer timer;
+
+  // leftover bytes, head is the next byte to hand out
+  char ring[ring_size];
+  size_t head;
+  size_t count;
+  size_t lost;
+
+  // scratch space for one async_read_some
+  char chunk[64];
+  size_t wanted;
   bool read_error;
- 
+  bool timed_out;
+
+  void push(const char *data, size_t len) {
+    size_t i = 0;
+    for (; i < len && count < ring_size; i++)
+      ring[(head + count++) % ring_size] = data[i];
+    lost += len - i;
+  }
+
+  size_t pop(char *data, size_t len) {
+    size_t n = 0;
+    while (n < len && count > 0) {
+      data[n++] = ring[head];
+      head = (head + 1) % ring_size;
+      count--;
+    }
+    return n;
+  }
+
+  void start_read() {
+    // never more than the ring can take
+    size_t room = ring_size - count;
+    if (room > sizeof(chunk))
+      room = sizeof(chunk);
+    port->async_read_some(boost::asio::buffer(chunk, room),
+                          boost::bind(&blocking_reader::read_complete,
+                                      this,
+                                      boost::asio::placeholders::error,
+                                      boost::asio::placeholders::bytes_transferred));
+  }
+
   // Called when an async read completes or has been cancelled
   void read_complete(const boost::system::error_code& error,
-                     size_t bytes_transferred) {		
- 
-    read_error = (error || bytes_transferred == 0);
-		
+                     size_t bytes_transferred) {
+
+    push(chunk, bytes_transferred);
+
+    if (error) {
+      read_error = true;
+      timer.cancel();
+      return;
+    }
+
+    // Keep reading until the whole response is in,
+    // the deadline is shared by every chunk.
+    if (count < wanted) {
+      start_read();
+      return;
+    }
+
     // Read has finished, so cancel the
     // timer.
     timer.cancel();
   }
- 
-  // Called when the timer's deadline expires.
+
+  // Called when the deadline expires.
   void time_out(const boost::system::error_code& error) {
- 
+
     // Was the timeout was cancelled?
     if (error) {
       // yes
       return;
     }
- 
+
     // no, we have timed out, so kill
     // the read operation
     // The read callback will be called
     // with an error
+    timed_out = true;
     port->cancel();
   }
- 
+
 public:
 
-  // Constructs a blocking reader, pass in an open serial_port and
-  // a timeout in milliseconds.
-  blocking_reader(boost::asio::serial_port * port, size_t timeout) :
-    port(port), timeout(timeout),
-    timer(port->get_io_service()),
-    read_error(true) {
-		 
+  // Constructs a blocking reader, pass in an open serial_port, the
+  // io_service it runs on and a timeout in milliseconds.
+  blocking_reader(boost::asio::serial_port * port,
+                  boost::asio::io_service & io, size_t timeout) :
+    port(port), io(io), timeout(timeout),
+    timer(io),
+    head(0), count(0), lost(0), wanted(0),
+    read_error(false), timed_out(false) {
+
+  }
+
+  // Reads len bytes or times out.
+  // returns the number of bytes read, less than len if the
+  // deadline expired or the port failed first, 0 if len is
+  // more than the ring holds.
+  size_t read(char *buf, size_t len) {
+
+    read_error = timed_out = false;
+
+    if (len > ring_size) {
+      read_error = true;
+      return 0;
+    }
+
+    if (count < len) {
+      wanted = len;
+
+      // After a timeout & cancel it seems we need
+      // to do a reset for subsequent reads to work.
+      io.reset();
+
+      start_read();
+
+      // One deadline for the whole response
+      timer.expires_from_now(boost::posix_time::milliseconds(timeout));
+      timer.async_wait(boost::bind(&blocking_reader::time_out,
+                                   this, boost::asio::placeholders::error));
+
+      // This will block until len bytes are buffered
+      // or until the read is cancelled.
+      io.run();
+    }
+
+    return pop(buf, len);
   }
- 
+
   // Reads a character or times out
   // returns false if the read times out
   bool read_char(char& val) {
-		
-    val = c = '\0';
- 
-    // After a timeout & cancel it seems we need
-    // to do a reset for subsequent reads to work.
-    port->get_io_service().reset();
- 
-    // Asynchronously read 1 character.
-    boost::asio::async_read(*port, boost::asio::buffer(&c, 1), 
-                            boost::bind(&blocking_reader::read_complete, 
-                                        this, 
-                                        boost::asio::placeholders::error, 
-                                        boost::asio::placeholders::bytes_transferred)); 
- 
-    // Setup a deadline time to implement our timeout.
-    timer.expires_from_now(boost::posix_time::milliseconds(timeout));
-    timer.async_wait(boost::bind(&blocking_reader::time_out,
-                                 this, boost::asio::placeholders::error));
- 
-    // This will block until a character is read
-    // or until the it is cancelled.
-    port->get_io_service().run();
- 
-    if (!read_error)
-      val = c;
- 
-    return !read_error;
+    val = '\0';
+    return read(&val, 1) == 1;
+  }
+
+  // true if the last read stopped at the deadline
+  bool last_timed_out() const {
+    return timed_out;
+  }
+
+  // true if the last read stopped on a port error
+  bool last_failed() const {
+    return read_error && !timed_out;
+  }
+
+  // Hands out up to len buffered bytes without reading the port
+  size_t take(char *buf, size_t len) {
+    return pop(buf, len);
+  }
+
+  // Number of bytes buffered but not yet read
+  size_t available() const {
+    return count;
+  }
+
+  // Number of received bytes the ring had no room for
+  size_t dropped() const {
+    return lost;
+  }
+
+  // Drops any buffered bytes
+  void clear() {
+    head = count = 0;
   }
 };
 #endif
@@ -77,7 +77,7 @@ enum class COMPACT_COM_BYTES: uint8_t {
     EXIT_SS                  = 1,               /**< No Data */
     MOTOR_FORWARD            = 3,               /**< Byte1: Low 5 bits of pwm (Spd & 0x1F)
                                                      Byte2: Remaining bits of pwm (Spd >> 5) */
-    MOTOR_REVERSE            = 4,               /**< Byte1: Low 5 bits of pwm (Spd & 0x1F)
+    MOTOR_REVERSE            = 3,               /**< Byte1: Low 5 bits of pwm (Spd & 0x1F)
                                                      Byte2: Remaining bits of pwm (Spd >> 5) */
     MOTOR_FORWARD_7BIT       = 2,               /**< Byte1: Pwm in increments 0-127 (mapped from 0-3200) */
     MOTOR_REVERSE_7BIT       = 2,               /**< Byte1: Pwm in increments 0-127 (mapped from 0-3200) */
@@ -116,12 +116,20 @@ enum class COM_RES_BYTES: uint8_t {
                                                      Byte4: Major Firmware Version (BDC) */
 };
 
+/**
+ * Mini SSC command, addresses a device by its Mini SSC servo number
+ * (device ID plus the controller's Mini SSC offset)
+ */
 enum class SSC_COM: uint8_t {
   SSC_PWM                    = 0XFF             /**< Set Motor Pwm, Direction Based On Value */
 };
 
+/**
+ * Number of bytes of a Mini SSC frame
+ * Includes the command byte itself
+ */
 enum class SSC_COM_BYTES: uint8_t {
-  SSC_PWM                    = 2                /**< Byte1: device ID
+  SSC_PWM                    = 3                /**< Byte1: device ID
                                                      Byte2: Pwm, 0-Full Reverse, 127-Still, 254-Full Forward */
 };
 
@@ -0,0 +1,191 @@
+#ifndef SMC_FRAMES_H_
+#define SMC_FRAMES_H_
+
+#include <stdint.h>
+
+#include "defs.h"
+
+/**
+ * Largest frame the library sends (Pololu format SET_LIMIT)
+ */
+#define SMC_MAX_FRAME 6
+
+/**
+ * Largest response the controller returns (GET_FIRMWARE)
+ */
+#define SMC_MAX_RESPONSE 4
+
+/**
+ * Data byte layouts used by the command set
+ * Data bytes always have bit 7 clear
+ */
+enum class PAYLOAD: uint8_t {
+
+  NONE,                         /**< No data */
+  PWM_14BIT,                    /**< Byte1: Low 5 bits (Val & 0x1F)
+                                     Byte2: Remaining bits (Val >> 5) */
+  BYTE_7BIT,                    /**< Byte1: 7-bit value */
+  LIMIT                         /**< Byte1: Limit ID
+                                     Byte2: Low 7 bits (Val & 0x7F)
+                                     Byte3: High 7 bits (Val >> 7) */
+};
+
+/**
+ * Packs the data bytes of a layout, one specialization per PAYLOAD
+ */
+template <PAYLOAD L> struct Payload;
+
+template <> struct Payload<PAYLOAD::NONE> {
+  static constexpr uint8_t size = 0;
+  static void pack(char *){}
+};
+
+template <> struct Payload<PAYLOAD::PWM_14BIT> {
+  static constexpr uint8_t size = 2;
+  static void pack(char *out, uint16_t val){
+    out[0] = val & 0x1F;
+    out[1] = (val >> 5) & 0x7F;
+  }
+};
+
+template <> struct Payload<PAYLOAD::BYTE_7BIT> {
+  static constexpr uint8_t size = 1;
+  static void pack(char *out, uint8_t val){
+    out[0] = val & 0x7F;
+  }
+};
+
+template <> struct Payload<PAYLOAD::LIMIT> {
+  static constexpr uint8_t size = 3;
+  static void pack(char *out, uint8_t limitID, uint16_t val){
+    out[0] = limitID & 0x7F;
+    out[1] = val & 0x7F;
+    out[2] = (val >> 7) & 0x7F;
+  }
+};
+
+/**
+ * Compile time descriptor of a command
+ * Frame sizes are derived from the payload layout and checked against
+ * the hand written tables in defs.h
+ */
+template <POLOLU_COM C> struct Command;
+
+#define SMC_COMMAND(NAME, LAYOUT)                                               \
+  template <> struct Command<POLOLU_COM::NAME> {                                \
+    static constexpr PAYLOAD layout = PAYLOAD::LAYOUT;                          \
+    static constexpr uint8_t compact = (uint8_t)POLOLU_COM::NAME | 0x80;        \
+    static constexpr uint8_t compactLen = 1 + Payload<PAYLOAD::LAYOUT>::size;   \
+    static constexpr uint8_t pololuLen = 3 + Payload<PAYLOAD::LAYOUT>::size;    \
+    static constexpr uint8_t responseLen = (uint8_t)COM_RES_BYTES::NAME;        \
+    static_assert((uint8_t)COMPACT_COM::NAME == compact,                        \
+                  "COMPACT_COM::" #NAME " is not POLOLU_COM | 0x80");           \
+    static_assert((uint8_t)COMPACT_COM_BYTES::NAME == compactLen,               \
+                  "COMPACT_COM_BYTES::" #NAME " does not match its payload");   \
+    static_assert((uint8_t)POLOLU_COM_BYTES::NAME == pololuLen,                 \
+                  "POLOLU_COM_BYTES::" #NAME " does not match its payload");    \
+    static_assert(pololuLen <= SMC_MAX_FRAME,                                   \
+                  #NAME " does not fit SMC_MAX_FRAME");                         \
+    static_assert(responseLen <= SMC_MAX_RESPONSE,                              \
+                  #NAME " response does not fit SMC_MAX_RESPONSE");             \
+  }
+
+SMC_COMMAND(EXIT_SS, NONE);
+SMC_COMMAND(MOTOR_FORWARD, PWM_14BIT);
+SMC_COMMAND(MOTOR_REVERSE, PWM_14BIT);
+SMC_COMMAND(MOTOR_FORWARD_7BIT, BYTE_7BIT);
+SMC_COMMAND(MOTOR_REVERSE_7BIT, BYTE_7BIT);
+SMC_COMMAND(MOTOR_BRAKE, BYTE_7BIT);
+SMC_COMMAND(MOTOR_STOP, NONE);
+SMC_COMMAND(SET_LIMIT, LIMIT);
+SMC_COMMAND(GET_SMC_VAR, BYTE_7BIT);
+SMC_COMMAND(GET_FIRMWARE, NONE);
+
+#undef SMC_COMMAND
+
+/**
+ * Runtime lookup of a command's sizes, for decoding frames
+ * @param command POLOLU_COM value
+ * @param payload ref for the data bytes after the command byte
+ * @param response ref for the response length
+ * @return 1 if the command is known
+ */
+inline int commandSizes(uint8_t command, int &payload, int &response){
+  switch((POLOLU_COM)command){
+#define SMC_SIZES(NAME)                                                         \
+  case POLOLU_COM::NAME:                                                        \
+    payload = Command<POLOLU_COM::NAME>::compactLen - 1;                        \
+    response = Command<POLOLU_COM::NAME>::responseLen;                          \
+    return 1;
+  SMC_SIZES(EXIT_SS)
+  SMC_SIZES(MOTOR_FORWARD)
+  SMC_SIZES(MOTOR_REVERSE)
+  SMC_SIZES(MOTOR_FORWARD_7BIT)
+  SMC_SIZES(MOTOR_REVERSE_7BIT)
+  SMC_SIZES(MOTOR_BRAKE)
+  SMC_SIZES(MOTOR_STOP)
+  SMC_SIZES(SET_LIMIT)
+  SMC_SIZES(GET_SMC_VAR)
+  SMC_SIZES(GET_FIRMWARE)
+#undef SMC_SIZES
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @return data bytes of a command, -1 if the command is unknown
+ */
+inline int payloadLen(uint8_t command){
+  int payload, response;
+  return commandSizes(command, payload, response) ? payload : -1;
+}
+
+/**
+ * Encodes a compact format frame, which reaches every device
+ * The data arguments must match the command's payload layout
+ * @param frame at least Command<C>::compactLen bytes
+ * @return frame length
+ */
+template <POLOLU_COM C, typename... Data>
+inline int encodeCompact(char *frame, Data... data){
+  frame[0] = (char)Command<C>::compact;
+  Payload<Command<C>::layout>::pack(frame + 1, data...);
+  return Command<C>::compactLen;
+}
+
+/**
+ * Encodes a Pololu format frame for a single device
+ * The data arguments must match the command's payload layout
+ * @param frame at least Command<C>::pololuLen bytes
+ * @param device ID of device, 0-127
+ * @return frame length
+ */
+template <POLOLU_COM C, typename... Data>
+inline int encodePololu(char *frame, uint8_t device, Data... data){
+  frame[0] = (char)POLOLU_COM::HEADER;
+  frame[1] = device & 0x7F;
+  frame[2] = (char)C;
+  Payload<Command<C>::layout>::pack(frame + 3, data...);
+  return Command<C>::pololuLen;
+}
+
+static_assert((uint8_t)SSC_COM_BYTES::SSC_PWM <= SMC_MAX_FRAME, "SSC_PWM does not fit SMC_MAX_FRAME");
+
+/**
+ * Encodes a Mini SSC frame
+ * Speed is scaled to 8 bits, 0 full reverse, 127 still, 254 full forward
+ * @param frame at least SSC_COM_BYTES::SSC_PWM bytes
+ * @param servo Mini SSC servo number, 0-254
+ * @param speed -3200 (full reverse) to 3200 (full forward)
+ * @return frame length
+ */
+inline int encodeSsc(char *frame, uint8_t servo, int16_t speed){
+  frame[0] = (char)SSC_COM::SSC_PWM;
+  frame[1] = servo;
+  // round to the nearest of the 127 steps each way
+  frame[2] = 127 + (speed * 127 + (speed < 0 ? -1600 : 1600)) / 3200;
+  return (int)SSC_COM_BYTES::SSC_PWM;
+}
+
+#endif /* SMC_FRAMES_H_ */
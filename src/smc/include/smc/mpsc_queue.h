@@ -0,0 +1,121 @@
+#ifndef SMC_MPSC_QUEUE_H_
+#define SMC_MPSC_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Bounded lock-free FIFO for any number of producer threads and one
+ * consumer thread. Holds at most N items, N must be a power of two.
+ * Each cell carries a sequence number that tells producers and the
+ * consumer whose turn it is, so neither side ever takes a lock.
+ */
+template <typename T, size_t N>
+class MpscQueue {
+private:
+
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "MpscQueue size must be a power of two");
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  Cell _cells[N];
+  std::atomic<size_t> _tail;    /**< Next position to claim, shared by producers */
+  size_t _head;                 /**< Next position to pop, consumer only */
+
+public:
+
+  MpscQueue()
+    :_tail(0),
+     _head(0)
+  {
+    for(size_t i = 0; i < N; i++)
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  /**
+   * Appends an item, any thread
+   * @return false if the queue is full
+   */
+  bool push(const T &item){
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    for(;;){
+      Cell &cell = _cells[pos & (N - 1)];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if(diff == 0){
+        if(_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+          cell.item = item;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if(diff < 0)
+        return false;
+      else
+        pos = _tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Appends several items as one run, any thread
+   * The positions are claimed together, so no other producer's item
+   * can land between them
+   * @return false if the queue doesn't have room for all of them
+   */
+  bool push(const T *items, size_t n){
+    if(!n || n > N)
+      return !n;
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    for(;;){
+      Cell &cell = _cells[pos & (N - 1)];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if(diff == 0){
+        // the consumer frees cells in order, so the last one being free
+        // means the ones before it are too
+        size_t last = _cells[(pos + n - 1) & (N - 1)].seq.load(std::memory_order_acquire);
+        if((intptr_t)last - (intptr_t)(pos + n - 1) < 0)
+          return false;
+        if(_tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)){
+          for(size_t i = 0; i < n; i++){
+            Cell &claimed = _cells[(pos + i) & (N - 1)];
+            claimed.item = items[i];
+            claimed.seq.store(pos + i + 1, std::memory_order_release);
+          }
+          return true;
+        }
+      }
+      else if(diff < 0)
+        return false;
+      else
+        pos = _tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Removes the oldest item, consumer only
+   * @return false if the queue is empty
+   */
+  bool pop(T &item){
+    Cell &cell = _cells[_head & (N - 1)];
+    if(cell.seq.load(std::memory_order_acquire) != _head + 1)
+      return false;
+    item = cell.item;
+    cell.seq.store(_head + N, std::memory_order_release);
+    _head++;
+    return true;
+  }
+
+  /**
+   * @return true if the consumer has nothing to pop, consumer only
+   */
+  bool empty() const {
+    return _cells[_head & (N - 1)].seq.load(std::memory_order_acquire) != _head + 1;
+  }
+};
+
+#endif /* SMC_MPSC_QUEUE_H_ */
@@ -1,158 +1,482 @@
-#ifndef SMC_H_
-#define SMC_H_
-
-#include "SerialPort.h"
-#include "defs.h"
-#include <string>
-
-class SMC {
-private:
-
-  SerialPort* _conn; /**< Serial Port for SMC communication */
-  char _buffer[6];
-
-  void initPololuMsg(uint8_t device){
-    _buffer[0] = (char)POLOLU_COM::HEADER;
-    _buffer[1] = device;
-  };
-
-public:
-
-  /**
-   *Default ctor
-   */
-  SMC();
-  
-  /**
-   * Initialize SMC
-   * @param conn Reference to an open serial port
-   */
-  SMC(SerialPort* conn);
-
-  /**
-   * Add a serial port reference
-   * @param conn reference to an open serial port
-   */
-  void setPort(SerialPort* conn);
-
-  /**
-   * Sends the exit safe start command to all devices
-   * @return 1 if successfully sent
-   */
-  int exitSafeStart();
-  
-  /**
-   * Sends the exit safe start command to specified devices
-   * @param uint8_t ID of device
-   * @return 1 if successfully sent
-   */
-  int exitSafeStart(uint8_t device);
-
-  /**
-   * Sends forward pwm value to all devices
-   * @param pwm value between 0-3200
-   */
-  int motorForward(uint16_t pwm );
-
-  /**
-   * Sends forward pwm value to specified device
-   * @param uint8_t ID of device
-   * @param pwm value between 0-3200
-   */
-  int motorForward(uint8_t device, uint16_t pwm);
-
-  /**
-   * Sends reverse  pwm value to all devices
-   * @param pwm value between 0-3200
-   */
-  int motorReverse(uint16_t pwm);
-
-  /**
-   * Sends reverse  pwm value to specified device
-   * @param uint8_t ID of device
-   * @param pwm value between 0-3200
-   */
-  int motorReverse(uint8_t device, uint16_t pwm);
-
-  /**
-   * Sends low resolution forward pwm value to all devices
-   * @param pwm value between 0-127
-   */
-  int motorForward_7Bit(uint8_t pwm );
-
-  /**
-   * Sends low resolution forward pwm value to specified device
-   * @param uint8_t ID of device
-   * @param pwm value between 0-127
-   */
-  int motorForward_7Bit(uint8_t device, uint8_t pwm);
-
-  /**
-   * Sends low resolution reverse  pwm value to all devices
-   * @param pwm value between 0-127
-   */
-  int motorReverse_7Bit(uint8_t pwm);
-
-  /**
-   * Sends low resolution reverse  pwm value to specified device
-   * @param uint8_t ID of device
-   * @param pwm value between 0-127
-   */
-  int motorReverse_7Bit(uint8_t device, uint8_t pwm);
-
-  /**
-   * Sends motor brake duty cycle to all devices
-   * @param Duty cycle value between 1-32
-   */
-  int motorBrake(uint8_t duty);
-
-  /**
-   * Sends motor brake duty cycle to specified device
-   * @param uint8_t ID of device
-   * @param Duty cycle value between 1-32
-   */
-  int motorBrake(uint8_t device, uint8_t duty);
-
-  /**
-   * Sends stop command to all devices
-   * Enters safe start mode
-   */
-  int motorStop();
-  
-  /**
-   * Sends stop command to specified device
-   * Enters safe start mode
-   * @param uint8_t ID of device
-   */
-  int motorStop(uint8_t device);
-
-  /**
-   * Sends a set limit command to all devices
-   * @param uint8_t ID of device
-   * @param uint8_t ID of limit 
-   * @param limit value
-   * @param uint8_t ref response code
-   * @return 1 if success, 0 if failed to send
-   */
-  int setMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, uint8_t &responseCode);
-
-  /**
-   * Reads the specified variable on a specific device 
-   * @param uint8_t ID of device
-   * @param uint8_t ID of variable
-   */
-  int getMotorVariable(uint8_t device, uint8_t variableID, uint16_t &variableVal);
-
-  /**
-   * Reads the firmware version of a specific device
-   * @param uint8_t ID of device
-   * @param uint16_t ref for product ID
-   * @param uint8_t ref for major version number (BCD)
-   * @param uint8_t ref for minor version number (BCD)
-   * @return 1 if success
-   */
-  int getFirmwareVersion(uint8_t device, uint16_t &productID, uint8_t &majorVersion, uint8_t &minorVersion);
-  
-};
-
-#endif /* SMC_H_ */
+#ifndef SMC_H_
+#define SMC_H_
+
+#include "SerialPort.h"
+#include "Dispatcher.h"
+#include "SerialReactor.h"
+#include "defs.h"
+#include "frames.h"
+#include "Stats.h"
+#include "SetpointEncoder.h"
+#include <string>
+#include <future>
+#include <functional>
+
+/**
+ * Maximum number of variables read by a single getMotorVariables call
+ */
+#define SMC_MAX_BATCH_VARS 32
+
+/**
+ * Snapshot of the status and diagnostic variables of a device
+ * Filled by SMC::getTelemetry with a single pipelined read
+ */
+struct SMCTelemetry {
+  uint16_t errorStatus;         /**< SMC_VAR::ERROR_STATUS bitmask */
+  uint16_t limitStatus;         /**< SMC_VAR::LIMIT_STATUS bitmask */
+  int16_t targetPwm;            /**< -3200 to +3200 */
+  int16_t currentPwm;           /**< -3200 to +3200 */
+  uint16_t brakeAmount;         /**< 0-32 */
+  uint16_t inputVoltage;        /**< mV */
+  uint16_t temperature;         /**< 0.1 C */
+  uint32_t systemTime;          /**< ms since last reset */
+};
+
+/**
+ * Most setpoints sent by a single setFleetSpeeds call
+ */
+#define SMC_MAX_FLEET 32
+
+/**
+ * Speed of one device in a fleet update
+ */
+struct SMCSetpoint {
+  uint8_t device;               /**< ID of device */
+  int16_t speed;                /**< -3200 (full reverse) to 3200 (full forward) */
+};
+
+/**
+ * Frame format of a fleet update
+ */
+enum class FLEET_FORMAT: uint8_t {
+  MINI_SSC,                     /**< 3 bytes per device, 8-bit resolution */
+  POLOLU                        /**< 5 bytes per device, full resolution */
+};
+
+/**
+ * Time a scan waits for answers beyond their wire time, microseconds.
+ * Covers the controllers' reply delay and a USB adapter's default 16 ms
+ * latency timer, a native UART or low latency port can pass far less.
+ */
+#define SMC_SCAN_SLACK_US 20000
+
+/**
+ * Times a scan probes a single ID again when its answer is short or
+ * garbled
+ */
+#define SMC_SCAN_RETRIES 2
+
+/**
+ * A device found by SMC::scan
+ */
+struct SMCDeviceInfo {
+  uint8_t device;               /**< ID of device */
+  uint16_t productID;
+  uint16_t version;             /**< Firmware version in BCD, 0x0104 for 1.04 */
+};
+
+/**
+ * Result of an asynchronous call
+ */
+struct SMCValue {
+  int status;                   /**< 1 if success */
+  uint16_t value;               /**< Variable value or limit response code */
+};
+
+/**
+ * Completion of an asynchronous call, runs on the I/O thread
+ * @param status 1 if success
+ * @param value variable value or limit response code
+ */
+typedef std::function<void(int status, uint16_t value)> SMCValueCallback;
+
+/**
+ * Pololu Simple Motor Controller protocol over a serial port
+ * Every call encodes its frame on its own stack. With the I/O thread
+ * running one instance can be shared by any number of threads, calls
+ * go through the dispatcher's lock-free submission queue and blocking
+ * calls don't allocate. Without it, calls go straight to the port and
+ * must come from one thread at a time.
+ */
+class SMC {
+private:
+
+  SerialPort* _conn; /**< Serial Port for SMC communication */
+  Dispatcher* _dispatcher; /**< I/O thread, NULL until started */
+  SerialReactor* _reactor; /**< Shared reactor, NULL if not used */
+  int _reactorPort; /**< Index of the port in _reactor */
+  uint8_t _sscOffset; /**< Mini SSC servo number of device 0 */
+  int _retries; /**< Times a failed request is sent again */
+  CommandMetrics _metrics; /**< Per command latency and failures */
+  SetpointEncoder _encoder; /**< Frame choice and last speeds of setSpeed */
+
+  bool queued();
+  int submit(const SMCRequest &req);
+  int submit(const SMCRequest *reqs, int count);
+  int exchange(const char *frames, int frameLen, int count, char *response, int responseLen);
+  int transfer(const char *frames, int frameLen, int count, char *response, int responseLen);
+  int send(const char *frame, int len);
+  int store(uint8_t slot, const char *frame, int len);
+  int setpoint(uint8_t slot, const char *frame, int len);
+  int urgent(uint8_t slot, const char *frame, int len);
+  int request(const char *frame, int len, char *response, int responseLen);
+
+  struct Scan {
+    SMCDeviceInfo *found;
+    int room;
+    int count;
+    long slackUs;
+  };
+  int probe(uint8_t first, uint8_t last, char *answers, long slackUs);
+  void scanRange(uint8_t first, uint8_t last, int answered, const char *answers, Scan &scan);
+
+public:
+
+  /**
+   *Default ctor
+   */
+  SMC();
+  
+  /**
+   * Initialize SMC
+   * @param conn Reference to an open serial port
+   */
+  SMC(SerialPort* conn);
+
+  /**
+   * Stops the I/O thread if running
+   */
+  ~SMC();
+
+  /**
+   * Add a serial port reference
+   * @param conn reference to an open serial port
+   */
+  void setPort(SerialPort* conn);
+
+  /**
+   * Starts a background I/O thread that owns the serial port
+   * Once running every call, blocking or not, is sent from that thread
+   * Async completions run on that thread and must not make blocking calls
+   * Speed and brake commands return once stored, only the newest
+   * pending one per device is sent
+   * Stop and brake commands preempt all other pending output
+   * @return 1 if the thread is running
+   */
+  int startIoThread();
+
+  /**
+   * @return the I/O thread, NULL if it was never started
+   */
+  Dispatcher* getDispatcher();
+
+  /**
+   * Stops the background I/O thread, pending async calls fail
+   */
+  void stopIoThread();
+
+  /**
+   * Sends every call through a port of a reactor shared with other
+   * controllers, instead of the serial port or the I/O thread
+   * Async completions run on the reactor thread and must not make
+   * blocking calls. Speed and brake commands are queued in order, they
+   * are not coalesced.
+   * @param reactor running reactor, NULL to go back to the serial port
+   * @param port index returned by SerialReactor::addPort
+   */
+  void setReactor(SerialReactor* reactor, int port);
+
+  /**
+   * Reads a device's error status every period on the reactor, so the
+   * link is never idle for longer than its serial command timeout
+   * The reads prove the link, not the caller, a stalled control loop
+   * still needs its own watchdog
+   * @param uint8_t ID of device
+   * @param periodMs period in milliseconds
+   * @return id for stopKeepAlive, 0 without a reactor
+   */
+  int keepAlive(uint8_t device, size_t periodMs);
+
+  /**
+   * Stops a keepalive
+   * @param id returned by keepAlive
+   */
+  void stopKeepAlive(int id);
+
+  /**
+   * Sends the exit safe start command to all devices
+   * @return 1 if successfully sent
+   */
+  int exitSafeStart();
+  
+  /**
+   * Sends the exit safe start command to specified devices
+   * @param uint8_t ID of device
+   * @return 1 if successfully sent
+   */
+  int exitSafeStart(uint8_t device);
+
+  /**
+   * Sends forward pwm value to all devices
+   * @param pwm value between 0-3200
+   */
+  int motorForward(uint16_t pwm );
+
+  /**
+   * Sends forward pwm value to specified device
+   * @param uint8_t ID of device
+   * @param pwm value between 0-3200
+   */
+  int motorForward(uint8_t device, uint16_t pwm);
+
+  /**
+   * Sends reverse  pwm value to all devices
+   * @param pwm value between 0-3200
+   */
+  int motorReverse(uint16_t pwm);
+
+  /**
+   * Sends reverse  pwm value to specified device
+   * @param uint8_t ID of device
+   * @param pwm value between 0-3200
+   */
+  int motorReverse(uint8_t device, uint16_t pwm);
+
+  /**
+   * Sends low resolution forward pwm value to all devices
+   * @param pwm value between 0-127
+   */
+  int motorForward_7Bit(uint8_t pwm );
+
+  /**
+   * Sends low resolution forward pwm value to specified device
+   * @param uint8_t ID of device
+   * @param pwm value between 0-127
+   */
+  int motorForward_7Bit(uint8_t device, uint8_t pwm);
+
+  /**
+   * Sends low resolution reverse  pwm value to all devices
+   * @param pwm value between 0-127
+   */
+  int motorReverse_7Bit(uint8_t pwm);
+
+  /**
+   * Sends low resolution reverse  pwm value to specified device
+   * @param uint8_t ID of device
+   * @param pwm value between 0-127
+   */
+  int motorReverse_7Bit(uint8_t device, uint8_t pwm);
+
+  /**
+   * Sends motor brake duty cycle to all devices
+   * @param Duty cycle value between 1-32
+   */
+  int motorBrake(uint8_t duty);
+
+  /**
+   * Sends motor brake duty cycle to specified device
+   * @param uint8_t ID of device
+   * @param Duty cycle value between 1-32
+   */
+  int motorBrake(uint8_t device, uint8_t duty);
+
+  /**
+   * Sends stop command to all devices
+   * Enters safe start mode
+   * Preempts and discards pending output
+   */
+  int motorStop();
+  
+  /**
+   * Sends stop command to specified device
+   * Enters safe start mode
+   * @param uint8_t ID of device
+   */
+  int motorStop(uint8_t device);
+
+  /**
+   * Sets the Mini SSC offset configured on the controllers
+   * Mini SSC frames address device ID + offset, default 0
+   * @param offset servo number of device 0, 0-254
+   */
+  void setMiniSscOffset(uint8_t offset);
+
+  /**
+   * Sends the speed of several devices back to back in a single write
+   * With the I/O thread running they replace its pending group and
+   * still leave in one write, on a reactor they are queued as one run
+   * that nothing else on the port gets between
+   * @param setpoints array of count device and speed pairs
+   * @param count number of setpoints, at most SMC_MAX_FLEET
+   * @param format frame format, MINI_SSC uses the fewest bytes
+   * @return number of bytes sent or stored, 0 if a speed is out of range
+   * or a Mini SSC servo number, ID plus offset, is past 254
+   */
+  int setFleetSpeeds(const SMCSetpoint *setpoints, int count, FLEET_FORMAT format);
+
+  /**
+   * Sets the speed of every device with the shortest frame the
+   * setpoint encoder allows, left out if they already have it
+   * @param speed -3200 (full reverse) to 3200 (full forward)
+   * @return 1 if sent, stored or left out, 0 if out of range or failed
+   */
+  int setSpeed(int16_t speed);
+
+  /**
+   * Sets the speed of a device with the shortest frame the setpoint
+   * encoder allows, left out if it already has it
+   * @param uint8_t ID of device
+   * @param speed -3200 (full reverse) to 3200 (full forward)
+   * @return 1 if sent, stored or left out, 0 if out of range or failed
+   */
+  int setSpeed(uint8_t device, int16_t speed);
+
+  /**
+   * Sets the speed of several devices with the shortest frames the
+   * setpoint encoder allows, a single compact frame if they are the
+   * encoder's whole bus
+   * @param devices IDs of devices
+   * @param count number of devices, at most SMC_MAX_SETPOINT_DEVICES
+   * @param speed -3200 (full reverse) to 3200 (full forward)
+   * @return 1 if sent, stored or left out, 0 if out of range or failed
+   */
+  int setSpeed(const uint8_t *devices, int count, int16_t speed);
+
+  /**
+   * @return the encoder setSpeed uses, for its tolerance, refresh time,
+   * bus and Mini SSC settings
+   */
+  SetpointEncoder* getSetpointEncoder();
+
+  /**
+   * Sends a set limit command to all devices
+   * @param uint8_t ID of device
+   * @param uint8_t ID of limit 
+   * @param limit value
+   * @param uint8_t ref response code
+   * @return 1 if success, 0 if failed to send
+   */
+  int setMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, uint8_t &responseCode);
+
+  /**
+   * Reads the specified variable on a specific device 
+   * @param uint8_t ID of device
+   * @param uint8_t ID of variable
+   */
+  int getMotorVariable(uint8_t device, uint8_t variableID, uint16_t &variableVal);
+
+  /**
+   * Reads several variables on a specific device in one round trip
+   * All requests are written at once and all responses read at once
+   * @param uint8_t ID of device
+   * @param variableIDs array of count variable IDs
+   * @param count number of variables, at most SMC_MAX_BATCH_VARS
+   * @param variableVals array of count values, filled in request order
+   * @return 1 if every value was read, 0 otherwise
+   */
+  int getMotorVariables(uint8_t device, const uint8_t *variableIDs, int count, uint16_t *variableVals);
+
+  /**
+   * Reads the status and diagnostic variables of a specific device
+   * @param uint8_t ID of device
+   * @param SMCTelemetry ref for the snapshot
+   * @return 1 if success
+   */
+  int getTelemetry(uint8_t device, SMCTelemetry &telemetry);
+
+  /**
+   * Reads the firmware version of a specific device
+   * @param uint8_t ID of device
+   * @param uint16_t ref for product ID
+   * @param uint8_t ref for major version number (BCD)
+   * @param uint8_t ref for minor version number (BCD)
+   * @return 1 if success
+   */
+  int getFirmwareVersion(uint8_t device, uint16_t &productID, uint8_t &majorVersion, uint8_t &minorVersion);
+
+  /**
+   * Finds the devices on the line
+   * GET_FIRMWARE probes for a range of IDs go out back to back in one
+   * write under a single deadline. A range without answers is ruled out
+   * at once, one with answers is split in halves until every answer comes
+   * from a single ID, so answers of neighbouring IDs that overlap or
+   * collide only cost a split. A half is not probed when the other half
+   * already accounts for the range's only answer.
+   * An ID whose answer stays garbled, two devices set to it, is left out.
+   * Not while the I/O thread or a reactor runs the port.
+   * @param found room for the devices found, in ID order
+   * @param room most devices to return
+   * @param first lowest ID to probe
+   * @param last highest ID to probe, at most 127
+   * @param slackUs time to wait for answers beyond their wire time
+   * @return number of devices found, -1 if the port is in use or closed
+   */
+  int scan(SMCDeviceInfo *found, int room, uint8_t first = 0, uint8_t last = 127,
+           long slackUs = SMC_SCAN_SLACK_US);
+
+  /**
+   * Reads the specified variable on a specific device without blocking
+   * Requires the I/O thread
+   * @param uint8_t ID of device
+   * @param uint8_t ID of variable
+   * @param done called on the I/O thread with the status and value
+   * @return 1 if queued, 0 if the I/O thread is not running
+   */
+  int asyncGetMotorVariable(uint8_t device, uint8_t variableID, SMCValueCallback done);
+
+  /**
+   * Reads the specified variable on a specific device without blocking
+   * Requires the I/O thread
+   * @param uint8_t ID of device
+   * @param uint8_t ID of variable
+   * @return future holding the status and value
+   */
+  std::future<SMCValue> asyncGetMotorVariable(uint8_t device, uint8_t variableID);
+
+  /**
+   * Sends a set limit command to a specific device without blocking
+   * Requires the I/O thread
+   * @param uint8_t ID of device
+   * @param uint8_t ID of limit
+   * @param limit value
+   * @param done called on the I/O thread with the status and response code
+   * @return 1 if queued, 0 if the I/O thread is not running
+   */
+  int asyncSetMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, SMCValueCallback done);
+
+  /**
+   * Sends a set limit command to a specific device without blocking
+   * Requires the I/O thread
+   * @param uint8_t ID of device
+   * @param uint8_t ID of limit
+   * @param limit value
+   * @return future holding the status and response code
+   */
+  std::future<SMCValue> asyncSetMotorLimit(uint8_t device, uint8_t limitID, uint16_t val);
+
+  /**
+   * Sets how many times a request whose response is missing or short
+   * is sent again, 0 by default
+   * Applies to blocking calls with a response, which are all safe to repeat
+   * @param retries extra attempts per call
+   */
+  void setRetries(int retries);
+
+  /**
+   * Copies the counters of this instance and its serial port
+   * Lock free, cheap enough to call from a control loop
+   * @param stats filled with the counters
+   */
+  void getStats(SMCStats &stats);
+
+  /**
+   * Writes the counters in the Prometheus text format
+   * @param path file to replace
+   * @return 1 if written
+   */
+  int writeStats(const std::string &path);
+
+};
+
+#endif /* SMC_H_ */
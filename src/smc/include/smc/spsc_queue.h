@@ -0,0 +1,62 @@
+#ifndef SMC_SPSC_QUEUE_H_
+#define SMC_SPSC_QUEUE_H_
+
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Bounded lock-free FIFO for exactly one producer thread and one
+ * consumer thread. Holds at most N items.
+ */
+template <typename T, size_t N>
+class SpscQueue {
+private:
+
+  T _items[N];
+  std::atomic<size_t> _head;    /**< Next item to pop, written by the consumer */
+  std::atomic<size_t> _tail;    /**< Next free slot, written by the producer */
+
+public:
+
+  SpscQueue()
+    :_head(0),
+     _tail(0)
+  {
+  }
+
+  /**
+   * Appends an item, producer only
+   * @return false if the queue is full
+   */
+  bool push(const T &item){
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if(tail - _head.load() == N)
+      return false;
+    _items[tail % N] = item;
+    _tail.store(tail + 1);
+    return true;
+  }
+
+  /**
+   * Removes the oldest item, consumer only
+   * @return false if the queue is empty
+   */
+  bool pop(T &item){
+    size_t head = _head.load(std::memory_order_relaxed);
+    if(head == _tail.load())
+      return false;
+    item = _items[head % N];
+    _head.store(head + 1);
+    return true;
+  }
+
+  bool empty() const {
+    return _head.load() == _tail.load();
+  }
+
+  bool full() const {
+    return _tail.load() - _head.load() == N;
+  }
+};
+
+#endif /* SMC_SPSC_QUEUE_H_ */
@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/serial_port.hpp>
+
+#include "smc/blocking_reader.h"
+#include "SerialBackend.h"
+
+namespace {
+
+/**
+ * Serial port on boost::asio, reads run the io_service under a deadline
+ */
+class AsioSerial : public SerialBackend {
+private:
+  boost::asio::io_service io;
+  boost::asio::serial_port port;
+  blocking_reader *reader;
+
+public:
+
+  AsioSerial()
+    :port(io),
+     reader(NULL)
+  {
+  }
+
+  ~AsioSerial(){
+    close();
+  }
+
+  int open(const std::string &device, int baud, size_t timeout){
+    try{
+      close();
+      port.open(device);
+      port.set_option(boost::asio::serial_port_base::baud_rate(baud));
+      reader = new blocking_reader(&port, io, timeout);
+      return 1;
+    }
+    catch(...){
+      return 0;
+    }
+  }
+
+  void close(){
+    delete reader;
+    reader = NULL;
+    boost::system::error_code ignored;
+    port.close(ignored);
+  }
+
+  int isOpen(){
+    return port.is_open();
+  }
+
+  /**
+   * Writes to the descriptor, not through asio, so a writer thread never
+   * touches the serial_port a reader thread runs the io_service on
+   */
+  int write(const char *buffer, int len){
+
+    int fd = port.native_handle();
+    int sent = 0;
+    while(sent < len){
+      ssize_t n = ::write(fd, buffer + sent, len - sent);
+      if(n > 0){
+        sent += n;
+        continue;
+      }
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n < 0 && errno != EAGAIN)
+        break;
+      // asio may have made the descriptor non-blocking, wait for room
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        break;
+    }
+    return sent;
+  }
+
+  int read(char *buffer, int len){
+    if(!reader)
+      return 0;
+    return reader->read(buffer, len);
+  }
+
+  int takeBuffered(char *buffer, int len){
+    return reader && len > 0 ? reader->take(buffer, len) : 0;
+  }
+
+  int lastReadTimedOut(){
+    return reader && reader->last_timed_out();
+  }
+
+  void flush(int what){
+    ::tcflush(port.native_handle(), what);
+    // bytes already pulled off the port count as received
+    if(reader && what != TCOFLUSH)
+      reader->clear();
+  }
+
+  void drain(){
+    ::tcdrain(port.native_handle());
+  }
+
+  int fd(){
+    return port.is_open() ? port.native_handle() : -1;
+  }
+};
+
+}
+
+/**
+ * boost::asio backend
+ */
+SerialBackend* createAsioBackend(){
+  return new AsioSerial();
+}
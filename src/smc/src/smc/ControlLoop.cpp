@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "smc/ControlLoop.h"
+
+/**
+ * @return CLOCK_MONOTONIC in ns
+ */
+static int64_t monotonicNs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Sleeps until an absolute CLOCK_MONOTONIC time in ns
+ */
+static void sleepUntil(int64_t ns){
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000LL;
+  ts.tv_nsec = ns % 1000000000LL;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+  }
+}
+
+/**
+ * @param periodUs time between ticks, microseconds
+ */
+ControlLoop::ControlLoop(long periodUs)
+  :_periodUs(periodUs),
+   _priority(0),
+   _cpu(-1),
+   _lockMemory(false),
+   _smc(NULL),
+   _phaseUs(0),
+   _format(FLEET_FORMAT::POLOLU),
+   _stagedCount(0),
+   _running(false),
+   _setup(-1),
+   _ticks(0),
+   _overruns(0),
+   _skipped(0),
+   _lateSends(0),
+   _sendFailures(0),
+   _maxJitterUs(0)
+{
+}
+
+/**
+ * Stops the loop
+ */
+ControlLoop::~ControlLoop(){
+  stop();
+}
+
+/**
+ * @param periodUs time between ticks, microseconds
+ * @return 1 if set, 0 while running or out of range
+ */
+int ControlLoop::setPeriod(long periodUs){
+  if(_running || periodUs <= 0 || (_smc && periodUs <= _phaseUs))
+    return 0;
+  _periodUs = periodUs;
+  return 1;
+}
+
+/**
+ * @param tick called once per period on the loop thread
+ * @return 1 if set, 0 while running
+ */
+int ControlLoop::setTick(ControlTick tick){
+  if(_running)
+    return 0;
+  _tick = tick;
+  return 1;
+}
+
+/**
+ * @param priority SCHED_FIFO priority 1-99, 0 for the default policy
+ * @return 1 if set, 0 while running or out of range
+ */
+int ControlLoop::setPriority(int priority){
+  if(_running || priority < 0 || priority > 99)
+    return 0;
+  _priority = priority;
+  return 1;
+}
+
+/**
+ * @param cpu CPU number, -1 for any
+ * @return 1 if set, 0 while running
+ */
+int ControlLoop::setCpu(int cpu){
+  if(_running || cpu < -1 || cpu >= CPU_SETSIZE)
+    return 0;
+  _cpu = cpu;
+  return 1;
+}
+
+/**
+ * @param enabled lock all memory of the process on start
+ * @return 1 if set, 0 while running
+ */
+int ControlLoop::setLockMemory(bool enabled){
+  if(_running)
+    return 0;
+  _lockMemory = enabled;
+  return 1;
+}
+
+/**
+ * Sends the setpoints a tick stages at a fixed phase of its period
+ * @return 1 if set, 0 while running or phaseUs is out of range
+ */
+int ControlLoop::setOutput(SMC *smc, long phaseUs, FLEET_FORMAT format){
+  if(_running || phaseUs < 0 || phaseUs >= _periodUs)
+    return 0;
+  _smc = smc;
+  _phaseUs = phaseUs;
+  _format = format;
+  return 1;
+}
+
+/**
+ * Stages the setpoints to send at this period's phase
+ * @return 1 if staged
+ */
+int ControlLoop::stage(const SMCSetpoint *setpoints, int count){
+  if(!setpoints || count <= 0 || count > SMC_MAX_FLEET)
+    return 0;
+  for(int i = 0; i < count; i++)
+    _staged[i] = setpoints[i];
+  _stagedCount = count;
+  return 1;
+}
+
+/**
+ * Starts the loop thread
+ * @return 1 if running, 0 if the memory lock, priority or CPU could
+ * not be set
+ */
+int ControlLoop::start(){
+
+  if(_running)
+    return 1;
+  if(_periodUs <= 0)
+    return 0;
+  if(_lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE))
+    return 0;
+
+  _setup = -1;
+  _running = true;
+  _thread = std::thread(&ControlLoop::run, this);
+
+  std::unique_lock<std::mutex> lock(_lock);
+  _started.wait(lock, [this]{ return _setup >= 0; });
+  if(_setup)
+    return 1;
+
+  lock.unlock();
+  _thread.join();
+  if(_lockMemory)
+    munlockall();
+  return 0;
+}
+
+/**
+ * Stops the loop, waits for the current period to end
+ */
+void ControlLoop::stop(){
+  _running = false;
+  if(_thread.joinable())
+    _thread.join();
+}
+
+/**
+ * @return 1 if the loop is running
+ */
+int ControlLoop::isRunning(){
+  return _running;
+}
+
+/**
+ * Copies the counters
+ */
+void ControlLoop::getStats(ControlLoopStats &stats){
+  stats.ticks = _ticks;
+  stats.overruns = _overruns;
+  stats.skipped = _skipped;
+  stats.lateSends = _lateSends;
+  stats.sendFailures = _sendFailures;
+  stats.maxJitterUs = _maxJitterUs;
+  _jitter.snapshot(stats.jitter);
+  _runtime.snapshot(stats.runtime);
+  _sendJitter.snapshot(stats.sendJitter);
+}
+
+/**
+ * Applies the CPU and priority to the loop thread and faults its stack in
+ * @return 1 if set
+ */
+int ControlLoop::setup(){
+
+  pthread_t self = pthread_self();
+
+  if(_cpu >= 0){
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_cpu, &cpus);
+    if(pthread_setaffinity_np(self, sizeof(cpus), &cpus))
+      return 0;
+  }
+
+  if(_priority > 0){
+    struct sched_param param;
+    param.sched_priority = _priority;
+    if(pthread_setschedparam(self, SCHED_FIFO, &param))
+      return 0;
+  }
+
+  if(_lockMemory){
+    volatile char stack[SMC_LOOP_STACK_PREFAULT];
+    for(int i = 0; i < SMC_LOOP_STACK_PREFAULT; i += 4096)
+      stack[i] = 0;
+    (void)stack;
+  }
+  return 1;
+}
+
+/**
+ * Sleeps until the phase and sends the staged setpoints, loop thread only
+ * @param phase CLOCK_MONOTONIC ns of the send
+ */
+void ControlLoop::send(int64_t phase){
+
+  int64_t now = monotonicNs();
+  if(now < phase){
+    sleepUntil(phase);
+    now = monotonicNs();
+  }
+  else if(now - phase >= 1000)
+    _lateSends++;
+  _sendJitter.record((uint64_t)(now - phase) / 1000);
+
+  if(!_smc->setFleetSpeeds(_staged, _stagedCount, _format))
+    _sendFailures++;
+  _stagedCount = 0;
+}
+
+/**
+ * Loop thread body
+ */
+void ControlLoop::run(){
+
+  int ok = setup();
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _setup = ok;
+  }
+  _started.notify_all();
+  if(!ok){
+    _running = false;
+    return;
+  }
+
+  int64_t period = (int64_t)_periodUs * 1000;
+  int64_t origin = monotonicNs();
+  uint64_t tick = 0;
+
+  while(_running){
+    int64_t wake = origin + (int64_t)tick * period;
+    sleepUntil(wake);
+    if(!_running)
+      break;
+
+    int64_t woke = monotonicNs();
+    long late = (long)((woke - wake) / 1000);
+    _jitter.record(late > 0 ? late : 0);
+    if(late > _maxJitterUs)
+      _maxJitterUs = late;
+
+    _stagedCount = 0;
+    if(_tick)
+      _tick(tick);
+    _runtime.record((uint64_t)(monotonicNs() - woke) / 1000);
+    _ticks++;
+
+    if(_smc && _stagedCount)
+      send(wake + (int64_t)_phaseUs * 1000);
+
+    // an overrun leaves out every period that already began
+    tick++;
+    int64_t done = monotonicNs();
+    if(done > origin + (int64_t)tick * period){
+      uint64_t next = (uint64_t)((done - origin) / period) + 1;
+      _overruns++;
+      _skipped += next - tick;
+      tick = next;
+    }
+  }
+}
@@ -0,0 +1,656 @@
+#include <string.h>
+
+#include "smc/Dispatcher.h"
+
+
+/**
+ * Create a dispatcher for an open serial port
+ * @param conn pointer to an open serial port
+ */
+Dispatcher::Dispatcher(SerialPort* conn)
+  :_conn(conn),
+   _carryHead(0),
+   _carryCount(0),
+   _writerWaiting(false),
+   _readerWaiting(false),
+   _writerIdle(false),
+   _running(false),
+   _submitting(0),
+   _pendingSetpoints(0),
+   _coalesced(0),
+   _nextSlot(0),
+   _pendingUrgent(0),
+   _nextUrgent(0),
+   _stopRequested(false),
+   _stopCalled(0),
+   _lastStopUs(0),
+   _maxStopUs(0),
+   _groupLen(0),
+   _groupCount(0),
+   _pendingGroup(false)
+{
+  for(int i = 0; i <= SMC_BROADCAST; i++)
+    _setpoints[i] = _urgent[i] = 0;
+}
+
+/**
+ * Stops the I/O threads if running
+ */
+Dispatcher::~Dispatcher(){
+  stop();
+}
+
+/**
+ * Starts the I/O threads
+ * @return 1 if the threads are running
+ */
+int Dispatcher::start(){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if(_running)
+    return 1;
+  if(!_conn || !_conn->isOpen())
+    return 0;
+
+  _running = true;
+  _writer = std::thread(&Dispatcher::writeLoop, this);
+  _reader = std::thread(&Dispatcher::readLoop, this);
+  return 1;
+}
+
+/**
+ * Stops the I/O threads, requests still queued or in flight
+ * complete with status 0
+ */
+void Dispatcher::stop(){
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+  }
+  _cond.notify_all();
+  _readCond.notify_all();
+
+  if(_writer.joinable())
+    _writer.join();
+  if(_reader.joinable())
+    _reader.join();
+
+  // a submit that saw _running may still be pushing
+  while(_submitting)
+    std::this_thread::yield();
+
+  // nobody is left to send or answer these
+  failInFlight();
+
+  clear(_setpoints, _pendingSetpoints);
+  clear(_urgent, _pendingUrgent);
+  dropGroup(SMC_BROADCAST);
+  _stopRequested = false;
+  _stopCalled = 0;
+
+  SMCRequest left;
+  while(nextRequest(left))
+    if(left.done)
+      left.done(left.ctx, 0, NULL);
+}
+
+/**
+ * @return 1 if the I/O threads are running
+ */
+int Dispatcher::isRunning(){
+  return _running;
+}
+
+/**
+ * Queues a request for the writer thread
+ * @param request frame, response length and completion
+ * @return 1 if queued, 0 if the I/O threads are not running
+ */
+int Dispatcher::submit(const SMCRequest &request){
+
+  if(request.frameLen > SMC_MAX_FRAME || request.responseLen > SMC_MAX_RESPONSE)
+    return 0;
+
+  // stop() drains the queue once no submit is between the check and
+  // the push, so a request queued here always completes
+  _submitting++;
+  if(!_running || !_queue.push(request)){
+    _submitting--;
+    return 0;
+  }
+  _submitting--;
+
+  // only pay for the lock when the writer is asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(_writerIdle){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cond.notify_one();
+  }
+  return 1;
+}
+
+/**
+ * Takes the next request to send, writer thread only
+ * @return false if none is waiting
+ */
+bool Dispatcher::nextRequest(SMCRequest &req){
+  if(_carryCount){
+    req = _carry[_carryHead];
+    _carryHead = (_carryHead + 1) % SMC_MAX_QUEUE;
+    _carryCount--;
+    return true;
+  }
+  return _queue.pop(req);
+}
+
+/**
+ * Puts a request aside to be served before the queue, writer thread only
+ * @param front true to serve it before the other carried requests
+ */
+void Dispatcher::carry(const SMCRequest &req, bool front){
+  if(_carryCount == SMC_MAX_QUEUE){
+    if(req.done)
+      req.done(req.ctx, 0, NULL);
+    return;
+  }
+  if(front){
+    _carryHead = (_carryHead + SMC_MAX_QUEUE - 1) % SMC_MAX_QUEUE;
+    _carry[_carryHead] = req;
+  }
+  else
+    _carry[(_carryHead + _carryCount) % SMC_MAX_QUEUE] = req;
+  _carryCount++;
+}
+
+/**
+ * Replaces the pending speed or brake command of a slot
+ * @param slot ID of device, or SMC_BROADCAST for compact format frames
+ * @param frame encoded command, at most 7 bytes
+ * @param len bytes in frame
+ * @return 1 if stored, 0 if the I/O threads are not running
+ */
+int Dispatcher::setpoint(uint8_t slot, const char *frame, int len){
+
+  if(!_running || !store(slot, frame, len))
+    return 0;
+  wakeWriter();
+  return 1;
+}
+
+/**
+ * Replaces the pending group of setpoints
+ * @param slots count slot IDs, the devices the frames are for
+ * @param count number of frames
+ * @param frames back to back frames
+ * @param len bytes in frames, at most SMC_MAX_GROUP
+ * @return 1 if stored, 0 if the I/O threads are not running
+ */
+int Dispatcher::group(const uint8_t *slots, int count, const char *frames, int len){
+
+  if(!_running || len <= 0 || len > SMC_MAX_GROUP || count <= 0 || count > SMC_MAX_GROUP)
+    return 0;
+  for(int i = 0; i < count; i++)
+    if(slots[i] > SMC_BROADCAST)
+      return 0;
+
+  // older single setpoints of the members would follow the group out
+  for(int i = 0; i < count; i++)
+    if(_setpoints[slots[i]].exchange(0)){
+      _pendingSetpoints--;
+      _coalesced++;
+    }
+
+  {
+    std::lock_guard<std::mutex> lock(_groupLock);
+    if(_pendingGroup)
+      _coalesced += _groupCount;
+    memcpy(_group, frames, len);
+    _groupLen = len;
+    memcpy(_groupSlots, slots, count);
+    _groupCount = count;
+    _pendingGroup = true;
+  }
+  wakeWriter();
+  return 1;
+}
+
+/**
+ * Takes the pending group if it fits
+ * @param room bytes left in the write
+ * @return bytes copied to frames, 0 if none is pending or it doesn't fit
+ */
+int Dispatcher::takeGroup(char *frames, int room){
+
+  if(!_pendingGroup)
+    return 0;
+
+  std::lock_guard<std::mutex> lock(_groupLock);
+  if(!_pendingGroup || _groupLen > room)
+    return 0;
+  memcpy(frames, _group, _groupLen);
+  _pendingGroup = false;
+  return _groupLen;
+}
+
+/**
+ * Drops the pending group if a slot is in it
+ * @param slot ID of device, SMC_BROADCAST drops any group
+ */
+void Dispatcher::dropGroup(uint8_t slot){
+
+  if(!_pendingGroup)
+    return;
+
+  std::lock_guard<std::mutex> lock(_groupLock);
+  for(int i = 0; i < _groupCount; i++)
+    if(slot == SMC_BROADCAST || _groupSlots[i] == slot){
+      _pendingGroup = false;
+      return;
+    }
+}
+
+/**
+ * Time spent in the writes that carried a group
+ * @param out ref for the histogram
+ */
+void Dispatcher::groupWriteTime(HistogramSnapshot &out){
+  _groupWrite.snapshot(out);
+}
+
+/**
+ * Puts a frame in a setpoint slot without waking the writer
+ * @return 1 if stored
+ */
+int Dispatcher::store(uint8_t slot, const char *frame, int len){
+
+  if(slot > SMC_BROADCAST || len <= 0 || len > 7)
+    return 0;
+
+  // a broadcast reaches every device, older single setpoints would
+  // follow it out and undo it
+  if(slot == SMC_BROADCAST)
+    for(int i = 0; i < SMC_BROADCAST; i++)
+      if(_setpoints[i].exchange(0)){
+        _pendingSetpoints--;
+        _coalesced++;
+      }
+
+  if(_setpoints[slot].exchange(pack(frame, len)))
+    _coalesced++;
+  else
+    _pendingSetpoints++;
+  return 1;
+}
+
+/**
+ * Wakes the writer if it sleeps with nothing to send
+ */
+void Dispatcher::wakeWriter(){
+  if(_writerIdle){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cond.notify_one();
+  }
+}
+
+/**
+ * @return number of setpoints dropped because a newer one replaced them
+ */
+unsigned long Dispatcher::coalescedCount(){
+  return _coalesced;
+}
+
+/**
+ * Sends a stop or brake frame through the priority lane
+ * @param slot ID of device, or SMC_BROADCAST for compact format frames
+ * @param frame encoded command, at most 7 bytes
+ * @param len bytes in frame
+ * @return 1 if stored, 0 if the I/O threads are not running
+ */
+int Dispatcher::urgent(uint8_t slot, const char *frame, int len){
+
+  if(!_running || slot > SMC_BROADCAST || len <= 0 || len > 7)
+    return 0;
+
+  // setpoints go out after the priority lane, none may undo a stop or
+  // brake, a broadcast one for any device
+  if(slot == SMC_BROADCAST){
+    clear(_setpoints, _pendingSetpoints);
+    clear(_urgent, _pendingUrgent);
+  }
+  else if(_setpoints[slot].exchange(0))
+    _pendingSetpoints--;
+  dropGroup(slot);
+
+  if(!_urgent[slot].exchange(pack(frame, len)))
+    _pendingUrgent++;
+
+  wakeWriter();
+  return 1;
+}
+
+/**
+ * Stops every device ahead of all other traffic
+ * @return 1 if the stop was scheduled, 0 if the I/O threads are not running
+ */
+int Dispatcher::emergencyStop(){
+
+  if(!_running)
+    return 0;
+
+  // latency counts from the first call not yet served, the writer takes
+  // the time back to 0 when it serves the stop
+  long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  long long none = 0;
+  _stopCalled.compare_exchange_strong(none, now, std::memory_order_acq_rel);
+  _stopRequested.store(true, std::memory_order_release);
+
+  // the writer may also be waiting for room in flight, always wake it
+  std::lock_guard<std::mutex> lock(_mutex);
+  _cond.notify_all();
+  return 1;
+}
+
+/**
+ * Emergency stop latency, from the call until the frame left the port
+ * @param maxUs ref for the worst latency seen, microseconds
+ * @return latency of the last emergency stop, microseconds
+ */
+long Dispatcher::stopLatency(long &maxUs){
+  maxUs = _maxStopUs;
+  return _lastStopUs;
+}
+
+/**
+ * Packs a frame of at most 7 bytes into one word
+ * Length in the low byte and the frame above it, so a frame is never 0
+ */
+uint64_t Dispatcher::pack(const char *frame, int len){
+  uint64_t packed = len;
+  for(int i = 0; i < len; i++)
+    packed |= (uint64_t)(uint8_t)frame[i] << (8 * (i + 1));
+  return packed;
+}
+
+/**
+ * Unpacks a word made by pack
+ * @return frame length
+ */
+int Dispatcher::unpack(uint64_t packed, char *frame){
+  int len = packed & 0xFF;
+  for(int i = 0; i < len; i++)
+    frame[i] = (char)(packed >> (8 * (i + 1)));
+  return len;
+}
+
+/**
+ * Takes the next pending frame, the broadcast slot first, then round
+ * robin over the devices
+ * @return packed frame, 0 if no slot is pending
+ */
+uint64_t Dispatcher::take(std::atomic<uint64_t> *slots, std::atomic<int> &pending, int &next){
+
+  if(!pending)
+    return 0;
+
+  // storing a broadcast frame dropped the older device frames, the
+  // ones still pending are newer and must follow it
+  uint64_t packed = slots[SMC_BROADCAST].exchange(0);
+  if(packed){
+    pending--;
+    return packed;
+  }
+
+  for(int i = 0; i < SMC_BROADCAST; i++){
+    int slot = (next + i) % SMC_BROADCAST;
+    packed = slots[slot].exchange(0);
+    if(packed){
+      pending--;
+      next = slot + 1;
+      return packed;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Drops every pending frame in a set of slots
+ */
+void Dispatcher::clear(std::atomic<uint64_t> *slots, std::atomic<int> &pending){
+  for(int i = 0; i <= SMC_BROADCAST; i++)
+    if(slots[i].exchange(0))
+      pending--;
+}
+
+/**
+ * Serves an emergency stop, writer thread only
+ */
+void Dispatcher::sendStop(){
+
+  // a call landing between these two is served by this frame as well,
+  // the stop it schedules again then finds no time to record
+  _stopRequested.store(false, std::memory_order_release);
+  long long called = _stopCalled.exchange(0, std::memory_order_acq_rel);
+
+  // nothing queued before the stop may reach a motor after it
+  clear(_setpoints, _pendingSetpoints);
+  clear(_urgent, _pendingUrgent);
+  dropGroup(SMC_BROADCAST);
+
+  // reads keep their order in the carry, write-only requests are dropped
+  int carried = _carryCount;
+  SMCRequest req;
+  for(int i = 0; i < carried && nextRequest(req); i++){
+    if(req.responseLen)
+      carry(req, false);
+    else if(req.done)
+      req.done(req.ctx, 0, NULL);
+  }
+  while(_queue.pop(req)){
+    if(req.responseLen)
+      carry(req, false);
+    else if(req.done)
+      req.done(req.ctx, 0, NULL);
+  }
+
+  char frame[SMC_MAX_FRAME];
+  int len = encodeCompact<POLOLU_COM::MOTOR_STOP>(frame);
+  try{
+    _conn->flushPort(SerialPort::flush_send);
+    _conn->sendArray(frame, len);
+    _conn->drain();
+  }
+  catch(...){
+  }
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  _wireFree = now;
+
+  if(!called)
+    return;
+  long us = (std::chrono::duration_cast<std::chrono::nanoseconds>(
+               now.time_since_epoch()).count() - called) / 1000;
+  _lastStopUs = us;
+  if(us > _maxStopUs)
+    _maxStopUs = us;
+}
+
+/**
+ * Writes a frame once the previous one has left the wire
+ * @param timing records the time in the write, NULL for none
+ * @return 1 if the whole frame was written, 0 if it failed or an
+ * emergency stop preempted it
+ */
+int Dispatcher::write(const char *frame, int len, Histogram *timing){
+
+  int baud = _conn->getBaud();
+  if(baud > 0){
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if(_wireFree > now){
+      // an emergency stop cuts the wait short and the frame is dropped
+      std::unique_lock<std::mutex> lock(_mutex);
+      while(!_stopRequested && std::chrono::steady_clock::now() < _wireFree)
+        _cond.wait_until(lock, _wireFree);
+      if(_stopRequested)
+        return 0;
+    }
+    else
+      _wireFree = now;
+    // 8N1, ten bit times per byte
+    _wireFree += std::chrono::microseconds(len * 10 * 1000000LL / baud);
+  }
+
+  try{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int sent = _conn->sendArray((char *)frame, len);
+    if(timing)
+      timing->record(start);
+    return sent == len;
+  }
+  catch(...){
+    return 0;
+  }
+}
+
+/**
+ * Completes every request in flight with status 0
+ */
+void Dispatcher::failInFlight(){
+  SMCPending pending;
+  while(_inFlight.pop(pending))
+    if(pending.done)
+      pending.done(pending.ctx, 0, NULL);
+}
+
+/**
+ * Writer thread body, sends requests without waiting for their answers
+ */
+void Dispatcher::writeLoop(){
+
+  for(;;){
+    if(_stopRequested){
+      sendStop();
+      continue;
+    }
+
+    // priority lane first, then the newest group and setpoints, all in
+    // one write, then queued requests
+    char burst[SMC_MAX_BURST];
+    int used = 0;
+    uint64_t packed;
+    // a group taken after the urgent frames can't be older than them,
+    // urgent drops it while it is still pending
+    int room = _pendingGroup ? SMC_MAX_BURST - SMC_MAX_GROUP : SMC_MAX_BURST;
+    while(used + 8 <= room && (packed = take(_urgent, _pendingUrgent, _nextUrgent)))
+      used += unpack(packed, burst + used);
+    int grouped = takeGroup(burst + used, SMC_MAX_BURST - used);
+    used += grouped;
+    while(used + 8 <= SMC_MAX_BURST && (packed = take(_setpoints, _pendingSetpoints, _nextSlot)))
+      used += unpack(packed, burst + used);
+    if(used){
+      write(burst, used, grouped ? &_groupWrite : NULL);
+      continue;
+    }
+
+    SMCRequest req;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _writerIdle = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while(_running && !_carryCount && _queue.empty() && !_pendingSetpoints
+            && !_pendingUrgent && !_pendingGroup && !_stopRequested)
+        _cond.wait(lock);
+      _writerIdle = false;
+      if(!_running)
+        return;
+      if(_stopRequested || !nextRequest(req))
+        continue;
+
+      // wait for room to track the answer
+      if(req.responseLen){
+        _writerWaiting = true;
+        while(_running && _inFlight.full() && !_stopRequested)
+          _cond.wait(lock);
+        _writerWaiting = false;
+        if(!_running){
+          lock.unlock();
+          if(req.done)
+            req.done(req.ctx, 0, NULL);
+          return;
+        }
+        if(_stopRequested){
+          carry(req, true);
+          continue;
+        }
+      }
+    }
+
+    int status = write(req.frame, req.frameLen);
+
+    if(!status || !req.responseLen){
+      if(req.done)
+        req.done(req.ctx, status, NULL);
+      continue;
+    }
+
+    SMCPending pending = SMCPending();
+    pending.responseLen = req.responseLen;
+    pending.done = req.done;
+    pending.ctx = req.ctx;
+    _inFlight.push(pending);
+
+    if(_readerWaiting){
+      std::lock_guard<std::mutex> lock(_mutex);
+      _readCond.notify_one();
+    }
+  }
+}
+
+/**
+ * Reader thread body, hands each response to the oldest request in flight
+ */
+void Dispatcher::readLoop(){
+
+  char response[SMC_MAX_RESPONSE];
+
+  for(;;){
+    SMCPending pending = SMCPending();
+    bool popped = _inFlight.pop(pending);
+    if(!popped){
+      std::unique_lock<std::mutex> lock(_mutex);
+      _readerWaiting = true;
+      while(_running && !(popped = _inFlight.pop(pending)))
+        _readCond.wait(lock);
+      _readerWaiting = false;
+    }
+    if(!_running){
+      if(popped && pending.done)
+        pending.done(pending.ctx, 0, NULL);
+      return;
+    }
+
+    if(_writerWaiting){
+      std::lock_guard<std::mutex> lock(_mutex);
+      _cond.notify_one();
+    }
+
+    int status = 0;
+    try{
+      status = _conn->getArray(response, pending.responseLen) == pending.responseLen;
+    }
+    catch(...){
+      status = 0;
+    }
+
+    if(pending.done)
+      pending.done(pending.ctx, status, response);
+
+    // Answers carry no request tag, once one is missing the rest of the
+    // stream can't be matched, so drop everything outstanding and resync.
+    if(!status){
+      failInFlight();
+      _conn->flushPort(SerialPort::flush_receive);
+    }
+  }
+}
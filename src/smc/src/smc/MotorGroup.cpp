@@ -0,0 +1,100 @@
+#include "smc/MotorGroup.h"
+
+/**
+ * @param smc controller connection of every member
+ * @param baud baud rate of the link
+ * @param devices IDs of the members, in the order of their speeds
+ * @param count number of members, at most SMC_MAX_FLEET
+ * @param format frame format
+ */
+MotorGroup::MotorGroup(SMC *smc, int baud, const uint8_t *devices, int count, FLEET_FORMAT format)
+  :_smc(smc),
+   _count(0),
+   _format(format),
+   _wireSkewUs(0),
+   _updates(0),
+   _failures(0)
+{
+  if(!devices || count <= 0 || count > SMC_MAX_FLEET)
+    return;
+  for(int i = 0; i < count; i++)
+    if(devices[i] > 127)
+      return;
+
+  for(int i = 0; i < count; i++){
+    _members[i].device = devices[i];
+    _members[i].speed = 0;
+  }
+  _count = count;
+
+  int frameLen = format == FLEET_FORMAT::MINI_SSC ?
+    (int)SSC_COM_BYTES::SSC_PWM : Command<POLOLU_COM::MOTOR_FORWARD>::pololuLen;
+  // the last member's frame starts once the others are on the wire, 8N1
+  _wireSkewUs = baud > 0 ? (count - 1) * frameLen * 10 * 1000000L / baud : 0;
+}
+
+/**
+ * @return number of members
+ */
+int MotorGroup::size(){
+  return _count;
+}
+
+/**
+ * Sets the speed of every member in one write
+ * @return 1 if sent or stored, 0 if a speed is out of range or it failed
+ */
+int MotorGroup::set(const int16_t *speeds){
+
+  if(!_smc || !_count || !speeds)
+    return 0;
+
+  SMCSetpoint setpoints[SMC_MAX_FLEET];
+  for(int i = 0; i < _count; i++){
+    setpoints[i].device = _members[i].device;
+    setpoints[i].speed = speeds[i];
+  }
+
+  // the writer times it when it owns the port
+  Dispatcher *dispatcher = _smc->getDispatcher();
+  bool queued = dispatcher && dispatcher->isRunning();
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if(!_smc->setFleetSpeeds(setpoints, _count, _format)){
+    _failures++;
+    return 0;
+  }
+  if(!queued)
+    _hostSkew.record(start);
+  _updates++;
+  return 1;
+}
+
+/**
+ * Sets the speeds of a two member group
+ * @return 1 if sent or stored, 0 if the group doesn't have two members,
+ * a speed is out of range or it failed
+ */
+int MotorGroup::set(int16_t first, int16_t second){
+
+  if(_count != 2)
+    return 0;
+  int16_t speeds[2] = {first, second};
+  return set(speeds);
+}
+
+/**
+ * Copies the counters
+ */
+void MotorGroup::getStats(MotorGroupStats &stats){
+
+  stats.updates = _updates;
+  stats.failures = _failures;
+  stats.wireSkewUs = _wireSkewUs;
+
+  Dispatcher *dispatcher = _smc ? _smc->getDispatcher() : NULL;
+  if(dispatcher && dispatcher->isRunning())
+    dispatcher->groupWriteTime(stats.hostSkew);
+  else
+    _hostSkew.snapshot(stats.hostSkew);
+}
@@ -0,0 +1,433 @@
+#include <stdlib.h>
+#include <algorithm>
+
+#include "smc/PollScheduler.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * How often rates are planned again as they adapt
+ */
+#define SMC_POLL_REPLAN_MS 1000
+
+/**
+ * Longest period between polls of a variable with a rate, a slower rate
+ * is planned again long before it would be due
+ */
+#define SMC_POLL_MAX_PERIOD_MS 60000
+
+/**
+ * Polls per second of budget left that count as none, what rounding
+ * leaves behind a level that used it up
+ */
+#define SMC_POLL_MIN_HZ 1e-6
+
+/**
+ * @return time between polls at a rate above 0
+ */
+static std::chrono::microseconds period(double hz){
+  return std::chrono::microseconds((long)std::min(1e6 / hz, SMC_POLL_MAX_PERIOD_MS * 1e3));
+}
+
+/**
+ * @param smc controller connection the polls go through
+ * @param baud baud rate of the link
+ */
+PollScheduler::PollScheduler(SMC *smc, int baud)
+  :_smc(smc),
+   _budget(0.5),
+   _timers(NULL),
+   _cache(NULL),
+   _running(false),
+   _replan(false),
+   _inFlight(0)
+{
+  for(int i = 0; i < SMC_CACHE_VARS; i++)
+    _rates[i].set = false;
+
+  char frame[SMC_MAX_FRAME];
+  int bytes = encodePololu<POLOLU_COM::GET_SMC_VAR>(frame, 0, 0) + Command<POLOLU_COM::GET_SMC_VAR>::responseLen;
+  // 8N1, ten bit times per byte
+  _pollUs = baud > 0 ? bytes * 10 * 1000000L / baud : 0;
+}
+
+/**
+ * Stops polling
+ */
+PollScheduler::~PollScheduler(){
+  stop();
+  delete _timers;
+}
+
+/**
+ * Polls a variable on every added device
+ * @return 1 if set, 0 while running
+ */
+int PollScheduler::setRate(SMC_VAR variable, double targetHz, uint8_t priority, uint16_t deadband){
+
+  uint8_t id = (uint8_t)variable;
+  if(_running || id >= SMC_CACHE_VARS || targetHz <= 0)
+    return 0;
+  _rates[id].set = true;
+  _rates[id].targetHz = targetHz;
+  _rates[id].priority = priority;
+  _rates[id].deadband = deadband;
+  return 1;
+}
+
+/**
+ * Adds a device to poll every variable with a rate on
+ * @return 1 if added, 0 while running
+ */
+int PollScheduler::addDevice(uint8_t device){
+  if(_running || device >= SMC_CACHE_DEVICES)
+    return 0;
+  if(std::find(_devices.begin(), _devices.end(), device) == _devices.end())
+    _devices.push_back(device);
+  return 1;
+}
+
+/**
+ * @param share part of the link's bytes polls may use, 0 to 1
+ * @return 1 if set, 0 while running
+ */
+int PollScheduler::setBudget(double share){
+  if(_running || share <= 0 || share > 1)
+    return 0;
+  _budget = share;
+  return 1;
+}
+
+/**
+ * @param cache receives every polled value, NULL for none
+ * @return 1 if set, 0 while running
+ */
+int PollScheduler::setCache(TelemetryCache *cache){
+  if(_running)
+    return 0;
+  _cache = cache;
+  return 1;
+}
+
+/**
+ * @param callback called with every polled value, empty for none
+ * @return 1 if set, 0 while running
+ */
+int PollScheduler::setCallback(PollCallback callback){
+  if(_running)
+    return 0;
+  _callback = callback;
+  return 1;
+}
+
+/**
+ * Shares the budget out by priority, under _lock
+ * Each priority level gets its wanted rates in full while the budget
+ * lasts, the level where it runs out is scaled down evenly
+ */
+void PollScheduler::plan(){
+
+  // polls per second the budget carries
+  double left = _pollUs > 0 ? _budget * 1e6 / _pollUs : 0;
+
+  std::vector<size_t> order(_items.size());
+  for(size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b){
+    return _items[a].priority > _items[b].priority;
+  });
+
+  Clock::time_point now = Clock::now();
+  for(size_t start = 0; start < order.size();){
+    size_t end = start;
+    double demand = 0;
+    while(end < order.size() && _items[order[end]].priority == _items[order[start]].priority)
+      demand += _items[order[end++]].wantHz;
+
+    double scale = demand <= left ? 1 : left / demand;
+    left -= demand * scale;
+    if(left < SMC_POLL_MIN_HZ)
+      left = 0;
+
+    for(size_t i = start; i < end; i++){
+      Item &item = _items[order[i]];
+      bool wasIdle = item.plannedHz <= 0;
+      item.plannedHz = item.wantHz * scale;
+      if(item.plannedHz <= 0){
+        // starved, no longer due until a plan gives it a rate again
+        item.due = false;
+        continue;
+      }
+      // don't keep waiting out a slower period than the new one
+      Clock::time_point soonest = now + period(item.plannedHz);
+      if(wasIdle || item.next > soonest)
+        item.next = wasIdle ? now : soonest;
+    }
+    start = end;
+  }
+  _ready.erase(std::remove_if(_ready.begin(), _ready.end(),
+                              [this](size_t i){ return !_items[i].due; }), _ready.end());
+  _replan = false;
+}
+
+/**
+ * Plans the rates and starts polling on a thread
+ * @return 1 if running
+ */
+int PollScheduler::start(){
+
+  if(_running)
+    return 1;
+  if(!_smc || _pollUs <= 0)
+    return 0;
+
+  _items.clear();
+  for(size_t d = 0; d < _devices.size(); d++){
+    for(int v = 0; v < SMC_CACHE_VARS; v++){
+      if(!_rates[v].set)
+        continue;
+      Item item;
+      item.device = _devices[d];
+      item.variableID = v;
+      item.priority = _rates[v].priority;
+      item.deadband = _rates[v].deadband;
+      item.targetHz = item.wantHz = _rates[v].targetHz;
+      item.plannedHz = 0;
+      item.timer = 0;
+      item.due = false;
+      item.inFlight = false;
+      item.haveValue = false;
+      item.last = 0;
+      item.steady = 0;
+      item.polls = item.changes = item.failures = 0;
+      _items.push_back(item);
+    }
+  }
+  if(_items.empty())
+    return 0;
+
+  // a timer per item at most
+  delete _timers;
+  _timers = new TimerWheel((int)_items.size());
+  _ready.clear();
+  _ready.reserve(_items.size());
+
+  plan();
+  _inFlight = 0;
+  _running = true;
+  _thread = std::thread(&PollScheduler::run, this);
+  return 1;
+}
+
+/**
+ * Stops polling and waits for polls on the wire
+ */
+void PollScheduler::stop(){
+
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if(!_running && !_thread.joinable())
+      return;
+    _running = false;
+  }
+  _wake.notify_all();
+  if(_thread.joinable())
+    _thread.join();
+
+  // async polls still call back into this
+  std::unique_lock<std::mutex> lock(_lock);
+  _wake.wait(lock, [this]{ return _inFlight == 0; });
+}
+
+/**
+ * @return 1 if polling
+ */
+int PollScheduler::isRunning(){
+  std::lock_guard<std::mutex> guard(_lock);
+  return _running;
+}
+
+/**
+ * Copies the rates of every polled variable
+ */
+void PollScheduler::getRates(std::vector<PollRate> &rates){
+
+  std::lock_guard<std::mutex> guard(_lock);
+  rates.resize(_items.size());
+  for(size_t i = 0; i < _items.size(); i++){
+    const Item &item = _items[i];
+    PollRate &rate = rates[i];
+    rate.device = item.device;
+    rate.variableID = item.variableID;
+    rate.priority = item.priority;
+    rate.targetHz = item.targetHz;
+    rate.wantHz = item.wantHz;
+    rate.plannedHz = item.plannedHz;
+    rate.polls = item.polls;
+    rate.changes = item.changes;
+    rate.failures = item.failures;
+  }
+}
+
+/**
+ * Arms the timer of every item with a rate at its next due time, after
+ * a plan may have moved it, under _lock
+ */
+void PollScheduler::arm(Clock::time_point now){
+  for(size_t i = 0; i < _items.size(); i++){
+    Item &item = _items[i];
+    if(item.timer)
+      _timers->cancel(item.timer);
+    item.timer = 0;
+    if(item.plannedHz > 0 && !item.due)
+      item.timer = _timers->schedule(std::max(item.next, now), fire, this, (uint32_t)i);
+  }
+}
+
+/**
+ * Moves an item whose due time came to the ready list, scheduler thread
+ * in TimerWheel::advance under _lock
+ */
+void PollScheduler::fire(void *ctx, uint32_t index){
+  PollScheduler *self = (PollScheduler *)ctx;
+  Item &item = self->_items[index];
+  item.timer = 0;
+  // a rate planned away is armed again by the plan that gives it one
+  if(item.plannedHz <= 0 || item.due)
+    return;
+  item.due = true;
+  self->_ready.push_back(index);
+}
+
+/**
+ * Scheduler thread body
+ */
+void PollScheduler::run(){
+
+  int maxInFlight = 1;
+  Clock::time_point wireFree = Clock::now();
+  Clock::time_point planned = Clock::now();
+  // the budget's share of the link per poll
+  Clock::duration spacing = std::chrono::microseconds((long)(_pollUs / _budget));
+
+  std::unique_lock<std::mutex> lock(_lock);
+  arm(planned);
+
+  while(_running){
+    Clock::time_point now = Clock::now();
+    if(_replan || now - planned >= std::chrono::milliseconds(SMC_POLL_REPLAN_MS)){
+      plan();
+      planned = now;
+      arm(now);
+    }
+    _timers->advance(now);
+
+    // highest priority of the due polls, ties to the earliest due
+    size_t best = _ready.size();
+    for(size_t r = 0; r < _ready.size(); r++){
+      const Item &item = _items[_ready[r]];
+      if(item.inFlight || item.plannedHz <= 0)
+        continue;
+      if(best == _ready.size() || item.priority > _items[_ready[best]].priority ||
+         (item.priority == _items[_ready[best]].priority && item.next < _items[_ready[best]].next))
+        best = r;
+    }
+
+    Clock::time_point until = planned + std::chrono::milliseconds(SMC_POLL_REPLAN_MS);
+    int waitMs = _timers->waitMs(now);
+    if(waitMs >= 0)
+      until = std::min(until, now + std::chrono::milliseconds(waitMs));
+    bool room = _inFlight < maxInFlight;
+    if(best < _ready.size() && room)
+      until = std::min(until, wireFree);
+
+    if(best == _ready.size() || !room || wireFree > now){
+      _wake.wait_until(lock, until);
+      continue;
+    }
+
+    size_t index = _ready[best];
+    _ready[best] = _ready.back();
+    _ready.pop_back();
+
+    Item &item = _items[index];
+    item.due = false;
+    item.inFlight = true;
+    _inFlight++;
+    item.next += period(item.plannedHz);
+    if(item.next < now)
+      item.next = now;
+    item.timer = _timers->schedule(item.next, fire, this, (uint32_t)index);
+    wireFree = std::max(wireFree, now) + spacing;
+
+    lock.unlock();
+    // polls can only overlap when they don't block this thread
+    maxInFlight = poll(index, now) ? SMC_POLL_IN_FLIGHT : 1;
+    lock.lock();
+  }
+}
+
+/**
+ * Sends one poll, in the background if the SMC can
+ * @return 1 if it went to the I/O thread, 0 if it was read here
+ */
+int PollScheduler::poll(size_t index, Clock::time_point sent){
+
+  // device and variable never change while running
+  const Item &item = _items[index];
+  if(_smc->asyncGetMotorVariable(item.device, item.variableID,
+       [this, index, sent](int status, uint16_t value){ complete(index, sent, status, value); }))
+    return 1;
+
+  uint16_t value = 0;
+  int status = _smc->getMotorVariable(item.device, item.variableID, value);
+  complete(index, sent, status, value);
+  return 0;
+}
+
+/**
+ * Records the answer to a poll and adapts the variable's rate
+ */
+void PollScheduler::complete(size_t index, Clock::time_point sent, int status, uint16_t value){
+
+  uint8_t device, variableID;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    Item &item = _items[index];
+    device = item.device;
+    variableID = item.variableID;
+    item.inFlight = false;
+
+    if(!status)
+      item.failures++;
+    else{
+      item.polls++;
+      bool changed = !item.haveValue || abs((int16_t)(value - item.last)) > item.deadband;
+      item.haveValue = true;
+      item.last = value;
+      if(changed){
+        item.changes++;
+        item.steady = 0;
+        if(item.wantHz < item.targetHz){
+          item.wantHz = item.targetHz;
+          _replan = true;
+        }
+      }
+      else if(++item.steady == SMC_POLL_STEADY){
+        item.steady = 0;
+        item.wantHz = std::max(item.targetHz / SMC_POLL_BACKOFF, item.wantHz / 2);
+      }
+    }
+  }
+
+  if(status && _cache)
+    _cache->update(device, variableID, value, sent);
+  if(status && _callback)
+    _callback(device, variableID, value);
+
+  // last, stop() returns and the cache and callback may go once this
+  // poll no longer counts, notified under the lock so _wake outlives it
+  std::lock_guard<std::mutex> guard(_lock);
+  _inFlight--;
+  _wake.notify_all();
+}
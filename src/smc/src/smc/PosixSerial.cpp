@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "SerialBackend.h"
+
+namespace {
+
+/**
+ * @return termios speed of a baud rate, B0 if there is none
+ */
+speed_t toSpeed(int baud){
+  switch(baud){
+  case 1200:    return B1200;
+  case 2400:    return B2400;
+  case 4800:    return B4800;
+  case 9600:    return B9600;
+  case 19200:   return B19200;
+  case 38400:   return B38400;
+  case 57600:   return B57600;
+  case 115200:  return B115200;
+  case 230400:  return B230400;
+#ifdef B460800
+  case 460800:  return B460800;
+#endif
+  default:      return B0;
+  }
+}
+
+/**
+ * Serial port on plain file descriptor calls
+ * The device is non-blocking, a read polls until the response is in
+ * or the deadline passes, so a short response that has already arrived
+ * costs one poll and one read
+ */
+class PosixSerial : public SerialBackend {
+private:
+  int _fd;
+  int _timeoutMs;
+  bool _timedOut;
+
+public:
+
+  PosixSerial()
+    :_fd(-1),
+     _timeoutMs(0),
+     _timedOut(false)
+  {
+  }
+
+  ~PosixSerial(){
+    close();
+  }
+
+  int open(const std::string &device, int baud, size_t timeout){
+
+    close();
+
+    speed_t speed = toSpeed(baud);
+    if(speed == B0)
+      return 0;
+
+    _fd = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(_fd < 0)
+      return 0;
+
+    // raw 8N1, no flow control, ignore modem lines
+    struct termios tio;
+    if(tcgetattr(_fd, &tio)){
+      close();
+      return 0;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    // with O_NONBLOCK an empty read is EAGAIN, with VMIN 0 it would be
+    // a zero byte read that looks like a hangup
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if(tcsetattr(_fd, TCSANOW, &tio)){
+      close();
+      return 0;
+    }
+
+    _timeoutMs = (int)timeout;
+    return 1;
+  }
+
+  void close(){
+    if(_fd >= 0)
+      ::close(_fd);
+    _fd = -1;
+  }
+
+  int isOpen(){
+    return _fd >= 0;
+  }
+
+  int write(const char *buffer, int len){
+
+    int sent = 0;
+    while(sent < len){
+      ssize_t n = ::write(_fd, buffer + sent, len - sent);
+      if(n > 0){
+        sent += n;
+        continue;
+      }
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n < 0 && errno != EAGAIN)
+        break;
+      // output buffer full, wait for room
+      struct pollfd pfd = { _fd, POLLOUT, 0 };
+      if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        break;
+    }
+    return sent;
+  }
+
+  int read(char *buffer, int len){
+
+    _timedOut = false;
+    if(_fd < 0)
+      return 0;
+
+    std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeoutMs);
+    int got = 0;
+
+    while(got < len){
+      int waitMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+      if(waitMs < 0)
+        waitMs = 0;
+
+      struct pollfd pfd = { _fd, POLLIN, 0 };
+      int ready = poll(&pfd, 1, waitMs);
+      if(ready < 0){
+        if(errno == EINTR)
+          continue;
+        break;
+      }
+      if(ready == 0){
+        _timedOut = true;
+        break;
+      }
+
+      ssize_t n = ::read(_fd, buffer + got, len - got);
+      if(n > 0)
+        got += n;
+      else if(n == 0 || (errno != EAGAIN && errno != EINTR))
+        break;
+    }
+    return got;
+  }
+
+  int takeBuffered(char *, int){
+    // reads stop at the bytes asked for, nothing is kept
+    return 0;
+  }
+
+  int lastReadTimedOut(){
+    return _timedOut;
+  }
+
+  void flush(int what){
+    if(_fd >= 0)
+      tcflush(_fd, what);
+  }
+
+  void drain(){
+    if(_fd >= 0)
+      tcdrain(_fd);
+  }
+
+  int fd(){
+    return _fd;
+  }
+};
+
+}
+
+/**
+ * open/termios/poll backend
+ */
+SerialBackend* createPosixBackend(){
+  return new PosixSerial();
+}
@@ -0,0 +1,70 @@
+#ifndef SMC_SERIAL_BACKEND_H_
+#define SMC_SERIAL_BACKEND_H_
+
+#include <stddef.h>
+#include <string>
+
+/**
+ * Platform side of a SerialPort
+ * SerialPort keeps the counters and forwards everything else here
+ */
+class SerialBackend {
+public:
+
+  virtual ~SerialBackend(){}
+
+  /**
+   * Opens a device, closing any device already open
+   * @param timeout read deadline in milliseconds
+   * @return 1 if open
+   */
+  virtual int open(const std::string &device, int baud, size_t timeout) = 0;
+  virtual void close() = 0;
+  virtual int isOpen() = 0;
+
+  /**
+   * @return bytes written
+   */
+  virtual int write(const char *buffer, int len) = 0;
+
+  /**
+   * Reads len bytes under one deadline
+   * @return bytes read, less than len on timeout or error
+   */
+  virtual int read(char *buffer, int len) = 0;
+
+  /**
+   * Takes bytes a read already pulled off the device but did not hand
+   * out, before the descriptor is read directly
+   * @return bytes copied
+   */
+  virtual int takeBuffered(char *buffer, int len) = 0;
+
+  /**
+   * @return 1 if the last read stopped at the deadline
+   */
+  virtual int lastReadTimedOut() = 0;
+
+  /**
+   * @param what TCIFLUSH, TCOFLUSH or TCIOFLUSH
+   */
+  virtual void flush(int what) = 0;
+  virtual void drain() = 0;
+
+  /**
+   * @return file descriptor of the open device, -1 if closed
+   */
+  virtual int fd() = 0;
+};
+
+/**
+ * boost::asio backend, only built with SMC_SERIAL_ASIO
+ */
+SerialBackend* createAsioBackend();
+
+/**
+ * open/termios/poll backend
+ */
+SerialBackend* createPosixBackend();
+
+#endif /* SMC_SERIAL_BACKEND_H_ */
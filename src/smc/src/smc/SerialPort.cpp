@@ -1,58 +1,244 @@
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include "smc/SerialPort.h"
-#include "smc/blocking_reader.h"
+#include "smc/WireRecorder.h"
+#include "SerialBackend.h"
 
+namespace {
 
+SerialBackend* createBackend(SERIAL_BACKEND &type){
+#ifdef SMC_SERIAL_ASIO
+  if(type == SERIAL_BACKEND::ASIO)
+    return createAsioBackend();
+#endif
+  type = SERIAL_BACKEND::POSIX;
+  return createPosixBackend();
+}
+
+/**
+ * Raw 8N1 without flow control, keeping the baud rate
+ * @return 1 if set
+ */
+int configureRaw(int fd){
+  struct termios tio;
+  if(fd < 0 || tcgetattr(fd, &tio))
+    return 0;
+  speed_t in = cfgetispeed(&tio);
+  speed_t out = cfgetospeed(&tio);
+  cfmakeraw(&tio);
+  tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+  tio.c_cflag |= CS8 | CLOCAL | CREAD;
+  tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+  // both backends read non-blocking, a zero byte read would look
+  // like end of file to asio
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, in);
+  cfsetospeed(&tio, out);
+  return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
 
-SerialPort::SerialPort(){
-  port = new boost::asio::serial_port(io);
+/**
+ * Sets ASYNC_LOW_LATENCY, on ftdi_sio this also drops the latency
+ * timer to 1 ms. Ptys and some drivers don't support it.
+ * @return 1 if set
+ */
+int setLowLatency(int fd){
+  struct serial_struct serial;
+  if(ioctl(fd, TIOCGSERIAL, &serial))
+    return 0;
+  serial.flags |= ASYNC_LOW_LATENCY;
+  return ioctl(fd, TIOCSSERIAL, &serial) == 0;
 }
 
+#ifdef SMC_SERIAL_ASIO
+const SERIAL_BACKEND defaultBackend = SERIAL_BACKEND::ASIO;
+#else
+const SERIAL_BACKEND defaultBackend = SERIAL_BACKEND::POSIX;
+#endif
 
-int SerialPort::connect(std::string device, int baud, size_t timeout) {
-  try{
-    port->open((char *) device.c_str());
-    port->set_option(boost::asio::serial_port_base::baud_rate(baud));
-    reader = new blocking_reader(port, timeout);
-    return 1;
-  }
-  catch(...){
+}
+
+
+SerialPort::SerialPort()
+  :baud(0),
+   txBytes(0),
+   rxBytes(0),
+   timeouts(0),
+   shortReads(0),
+   type(defaultBackend),
+   recorder(NULL)
+{
+  backend = createBackend(type);
+}
+
+SerialPort::SerialPort(SERIAL_BACKEND type)
+  :baud(0),
+   txBytes(0),
+   rxBytes(0),
+   timeouts(0),
+   shortReads(0),
+   type(type),
+   recorder(NULL)
+{
+  backend = createBackend(this->type);
+}
+
+SerialPort::~SerialPort(){
+  delete backend;
+}
+
+
+int SerialPort::connect(std::string device, int baud, size_t timeout, bool lowLatency) {
+  if(!backend->open(device, baud, timeout))
     return 0;
+  if(lowLatency){
+    if(!configureRaw(backend->fd())){
+      backend->close();
+      return 0;
+    }
+    setLowLatency(backend->fd());
   }
+  this->baud = baud;
+  return 1;
 }
 
 void SerialPort::disconnect(void){
-  port->close();
+  backend->close();
 }
 
 int SerialPort::sendArray(char *buffer, int len) {
-  int n = boost::asio::write( *port,
-                             boost::asio::buffer(buffer,len));
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int n = backend->write(buffer, len);
+  writeTime.record(start);
+  txBytes.fetch_add(n, std::memory_order_relaxed);
+  if(recorder)
+    recorder->sent(buffer, n);
   return n;
 }
 
 int SerialPort::sendString(std::string msg){
   std::string tmp = msg + "\n";
-  SerialPort::sendArray((char *) tmp.c_str(), tmp.length()); 
+  return SerialPort::sendArray((char *) tmp.c_str(), tmp.length()); 
 }
 
 int SerialPort::getArray (char *buffer, int len){
-  char rcvChar;
-  int i = 0;
-  while ( i < len && reader->read_char(rcvChar))
-    buffer[i++] = rcvChar;
-  return i;
+  if(!backend->isOpen() || len <= 0)
+    return 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int n = backend->read(buffer, len);
+  readTime.record(start);
+  rxBytes.fetch_add(n, std::memory_order_relaxed);
+  if(recorder){
+    recorder->received(buffer, n);
+    // the I/O paths drop what is outstanding after a short read
+    if(n < len)
+      recorder->resync();
+  }
+  if(n < len){
+    shortReads.fetch_add(1, std::memory_order_relaxed);
+    if(backend->lastReadTimedOut())
+      timeouts.fetch_add(1, std::memory_order_relaxed);
+  }
+  return n;
+}
+
+int SerialPort::getAvailable(char *buffer, int len, long timeoutUs){
+  int fd = backend->fd();
+  if(fd < 0 || len <= 0)
+    return 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point deadline = start + std::chrono::microseconds(timeoutUs);
+  // bytes the asio reader pulled off the port beyond an earlier read
+  // come first, flushPort drops them with the kernel's. Then the
+  // descriptor is read around the backend, only after poll found bytes,
+  // so it may be blocking or not.
+  int got = backend->takeBuffered(buffer, len);
+
+  while(got < len){
+    long waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      deadline - std::chrono::steady_clock::now()).count();
+    if(waitNs <= 0)
+      break;
+    struct timespec wait = { waitNs / 1000000000L, waitNs % 1000000000L };
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready = ppoll(&pfd, 1, &wait, NULL);
+    if(ready < 0 && errno == EINTR)
+      continue;
+    if(ready <= 0)
+      break;
+    ssize_t n = ::read(fd, buffer + got, len - got);
+    if(n > 0)
+      got += n;
+    else if(n == 0 || (errno != EAGAIN && errno != EINTR))
+      break;
+  }
+
+  readTime.record(start);
+  rxBytes.fetch_add(got, std::memory_order_relaxed);
+  if(recorder){
+    recorder->received(buffer, got);
+    if(got < len)
+      recorder->resync();
+  }
+  return got;
+}
+
+int SerialPort::lastReadTimedOut(){
+  return backend->lastReadTimedOut();
 }
 
 int SerialPort::isOpen(){
-  return port->is_open();
+  return backend->isOpen();
 }
 
-void SerialPort::flushPort(flush_type what){
-  ::tcflush(this->port->lowest_layer().native_handle(), what);
+int SerialPort::getBaud(){
+  return baud;
+}
+
+SERIAL_BACKEND SerialPort::getBackend(){
+  return type;
+}
+
+int SerialPort::isLowLatency(){
+  struct serial_struct serial;
+  int fd = backend->fd();
+  if(fd < 0 || ioctl(fd, TIOCGSERIAL, &serial))
+    return 0;
+  return (serial.flags & ASYNC_LOW_LATENCY) != 0;
+}
+
+int SerialPort::getFd(){
+  return backend->fd();
 }
 
+void SerialPort::drain(){
+  backend->drain();
+}
 
+void SerialPort::getStats(SerialStats &stats){
+  stats.txBytes = txBytes.load(std::memory_order_relaxed);
+  stats.rxBytes = rxBytes.load(std::memory_order_relaxed);
+  stats.timeouts = timeouts.load(std::memory_order_relaxed);
+  stats.shortReads = shortReads.load(std::memory_order_relaxed);
+  writeTime.snapshot(stats.write);
+  readTime.snapshot(stats.read);
+}
 
+void SerialPort::flushPort(flush_type what){
+  backend->flush(what);
+  if(recorder && what != flush_send)
+    recorder->resync();
+}
+
+void SerialPort::setRecorder(WireRecorder *recorder){
+  this->recorder = recorder;
+}
+
+WireRecorder* SerialPort::getRecorder(){
+  return recorder;
+}
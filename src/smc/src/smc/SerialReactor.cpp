@@ -0,0 +1,543 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "smc/SerialReactor.h"
+#include "smc/WireRecorder.h"
+
+/**
+ * epoll tag of the wake eventfd, ports use their index
+ */
+#define SMC_REACTOR_WAKE SMC_MAX_PORTS
+
+SerialReactor::SerialReactor()
+  :_portCount(0),
+   _running(false),
+   _submitting(0),
+   _sleeping(false),
+   _timers(SMC_MAX_PORTS * SMC_MAX_IN_FLIGHT + SMC_MAX_PERIODIC),
+   _periodicChanged(false)
+{
+  for(int i = 0; i < SMC_MAX_PERIODIC; i++)
+    _periodic[i].state = PERIODIC::FREE;
+
+  _epoll = epoll_create1(EPOLL_CLOEXEC);
+  _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = SMC_REACTOR_WAKE;
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &ev);
+}
+
+/**
+ * Stops the reactor thread if running
+ */
+SerialReactor::~SerialReactor(){
+  stop();
+  for(int i = 0; i < _portCount; i++)
+    delete _ports[i];
+  close(_wake);
+  close(_epoll);
+}
+
+/**
+ * Registers a connected port, before start()
+ * @return index of the port for submit, -1 if it can't be added
+ */
+int SerialReactor::addPort(SerialPort *conn, size_t timeout){
+
+  if(_running || _portCount == SMC_MAX_PORTS || !conn || _epoll < 0)
+    return -1;
+
+  int fd = conn->getFd();
+  if(fd < 0)
+    return -1;
+  int flags = fcntl(fd, F_GETFL);
+  if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return -1;
+
+  int index = _portCount;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = index;
+  if(epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev))
+    return -1;
+
+  Port *port = new Port();
+  port->conn = conn;
+  port->fd = fd;
+  port->timeoutUs = (long)timeout * 1000;
+  port->baud = conn->getBaud();
+  port->failed = false;
+  port->writeWait = false;
+  port->hasNext = false;
+  port->head = port->count = 0;
+  port->txLen = port->rxLen = 0;
+
+  _ports[index] = port;
+  _portCount++;
+  return index;
+}
+
+/**
+ * @return number of registered ports
+ */
+int SerialReactor::portCount(){
+  return _portCount;
+}
+
+/**
+ * Starts the reactor thread
+ * @return 1 if running
+ */
+int SerialReactor::start(){
+  if(_running)
+    return 1;
+  if(_epoll < 0 || _wake < 0)
+    return 0;
+  _running = true;
+  _thread = std::thread(&SerialReactor::run, this);
+  return 1;
+}
+
+/**
+ * Stops the reactor thread, requests still queued or in flight
+ * complete with status 0
+ */
+void SerialReactor::stop(){
+
+  if(!_running && !_thread.joinable())
+    return;
+
+  _running = false;
+  uint64_t one = 1;
+  if(::write(_wake, &one, sizeof(one)) < 0){}
+  if(_thread.joinable())
+    _thread.join();
+
+  // a submit that saw _running may still be pushing
+  while(_submitting)
+    std::this_thread::yield();
+
+  for(int i = 0; i < _portCount; i++){
+    Port &port = *_ports[i];
+    failInFlight(port);
+    if(port.hasNext && port.next.done)
+      port.next.done(port.next.ctx, 0, NULL);
+    port.hasNext = false;
+    SMCRequest req;
+    while(port.queue.pop(req))
+      if(req.done)
+        req.done(req.ctx, 0, NULL);
+    port.txLen = 0;
+  }
+}
+
+/**
+ * @return 1 if the reactor thread is running
+ */
+int SerialReactor::isRunning(){
+  return _running;
+}
+
+/**
+ * Queues a request on a port, safe from any thread
+ * @return 1 if queued
+ */
+int SerialReactor::submit(int index, const SMCRequest &request){
+
+  if(index < 0 || index >= _portCount)
+    return 0;
+  if(request.frameLen > SMC_MAX_FRAME || request.responseLen > SMC_MAX_RESPONSE)
+    return 0;
+
+  // stop() drains the queues once no submit is between the check and
+  // the push, so a request queued here always completes
+  Port &port = *_ports[index];
+  _submitting++;
+  if(!_running || port.failed || !port.queue.push(request)){
+    _submitting--;
+    return 0;
+  }
+  _submitting--;
+
+  wake();
+  return 1;
+}
+
+/**
+ * Queues several requests on a port as one run, safe from any thread
+ * @return 1 if all were queued, 0 if none were
+ */
+int SerialReactor::submit(int index, const SMCRequest *requests, int count){
+
+  if(index < 0 || index >= _portCount || !requests || count <= 0 || count > SMC_MAX_QUEUE)
+    return 0;
+  for(int i = 0; i < count; i++)
+    if(requests[i].frameLen > SMC_MAX_FRAME || requests[i].responseLen > SMC_MAX_RESPONSE)
+      return 0;
+
+  // fill() takes them in queue order and only ever appends to the send
+  // buffer, so a run that doesn't fit one burst still leaves whole
+  Port &port = *_ports[index];
+  _submitting++;
+  if(!_running || port.failed || !port.queue.push(requests, count)){
+    _submitting--;
+    return 0;
+  }
+  _submitting--;
+
+  wake();
+  return 1;
+}
+
+/**
+ * Queues a copy of a request on a port every period, safe from any thread
+ * @return schedule id for cancel, 0 if the table is full
+ */
+int SerialReactor::every(int index, const SMCRequest &request, size_t periodMs){
+
+  if(index < 0 || index >= _portCount || !periodMs)
+    return 0;
+  if(request.frameLen > SMC_MAX_FRAME || request.responseLen > SMC_MAX_RESPONSE)
+    return 0;
+
+  for(int i = 0; i < SMC_MAX_PERIODIC; i++){
+    PERIODIC state = PERIODIC::FREE;
+    if(!_periodic[i].state.compare_exchange_strong(state, PERIODIC::CLAIMED))
+      continue;
+    _periodic[i].port = index;
+    _periodic[i].periodUs = (long)periodMs * 1000;
+    _periodic[i].request = request;
+    _periodic[i].timer = 0;
+    _periodic[i].state.store(PERIODIC::ADDED, std::memory_order_release);
+    _periodicChanged = true;
+    wake();
+    return i + 1;
+  }
+  return 0;
+}
+
+/**
+ * Stops a periodic request, safe from any thread
+ * @return 1 if it was scheduled
+ */
+int SerialReactor::cancel(int id){
+
+  if(id < 1 || id > SMC_MAX_PERIODIC)
+    return 0;
+
+  // not armed yet, the reactor never sees it
+  PERIODIC state = PERIODIC::ADDED;
+  if(_periodic[id - 1].state.compare_exchange_strong(state, PERIODIC::FREE))
+    return 1;
+  state = PERIODIC::ACTIVE;
+  if(!_periodic[id - 1].state.compare_exchange_strong(state, PERIODIC::CANCELLED))
+    return 0;
+  _periodicChanged = true;
+  wake();
+  return 1;
+}
+
+/**
+ * Interrupts epoll_wait, only pays for the syscall when the reactor is
+ * asleep
+ */
+void SerialReactor::wake(){
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(_sleeping){
+    uint64_t one = 1;
+    if(::write(_wake, &one, sizeof(one)) < 0){}
+  }
+}
+
+/**
+ * Arms added periodic requests and disarms cancelled ones
+ */
+void SerialReactor::updatePeriodic(){
+
+  if(!_periodicChanged.exchange(false))
+    return;
+
+  for(int i = 0; i < SMC_MAX_PERIODIC; i++){
+    Periodic &periodic = _periodic[i];
+    PERIODIC state = periodic.state.load(std::memory_order_acquire);
+    // once active only the reactor frees it, the request can't change
+    if(state == PERIODIC::ADDED && periodic.state.compare_exchange_strong(state, PERIODIC::ACTIVE))
+      periodic.timer = _timers.every(periodic.periodUs, &SerialReactor::period, this, i);
+    else if(state == PERIODIC::CANCELLED){
+      _timers.cancel(periodic.timer);
+      periodic.state = PERIODIC::FREE;
+    }
+  }
+}
+
+/**
+ * Timer callback of a periodic request, queues a copy
+ */
+void SerialReactor::period(void *ctx, uint32_t slot){
+
+  SerialReactor *reactor = (SerialReactor *)ctx;
+  Periodic &periodic = reactor->_periodic[slot];
+  if(periodic.state.load(std::memory_order_acquire) != PERIODIC::ACTIVE)
+    return;
+
+  Port &port = *reactor->_ports[periodic.port];
+  if(!port.failed)
+    port.queue.push(periodic.request);
+}
+
+/**
+ * Timer callback of a response deadline
+ * A late answer would be taken for the next request, so every request
+ * in flight on the port fails and what has arrived is dropped
+ */
+void SerialReactor::deadline(void *ctx, uint32_t index){
+  SerialReactor *reactor = (SerialReactor *)ctx;
+  Port &port = *reactor->_ports[index];
+  reactor->failInFlight(port);
+  tcflush(port.fd, TCIFLUSH);
+  WireRecorder *recorder = port.conn->getRecorder();
+  if(recorder)
+    recorder->resync();
+}
+
+/**
+ * @return time on the wire of some bytes at the port's baud rate
+ */
+long SerialReactor::wireUs(const Port &port, int bytes){
+  // 8N1, ten bit times per byte
+  return port.baud > 0 ? bytes * 10 * 1000000LL / port.baud : 0;
+}
+
+/**
+ * Moves queued requests into the send buffer and in-flight FIFO of a
+ * port, then writes what the kernel takes
+ */
+void SerialReactor::fill(int index){
+
+  Port &port = *_ports[index];
+  if(port.failed){
+    SMCRequest req;
+    while(port.queue.pop(req))
+      if(req.done)
+        req.done(req.ctx, 0, NULL);
+    return;
+  }
+
+  std::chrono::steady_clock::time_point now;
+  bool haveNow = false;
+
+  for(;;){
+    if(!port.hasNext){
+      if(!port.queue.pop(port.next))
+        break;
+      port.hasNext = true;
+    }
+    SMCRequest &req = port.next;
+    if(req.responseLen && port.count == SMC_MAX_IN_FLIGHT)
+      break;
+    if(port.txLen + req.frameLen > SMC_MAX_BURST)
+      break;
+
+    memcpy(port.tx + port.txLen, req.frame, req.frameLen);
+    port.txLen += req.frameLen;
+    port.hasNext = false;
+
+    if(!req.responseLen){
+      if(req.done)
+        req.done(req.ctx, 1, NULL);
+      continue;
+    }
+
+    // answers come back in order, so this one also waits for every
+    // byte queued ahead of it in both directions
+    int ahead = port.txLen + port.rxLen + req.responseLen;
+    for(int i = 0; i < port.count; i++)
+      ahead += port.inFlight[(port.head + i) % SMC_MAX_IN_FLIGHT].responseLen;
+
+    if(!haveNow){
+      now = std::chrono::steady_clock::now();
+      haveNow = true;
+    }
+    int tail = (port.head + port.count) % SMC_MAX_IN_FLIGHT;
+    SMCPending &pending = port.inFlight[tail];
+    pending.responseLen = req.responseLen;
+    pending.done = req.done;
+    pending.ctx = req.ctx;
+    port.timers[tail] = _timers.schedule(now + std::chrono::microseconds(port.timeoutUs + wireUs(port, ahead)),
+                                         &SerialReactor::deadline, this, index);
+    port.count++;
+  }
+
+  flush(index);
+}
+
+/**
+ * Writes as much of a port's send buffer as the kernel takes
+ */
+void SerialReactor::flush(int index){
+
+  Port &port = *_ports[index];
+  WireRecorder *recorder = port.conn->getRecorder();
+  int written = 0;
+
+  while(written < port.txLen){
+    ssize_t n = ::write(port.fd, port.tx + written, port.txLen - written);
+    if(n > 0){
+      if(recorder)
+        recorder->sent(port.tx + written, n);
+      written += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == EAGAIN)
+      break;
+    fail(index);
+    return;
+  }
+
+  port.txLen -= written;
+  if(written && port.txLen)
+    memmove(port.tx, port.tx + written, port.txLen);
+  watchWrite(index, port.txLen > 0);
+}
+
+/**
+ * Arms or disarms EPOLLOUT on a port
+ */
+void SerialReactor::watchWrite(int index, bool on){
+
+  Port &port = *_ports[index];
+  if(port.writeWait == on)
+    return;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (on ? (uint32_t)EPOLLOUT : 0u);
+  ev.data.u32 = index;
+  epoll_ctl(_epoll, EPOLL_CTL_MOD, port.fd, &ev);
+  port.writeWait = on;
+}
+
+/**
+ * Reads what a port has received and completes answered requests
+ */
+void SerialReactor::receive(int index){
+
+  Port &port = *_ports[index];
+  WireRecorder *recorder = port.conn->getRecorder();
+
+  for(;;){
+    ssize_t n = ::read(port.fd, port.rx + port.rxLen, sizeof(port.rx) - port.rxLen);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == EAGAIN)
+      break;
+    if(n <= 0){
+      fail(index);
+      return;
+    }
+    if(recorder)
+      recorder->received(port.rx + port.rxLen, n);
+    port.rxLen += n;
+
+    int used = 0;
+    while(port.count && port.rxLen - used >= port.inFlight[port.head].responseLen){
+      SMCPending &pending = port.inFlight[port.head];
+      _timers.cancel(port.timers[port.head]);
+      if(pending.done)
+        pending.done(pending.ctx, 1, port.rx + used);
+      used += pending.responseLen;
+      port.head = (port.head + 1) % SMC_MAX_IN_FLIGHT;
+      port.count--;
+    }
+    // bytes nobody asked for can't be matched to anything
+    if(!port.count)
+      used = port.rxLen;
+    port.rxLen -= used;
+    if(used && port.rxLen)
+      memmove(port.rx, port.rx + used, port.rxLen);
+  }
+}
+
+/**
+ * Fails every in-flight request of a port with status 0
+ */
+void SerialReactor::failInFlight(Port &port){
+  while(port.count){
+    SMCPending &pending = port.inFlight[port.head];
+    _timers.cancel(port.timers[port.head]);
+    if(pending.done)
+      pending.done(pending.ctx, 0, NULL);
+    port.head = (port.head + 1) % SMC_MAX_IN_FLIGHT;
+    port.count--;
+  }
+  port.rxLen = 0;
+}
+
+/**
+ * Takes a port whose descriptor failed out of service
+ */
+void SerialReactor::fail(int index){
+
+  Port &port = *_ports[index];
+  port.failed = true;
+  epoll_ctl(_epoll, EPOLL_CTL_DEL, port.fd, NULL);
+  port.writeWait = false;
+  port.txLen = 0;
+  failInFlight(port);
+}
+
+/**
+ * Reactor thread body
+ */
+void SerialReactor::run(){
+
+  struct epoll_event events[SMC_MAX_PORTS + 1];
+
+  while(_running){
+    updatePeriodic();
+    _timers.advance(std::chrono::steady_clock::now());
+    for(int i = 0; i < _portCount; i++)
+      fill(i);
+
+    int timeout = _timers.waitMs(std::chrono::steady_clock::now());
+
+    // a submit after this point sees _sleeping and writes the eventfd
+    _sleeping = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(_periodicChanged)
+      timeout = 0;
+    for(int i = 0; i < _portCount && timeout; i++)
+      if(!_ports[i]->hasNext && !_ports[i]->queue.empty())
+        timeout = 0;
+
+    int n = epoll_wait(_epoll, events, SMC_MAX_PORTS + 1, _running ? timeout : 0);
+    _sleeping = false;
+
+    for(int i = 0; i < n; i++){
+      uint32_t tag = events[i].data.u32;
+      if(tag == SMC_REACTOR_WAKE){
+        uint64_t count;
+        if(::read(_wake, &count, sizeof(count)) < 0){}
+        continue;
+      }
+      Port &port = *_ports[tag];
+      if(port.failed)
+        continue;
+      if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        receive(tag);
+      if(!port.failed && events[i].events & EPOLLOUT)
+        flush(tag);
+    }
+  }
+}
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+
+#include "smc/SetpointEncoder.h"
+
+#define SMC_SETPOINT_VALID (1ULL << 63)
+
+SetpointEncoder::SetpointEncoder()
+  :_busCount(0),
+   _tolerance(0),
+   _refreshMs(SMC_SETPOINT_REFRESH_MS),
+   _ssc(false),
+   _sscOffset(0),
+   _origin(std::chrono::steady_clock::now()),
+   _frames(0),
+   _suppressed(0),
+   _bytes(0),
+   _fullBytes(0)
+{
+  for(int i = 0; i < SMC_MAX_SETPOINT_DEVICES; i++)
+    _bus[i] = 0;
+  for(int i = 0; i <= SMC_BROADCAST; i++)
+    _last[i] = 0;
+  for(int i = 0; i < 5; i++)
+    _formats[i] = 0;
+}
+
+/**
+ * @param tolerance largest difference from the speed asked for a
+ * shorter frame may have
+ */
+void SetpointEncoder::setTolerance(uint16_t tolerance){
+  _tolerance = tolerance;
+}
+
+/**
+ * @param ms time after which an unchanged speed is sent again
+ */
+void SetpointEncoder::setRefresh(uint32_t ms){
+  _refreshMs = ms;
+}
+
+/**
+ * Devices on the bus, a speed for all of them is broadcast
+ * @return 1 if set
+ */
+int SetpointEncoder::setBus(const uint8_t *devices, int count){
+
+  if(count < 0 || count > SMC_MAX_SETPOINT_DEVICES || (count && !devices))
+    return 0;
+  for(int i = 0; i < count; i++)
+    if(devices[i] > 127)
+      return 0;
+
+  _busCount = 0;
+  for(int i = 0; i < count; i++)
+    _bus[i] = devices[i];
+  _busCount = count;
+  forget(SMC_BROADCAST);
+  return 1;
+}
+
+/**
+ * Lets single device frames use Mini SSC
+ */
+void SetpointEncoder::setMiniSsc(bool enabled, uint8_t offset){
+  _sscOffset = offset;
+  _ssc = enabled;
+}
+
+/**
+ * @return ms since the encoder was made
+ */
+uint64_t SetpointEncoder::now(){
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - _origin).count();
+}
+
+/**
+ * @return true if a device was last sent this speed recently enough
+ */
+bool SetpointEncoder::current(int index, int16_t speed, uint64_t now){
+
+  uint64_t last = _last[index].load(std::memory_order_relaxed);
+  if(!(last & SMC_SETPOINT_VALID) || (int16_t)(last & 0xffff) != speed)
+    return false;
+  uint32_t refresh = _refreshMs;
+  return !refresh || now - ((last & ~SMC_SETPOINT_VALID) >> 16) < refresh;
+}
+
+void SetpointEncoder::remember(int index, int16_t speed, uint64_t now){
+  _last[index].store(SMC_SETPOINT_VALID | (now << 16) | (uint16_t)speed, std::memory_order_relaxed);
+}
+
+/**
+ * @return true if a device set is the whole bus
+ */
+bool SetpointEncoder::isBus(const uint8_t *devices, int count){
+
+  int busCount = _busCount;
+  if(!busCount || count != busCount)
+    return false;
+  for(int i = 0; i < busCount; i++){
+    uint8_t device = _bus[i];
+    int j = 0;
+    while(j < count && devices[j] != device)
+      j++;
+    if(j == count)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * Encodes the 7-bit speed step nearest to a speed
+ * @param device ID of device, SMC_BROADCAST for a compact frame
+ * @param sent returns the speed the controller makes of it
+ * @return frame length
+ */
+int SetpointEncoder::encode7Bit(char *frame, int device, int16_t speed, int16_t &sent){
+
+  // the controller scales a step by 3200 / 127, rounding down
+  int target = abs(speed);
+  int step = target * 127 / 3200;
+  if(step < 127 && (step + 1) * 3200 / 127 - target < target - step * 3200 / 127)
+    step++;
+  sent = step * 3200 / 127;
+  if(speed < 0)
+    sent = -sent;
+
+  if(device == SMC_BROADCAST)
+    return speed < 0 ? encodeCompact<POLOLU_COM::MOTOR_REVERSE_7BIT>(frame, (uint8_t)step) :
+                       encodeCompact<POLOLU_COM::MOTOR_FORWARD_7BIT>(frame, (uint8_t)step);
+  return speed < 0 ? encodePololu<POLOLU_COM::MOTOR_REVERSE_7BIT>(frame, device, (uint8_t)step) :
+                     encodePololu<POLOLU_COM::MOTOR_FORWARD_7BIT>(frame, device, (uint8_t)step);
+}
+
+void SetpointEncoder::tally(SETPOINT_FORMAT format, int len, int fullLen){
+  _frames++;
+  _bytes += len;
+  _fullBytes += fullLen;
+  _formats[(int)format]++;
+}
+
+/**
+ * Encodes the frames that bring devices to a speed
+ * @return number of frames, 0 if all were left out, -1 if an argument
+ * is out of range
+ */
+int SetpointEncoder::encode(const uint8_t *devices, int count, int16_t speed, char *frames, int *lens, uint8_t *slots){
+
+  if(speed > 3200 || speed < -3200)
+    return -1;
+  if(devices && (count <= 0 || count > SMC_MAX_SETPOINT_DEVICES))
+    return -1;
+  for(int i = 0; devices && i < count; i++)
+    if(devices[i] > 127)
+      return -1;
+
+  uint64_t time = now();
+  uint16_t tolerance = _tolerance;
+  int fullLen = Command<POLOLU_COM::MOTOR_FORWARD>::pololuLen;
+
+  if(!devices || isBus(devices, count)){
+    int16_t sent;
+    char *frame = frames;
+    int len = encode7Bit(frame, SMC_BROADCAST, speed, sent);
+    SETPOINT_FORMAT format = SETPOINT_FORMAT::COMPACT_7BIT;
+    if(abs(sent - speed) > tolerance){
+      sent = speed;
+      format = SETPOINT_FORMAT::COMPACT;
+      len = speed < 0 ? encodeCompact<POLOLU_COM::MOTOR_REVERSE>(frame, (uint16_t)-speed) :
+                        encodeCompact<POLOLU_COM::MOTOR_FORWARD>(frame, (uint16_t)speed);
+    }
+
+    // without a known bus only the last broadcast says what they have
+    int busCount = _busCount;
+    bool same = busCount ? true : current(SMC_BROADCAST, sent, time);
+    for(int i = 0; i < busCount && same; i++)
+      same = current(_bus[i], sent, time);
+    if(same){
+      _suppressed++;
+      return 0;
+    }
+
+    remember(SMC_BROADCAST, sent, time);
+    for(int i = 0; i < busCount; i++)
+      remember(_bus[i], sent, time);
+    tally(format, len, fullLen * (busCount ? busCount : 1));
+    lens[0] = len;
+    slots[0] = SMC_BROADCAST;
+    return 1;
+  }
+
+  bool ssc = _ssc;
+  uint8_t sscOffset = _sscOffset;
+  int n = 0;
+
+  for(int i = 0; i < count; i++){
+    uint8_t device = devices[i];
+    char *frame = frames + n * SMC_MAX_FRAME;
+    int16_t sent;
+    SETPOINT_FORMAT format = SETPOINT_FORMAT::POLOLU_7BIT;
+    int len = encode7Bit(frame, device, speed, sent);
+
+    if(abs(sent - speed) > tolerance){
+      sent = speed;
+      format = SETPOINT_FORMAT::POLOLU;
+      len = speed < 0 ? encodePololu<POLOLU_COM::MOTOR_REVERSE>(frame, device, (uint16_t)-speed) :
+                        encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, device, (uint16_t)speed);
+    }
+    else if(ssc && device + sscOffset <= 254){
+      // same steps one byte shorter, but rounded its own way
+      char sscFrame[SMC_MAX_FRAME];
+      int sscLen = encodeSsc(sscFrame, device + sscOffset, speed);
+      int16_t sscSent = ((int)(uint8_t)sscFrame[2] - 127) * 3200 / 127;
+      if(abs(sscSent - speed) <= tolerance){
+        for(int j = 0; j < sscLen; j++)
+          frame[j] = sscFrame[j];
+        len = sscLen;
+        sent = sscSent;
+        format = SETPOINT_FORMAT::MINI_SSC;
+      }
+    }
+
+    if(current(device, sent, time)){
+      _suppressed++;
+      continue;
+    }
+    remember(device, sent, time);
+    // a broadcast of the same speed no longer describes every device
+    _last[SMC_BROADCAST] = 0;
+
+    tally(format, len, fullLen);
+    lens[n] = len;
+    slots[n] = device;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * Forgets the speed sent to a device
+ * @param device ID of device, SMC_BROADCAST for every device
+ */
+void SetpointEncoder::forget(uint8_t device){
+
+  if(device < SMC_BROADCAST){
+    _last[device] = 0;
+    _last[SMC_BROADCAST] = 0;
+    return;
+  }
+  for(int i = 0; i <= SMC_BROADCAST; i++)
+    _last[i] = 0;
+}
+
+/**
+ * Copies the counters
+ */
+void SetpointEncoder::getStats(SetpointEncoderStats &stats){
+  stats.frames = _frames;
+  stats.suppressed = _suppressed;
+  stats.bytes = _bytes;
+  stats.fullBytes = _fullBytes;
+  for(int i = 0; i < 5; i++)
+    stats.formats[i] = _formats[i];
+}
@@ -0,0 +1,555 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "smc/Simulator.h"
+#include "smc/frames.h"
+
+Simulator::Simulator()
+  :_master(-1),
+   _slave(-1),
+   _running(false),
+   _baud(0),
+   _delayUs(0),
+   _sscOffset(0),
+   _dropRate(0),
+   _corruptRate(0),
+   _random(1),
+   _frameLen(0),
+   _frameNeed(0),
+   _frames(0),
+   _responses(0),
+   _dropped(0),
+   _corrupted(0),
+   _collisions(0),
+   _serialErrors(0)
+{
+  memset(_devices, 0, sizeof(_devices));
+}
+
+/**
+ * Stops the simulator if running
+ */
+Simulator::~Simulator(){
+  stop();
+}
+
+/**
+ * Adds a device, all devices start in safe start
+ */
+void Simulator::addDevice(uint8_t device, uint16_t productID, uint8_t major, uint8_t minor){
+
+  if(device > 127)
+    return;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  Device &dev = _devices[device];
+  memset(&dev, 0, sizeof(dev));
+  dev.present = true;
+  dev.safeStart = true;
+  dev.productID = productID;
+  dev.major = major;
+  dev.minor = minor;
+
+  dev.vars[(int)SMC_VAR::ERROR_STATUS] = (uint16_t)ERROR_STATUS::SAFE_START;
+  dev.vars[(int)SMC_VAR::ERRORS] = (uint16_t)ERROR_STATUS::SAFE_START;
+  dev.vars[(int)SMC_VAR::LIMIT_STATUS] = (uint16_t)LIMIT_STATUS::SAFE_START;
+  dev.vars[(int)SMC_VAR::RESET_FLAGS] = (uint16_t)RESET_FLAGS::PWR;
+  dev.vars[(int)SMC_VAR::RC1_UNLIMITED_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::RC1_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::RC2_UNLIMITED_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::RC2_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::AN1_UNLIMITED_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::AN1_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::AN2_UNLIMITED_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::AN2_RAW] = 0xFFFF;
+  dev.vars[(int)SMC_VAR::INPUT_VOLTAGE] = 12000;
+  dev.vars[(int)SMC_VAR::TEMPERATURE] = 300;
+  dev.vars[(int)SMC_VAR::MAX_PWM_FORWARD] = 3200;
+  dev.vars[(int)SMC_VAR::MAX_PWM_REVERSE] = 3200;
+  if(_baud > 0)
+    dev.vars[(int)SMC_VAR::BAUD_RATE_REGISTER] = 72000000 / _baud;
+
+  for(int i = 0; i < 128; i++)
+    _answers.erase(device << 7 | i);
+}
+
+/**
+ * Removes a device, it stops answering
+ */
+void Simulator::removeDevice(uint8_t device){
+  if(device > 127)
+    return;
+  std::lock_guard<std::mutex> lock(_mutex);
+  _devices[device].present = false;
+}
+
+/**
+ * Emulates the wire time of a baud rate, 0 to disable
+ */
+void Simulator::setBaud(int baud){
+  _baud = baud;
+  std::lock_guard<std::mutex> lock(_mutex);
+  for(int i = 0; i < 128; i++)
+    _devices[i].vars[(int)SMC_VAR::BAUD_RATE_REGISTER] = baud > 0 ? 72000000 / baud : 0;
+}
+
+/**
+ * Time the device takes before it starts a response
+ */
+void Simulator::setResponseDelay(long us){
+  _delayUs = us;
+}
+
+/**
+ * Mini SSC servo number of device 0
+ */
+void Simulator::setMiniSscOffset(uint8_t offset){
+  _sscOffset = offset;
+}
+
+/**
+ * Fault injection
+ */
+void Simulator::setFaults(double dropRate, double corruptRate, unsigned seed){
+  _dropRate = dropRate;
+  _corruptRate = corruptRate;
+  _random.seed(seed);
+}
+
+/**
+ * Sets a variable of a device
+ */
+void Simulator::setVariable(uint8_t device, SMC_VAR variable, uint16_t val){
+  if(device > 127)
+    return;
+  std::lock_guard<std::mutex> lock(_mutex);
+  _devices[device].vars[(int)variable & 0x7F] = val;
+}
+
+/**
+ * @return a variable of a device as the host would read it
+ */
+uint16_t Simulator::getVariable(uint8_t device, SMC_VAR variable){
+  if(device > 127)
+    return 0;
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _devices[device].vars[(int)variable & 0x7F];
+}
+
+/**
+ * Queues the answer to a later GET_SMC_VAR of a variable
+ */
+void Simulator::queueAnswer(uint8_t device, SMC_VAR variable, uint16_t val){
+  if(device > 127)
+    return;
+  std::lock_guard<std::mutex> lock(_mutex);
+  _answers[device << 7 | ((int)variable & 0x7F)].push_back(val);
+}
+
+/**
+ * Opens the pseudo-terminal and starts serving it
+ * @return 1 if running
+ */
+int Simulator::start(){
+
+  if(_running)
+    return 1;
+
+  _master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(_master < 0)
+    return 0;
+
+  char name[128];
+  if(grantpt(_master) || unlockpt(_master) || ptsname_r(_master, name, sizeof(name))){
+    close(_master);
+    _master = -1;
+    return 0;
+  }
+  _path = name;
+
+  // raw line, kept open so the settings outlive client connections
+  _slave = open(name, O_RDWR | O_NOCTTY);
+  if(_slave >= 0){
+    struct termios tio;
+    tcgetattr(_slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(_slave, TCSANOW, &tio);
+  }
+
+  _started = _rxWire = _txWire = std::chrono::steady_clock::now();
+  _frameLen = _frameNeed = 0;
+  _running = true;
+  _thread = std::thread(&Simulator::run, this);
+  return 1;
+}
+
+/**
+ * Stops serving and closes the pseudo-terminal
+ */
+void Simulator::stop(){
+
+  _running = false;
+  if(_thread.joinable())
+    _thread.join();
+
+  if(_slave >= 0)
+    close(_slave);
+  if(_master >= 0)
+    close(_master);
+  _slave = _master = -1;
+  _outputs.clear();
+}
+
+/**
+ * @return path of the serial device to connect to, empty until started
+ */
+std::string Simulator::getPath(){
+  return _path;
+}
+
+/**
+ * @return a copy of the counters
+ */
+SimStats Simulator::getStats(){
+  SimStats stats;
+  stats.frames = _frames;
+  stats.responses = _responses;
+  stats.dropped = _dropped;
+  stats.corrupted = _corrupted;
+  stats.collisions = _collisions;
+  stats.serialErrors = _serialErrors;
+  return stats;
+}
+
+/**
+ * @return time on the wire of some bytes at the emulated baud rate
+ */
+long Simulator::wireUs(int bytes){
+  // 8N1, ten bit times per byte
+  return _baud > 0 ? bytes * 10 * 1000000LL / _baud : 0;
+}
+
+/**
+ * Simulator thread body, decodes received bytes and writes scheduled
+ * responses once their wire time has passed
+ */
+void Simulator::run(){
+
+  uint8_t buf[256];
+
+  while(_running){
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    // wake for the next due response, or now and then to check _running
+    long waitUs = 20000;
+    if(!_outputs.empty()){
+      long due = std::chrono::duration_cast<std::chrono::microseconds>(_outputs.front().due - now).count();
+      waitUs = due < 0 ? 0 : (due < waitUs ? due : waitUs);
+    }
+    struct timespec ts;
+    ts.tv_sec = waitUs / 1000000;
+    ts.tv_nsec = (waitUs % 1000000) * 1000;
+    struct pollfd pfd;
+    pfd.fd = _master;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ready = ppoll(&pfd, 1, &ts, NULL);
+
+    now = std::chrono::steady_clock::now();
+    while(!_outputs.empty() && _outputs.front().due <= now){
+      if(::write(_master, _outputs.front().bytes, _outputs.front().len) > 0)
+        _responses++;
+      _outputs.pop_front();
+    }
+
+    if(ready <= 0 || !(pfd.revents & POLLIN))
+      continue;
+
+    ssize_t got = read(_master, buf, sizeof(buf));
+    for(ssize_t i = 0; i < got; i++){
+      // bytes reach the device one after another at the baud rate
+      if(_rxWire < now)
+        _rxWire = now;
+      _rxWire += std::chrono::microseconds(wireUs(1));
+      receive(buf[i]);
+    }
+  }
+}
+
+/**
+ * Feeds one byte to the frame decoder
+ */
+void Simulator::receive(uint8_t byte){
+
+  // Mini SSC data bytes may have bit 7 set
+  bool ssc = _frameNeed && _frame[0] == (uint8_t)SSC_COM::SSC_PWM;
+
+  if(byte & 0x80 && !(ssc && byte != 0xFF)){
+    if(_frameNeed)
+      serialError((uint16_t)SERIAL_ERROR::FORMAT);
+
+    _frame[0] = byte;
+    _frameLen = 1;
+    if(byte == (uint8_t)POLOLU_COM::HEADER || byte == (uint8_t)SSC_COM::SSC_PWM)
+      _frameNeed = 3;
+    else{
+      int payload = payloadLen(byte & 0x7F);
+      if(payload < 0){
+        serialError((uint16_t)SERIAL_ERROR::FORMAT);
+        _frameNeed = 0;
+        return;
+      }
+      _frameNeed = 1 + payload;
+    }
+  }
+  else if(_frameNeed)
+    _frame[_frameLen++] = byte;
+  else{
+    // data byte outside of a frame
+    serialError((uint16_t)SERIAL_ERROR::FORMAT);
+    return;
+  }
+
+  // the pololu format length is known once the command byte is in
+  if(_frame[0] == (uint8_t)POLOLU_COM::HEADER && _frameLen == 3){
+    int payload = payloadLen(_frame[2]);
+    if(payload < 0){
+      serialError((uint16_t)SERIAL_ERROR::FORMAT);
+      _frameNeed = 0;
+      return;
+    }
+    _frameNeed = 3 + payload;
+  }
+
+  if(_frameLen < _frameNeed)
+    return;
+  _frameNeed = 0;
+  _frames++;
+
+  if(_frame[0] == (uint8_t)SSC_COM::SSC_PWM){
+    int device = _frame[1] - _sscOffset;
+    if(device < 0 || device > 127 || _frame[2] == 0xFF)
+      return;
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_devices[device].present)
+      setSpeed(_devices[device], ((int)_frame[2] - 127) * 3200 / 127);
+  }
+  else if(_frame[0] == (uint8_t)POLOLU_COM::HEADER)
+    execute(false, _frame[1], _frame[2], _frame + 3);
+  else
+    execute(true, 0, _frame[0] & 0x7F, _frame + 1);
+}
+
+/**
+ * Runs a decoded command on one device or, in compact format, on all
+ */
+void Simulator::execute(bool compact, uint8_t device, uint8_t command, const uint8_t *data){
+
+  uint8_t response[SMC_MAX_RESPONSE];
+  uint8_t combined[SMC_MAX_RESPONSE];
+  int len = 0;
+  int responders = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for(int id = 0; id < 128; id++){
+      if(!_devices[id].present || (!compact && id != device))
+        continue;
+      int n = apply(_devices[id], command, data, response);
+      if(n <= 0)
+        continue;
+      // every device drives the shared TX line, a zero bit wins
+      if(!responders)
+        memcpy(combined, response, n);
+      else
+        for(int i = 0; i < n; i++)
+          combined[i] &= response[i];
+      len = n;
+      responders++;
+    }
+  }
+
+  if(responders > 1)
+    _collisions++;
+  if(len)
+    respond(combined, len);
+}
+
+/**
+ * Applies a command to a device
+ * @param response filled with the reply
+ * @return reply length, 0 if none
+ */
+int Simulator::apply(Device &dev, uint8_t command, const uint8_t *data, uint8_t *response){
+
+  switch((POLOLU_COM)command){
+
+  case POLOLU_COM::EXIT_SS:
+    dev.safeStart = false;
+    dev.vars[(int)SMC_VAR::ERROR_STATUS] &= ~(uint16_t)ERROR_STATUS::SAFE_START;
+    dev.vars[(int)SMC_VAR::LIMIT_STATUS] &= ~(uint16_t)LIMIT_STATUS::SAFE_START;
+    return 0;
+
+  case POLOLU_COM::MOTOR_FORWARD:
+    setSpeed(dev, data[0] + (data[1] << 5));
+    return 0;
+
+  case POLOLU_COM::MOTOR_REVERSE:
+    setSpeed(dev, -(data[0] + (data[1] << 5)));
+    return 0;
+
+  case POLOLU_COM::MOTOR_FORWARD_7BIT:
+    setSpeed(dev, data[0] * 3200 / 127);
+    return 0;
+
+  case POLOLU_COM::MOTOR_REVERSE_7BIT:
+    setSpeed(dev, -(data[0] * 3200 / 127));
+    return 0;
+
+  case POLOLU_COM::MOTOR_BRAKE:
+    setSpeed(dev, 0);
+    dev.vars[(int)SMC_VAR::BRAKE_AMOUNT] = data[0] > 32 ? 32 : data[0];
+    return 0;
+
+  case POLOLU_COM::MOTOR_STOP:
+    setSpeed(dev, 0);
+    dev.safeStart = true;
+    dev.vars[(int)SMC_VAR::ERROR_STATUS] |= (uint16_t)ERROR_STATUS::SAFE_START;
+    dev.vars[(int)SMC_VAR::ERRORS] |= (uint16_t)ERROR_STATUS::SAFE_START;
+    dev.vars[(int)SMC_VAR::LIMIT_STATUS] |= (uint16_t)LIMIT_STATUS::SAFE_START;
+    return 0;
+
+  case POLOLU_COM::SET_LIMIT: {
+    uint8_t id = data[0];
+    uint16_t val = data[1] | (data[2] << 7);
+    if(id > (uint8_t)SOFT_LIMIT::BRAKE_DURATION_REVERSE){
+      serialErrorLocked((uint16_t)SERIAL_ERROR::FORMAT);
+      return 0;
+    }
+    // low two bits pick the limit, the rest both/forward/reverse
+    int which = id & 0x03;
+    int dir = id >> 2;
+    if(dir != 2)
+      dev.vars[(int)SMC_VAR::MAX_PWM_FORWARD + which] = val;
+    if(dir != 1)
+      dev.vars[(int)SMC_VAR::MAX_PWM_REVERSE + which] = val;
+    response[0] = 0;
+    return 1;
+  }
+
+  case POLOLU_COM::GET_SMC_VAR: {
+    uint8_t id = data[0];
+    uint16_t val;
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - _started).count();
+    std::map<uint16_t, std::deque<uint16_t>>::iterator queued = _answers.find((&dev - _devices) << 7 | (id & 0x7F));
+    if(queued != _answers.end() && !queued->second.empty()){
+      val = queued->second.front();
+      queued->second.pop_front();
+    }
+    else if(id == (uint8_t)SMC_VAR::SYSTEM_TIME_LOW)
+      val = ms & 0xFFFF;
+    else if(id == (uint8_t)SMC_VAR::SYSTEM_TIME_HIGH)
+      val = (ms >> 16) & 0xFFFF;
+    else
+      val = dev.vars[id];
+    // these two clear when read
+    if(id == (uint8_t)SMC_VAR::ERRORS || id == (uint8_t)SMC_VAR::SERIAL_ERRORS)
+      dev.vars[id] = 0;
+    response[0] = val & 0xFF;
+    response[1] = val >> 8;
+    return 2;
+  }
+
+  case POLOLU_COM::GET_FIRMWARE:
+    response[0] = dev.productID & 0xFF;
+    response[1] = dev.productID >> 8;
+    response[2] = dev.minor;
+    response[3] = dev.major;
+    return 4;
+
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Sets the target and current pwm of a device within its limits
+ * @param speed -3200 to 3200
+ */
+void Simulator::setSpeed(Device &dev, int speed){
+
+  if(speed > 3200)
+    speed = 3200;
+  if(speed < -3200)
+    speed = -3200;
+
+  dev.vars[(int)SMC_VAR::TARGET_PWM] = (uint16_t)(int16_t)speed;
+
+  int max = speed >= 0 ? dev.vars[(int)SMC_VAR::MAX_PWM_FORWARD]
+                       : dev.vars[(int)SMC_VAR::MAX_PWM_REVERSE];
+  uint16_t limits = dev.vars[(int)SMC_VAR::LIMIT_STATUS] & ~(uint16_t)LIMIT_STATUS::MAX_PWM;
+  if(speed > max || -speed > max){
+    speed = speed > 0 ? max : -max;
+    limits |= (uint16_t)LIMIT_STATUS::MAX_PWM;
+  }
+  dev.vars[(int)SMC_VAR::LIMIT_STATUS] = limits;
+
+  if(dev.safeStart)
+    speed = 0;
+  dev.vars[(int)SMC_VAR::CURRENT_PWM] = (uint16_t)(int16_t)speed;
+  if(speed)
+    dev.vars[(int)SMC_VAR::BRAKE_AMOUNT] = 0xFF;
+}
+
+/**
+ * Schedules a response after the frame that caused it has arrived
+ * and the response delay has passed
+ */
+void Simulator::respond(const uint8_t *response, int len){
+
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+  if(_dropRate > 0 && chance(_random) < _dropRate){
+    _dropped++;
+    return;
+  }
+
+  Output out;
+  memcpy(out.bytes, response, len);
+  out.len = len;
+
+  if(_corruptRate > 0 && chance(_random) < _corruptRate){
+    out.bytes[_random() % len] ^= 1 << (_random() % 8);
+    _corrupted++;
+  }
+
+  std::chrono::steady_clock::time_point start = _rxWire + std::chrono::microseconds(_delayUs);
+  if(start < _txWire)
+    start = _txWire;
+  out.due = _txWire = start + std::chrono::microseconds(wireUs(len));
+  _outputs.push_back(out);
+}
+
+/**
+ * Records a serial error on every device
+ */
+void Simulator::serialError(uint16_t bit){
+  std::lock_guard<std::mutex> lock(_mutex);
+  serialErrorLocked(bit);
+}
+
+/**
+ * Records a serial error on every device, _mutex held
+ */
+void Simulator::serialErrorLocked(uint16_t bit){
+  _serialErrors++;
+  for(int i = 0; i < 128; i++){
+    _devices[i].vars[(int)SMC_VAR::SERIAL_ERRORS] |= bit;
+    _devices[i].vars[(int)SMC_VAR::ERRORS] |= (uint16_t)ERROR_STATUS::SERIAL_ERROR;
+  }
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string>
+
+#include "smc/Stats.h"
+#include "smc/defs.h"
+
+namespace {
+
+struct CommandName {
+  uint8_t command;
+  const char *name;
+};
+
+const CommandName commandNames[SMC_STAT_COMMANDS] = {
+  { (uint8_t)POLOLU_COM::EXIT_SS,            "EXIT_SS" },
+  { (uint8_t)POLOLU_COM::MOTOR_FORWARD,      "MOTOR_FORWARD" },
+  { (uint8_t)POLOLU_COM::MOTOR_REVERSE,      "MOTOR_REVERSE" },
+  { (uint8_t)POLOLU_COM::MOTOR_FORWARD_7BIT, "MOTOR_FORWARD_7BIT" },
+  { (uint8_t)POLOLU_COM::MOTOR_REVERSE_7BIT, "MOTOR_REVERSE_7BIT" },
+  { (uint8_t)POLOLU_COM::MOTOR_BRAKE,        "MOTOR_BRAKE" },
+  { (uint8_t)POLOLU_COM::MOTOR_STOP,         "MOTOR_STOP" },
+  { (uint8_t)POLOLU_COM::SET_LIMIT,          "SET_LIMIT" },
+  { (uint8_t)POLOLU_COM::GET_SMC_VAR,        "GET_SMC_VAR" },
+  { (uint8_t)POLOLU_COM::GET_FIRMWARE,       "GET_FIRMWARE" },
+  { (uint8_t)SSC_COM::SSC_PWM,               "SSC_PWM" }
+};
+
+/**
+ * Writes one histogram, bounds in seconds as Prometheus expects
+ */
+void writeHistogram(FILE *f, const char *name, const char *labels, const HistogramSnapshot &h){
+
+  const char *sep = labels[0] ? "," : "";
+  uint64_t cumulative = 0;
+
+  for(int i = 0; i < SMC_HISTOGRAM_BUCKETS - 1; i++){
+    cumulative += h.buckets[i];
+    fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+            Histogram::bound(i) / 1e6, (unsigned long long)cumulative);
+  }
+  fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)h.count);
+  if(labels[0]){
+    fprintf(f, "%s_sum{%s} %g\n", name, labels, h.sumUs / 1e6);
+    fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h.count);
+  }
+  else{
+    fprintf(f, "%s_sum %g\n", name, h.sumUs / 1e6);
+    fprintf(f, "%s_count %llu\n", name, (unsigned long long)h.count);
+  }
+}
+
+void writeCounter(FILE *f, const char *name, const char *help, uint64_t val){
+  fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)val);
+}
+
+}
+
+Histogram::Histogram()
+  :_sumUs(0)
+{
+  for(int i = 0; i < SMC_HISTOGRAM_BUCKETS; i++)
+    _buckets[i].store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Copies the counts
+ */
+void Histogram::snapshot(HistogramSnapshot &out) const {
+  out.count = 0;
+  for(int i = 0; i < SMC_HISTOGRAM_BUCKETS; i++){
+    out.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+    out.count += out.buckets[i];
+  }
+  out.sumUs = _sumUs.load(std::memory_order_relaxed);
+}
+
+/**
+ * @return inclusive upper bound of a bucket in us, 0 for the last one
+ */
+uint64_t Histogram::bound(int bucket){
+  if(bucket >= SMC_HISTOGRAM_BUCKETS - 1)
+    return 0;
+  return (uint64_t)1 << bucket;
+}
+
+CommandMetrics::CommandMetrics()
+  :_retries(0)
+{
+  for(int i = 0; i < SMC_STAT_COMMANDS; i++)
+    _failures[i].store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @return index of a command type, -1 if not counted
+ */
+int CommandMetrics::index(uint8_t command){
+  for(int i = 0; i < SMC_STAT_COMMANDS; i++)
+    if(commandNames[i].command == command)
+      return i;
+  return -1;
+}
+
+/**
+ * @return command type of an encoded frame
+ */
+uint8_t CommandMetrics::command(const char *frame){
+  uint8_t first = (uint8_t)frame[0];
+  if(first == (uint8_t)POLOLU_COM::HEADER)
+    return (uint8_t)frame[2];
+  if(first == (uint8_t)SSC_COM::SSC_PWM)
+    return first;
+  return first & 0x7F;
+}
+
+/**
+ * @return name of a command type, NULL if not counted
+ */
+const char* CommandMetrics::name(uint8_t command){
+  int i = index(command);
+  return i < 0 ? NULL : commandNames[i].name;
+}
+
+/**
+ * Copies the per command counters
+ */
+void CommandMetrics::snapshot(SMCStats &out) const {
+  for(int i = 0; i < SMC_STAT_COMMANDS; i++){
+    out.commands[i].command = commandNames[i].command;
+    out.commands[i].name = commandNames[i].name;
+    out.commands[i].failures = _failures[i].load(std::memory_order_relaxed);
+    _latency[i].snapshot(out.commands[i].latency);
+  }
+  out.retries = _retries.load(std::memory_order_relaxed);
+}
+
+/**
+ * Writes stats in the Prometheus text format
+ * @return 1 if written
+ */
+int writePrometheus(const SMCStats &stats, const char *path){
+
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if(!f)
+    return 0;
+
+  char labels[64];
+
+  fprintf(f, "# HELP smc_command_latency_seconds Time spent in a call, including retries\n");
+  fprintf(f, "# TYPE smc_command_latency_seconds histogram\n");
+  for(int i = 0; i < SMC_STAT_COMMANDS; i++){
+    snprintf(labels, sizeof(labels), "command=\"%s\"", stats.commands[i].name);
+    writeHistogram(f, "smc_command_latency_seconds", labels, stats.commands[i].latency);
+  }
+
+  fprintf(f, "# HELP smc_command_failures_total Calls that failed\n");
+  fprintf(f, "# TYPE smc_command_failures_total counter\n");
+  for(int i = 0; i < SMC_STAT_COMMANDS; i++)
+    fprintf(f, "smc_command_failures_total{command=\"%s\"} %llu\n", stats.commands[i].name,
+            (unsigned long long)stats.commands[i].failures);
+
+  fprintf(f, "# HELP smc_serial_write_seconds Time spent in sendArray\n");
+  fprintf(f, "# TYPE smc_serial_write_seconds histogram\n");
+  writeHistogram(f, "smc_serial_write_seconds", "", stats.serial.write);
+  fprintf(f, "# HELP smc_serial_read_seconds Time spent waiting in getArray\n");
+  fprintf(f, "# TYPE smc_serial_read_seconds histogram\n");
+  writeHistogram(f, "smc_serial_read_seconds", "", stats.serial.read);
+
+  writeCounter(f, "smc_serial_tx_bytes_total", "Bytes written", stats.serial.txBytes);
+  writeCounter(f, "smc_serial_rx_bytes_total", "Bytes read", stats.serial.rxBytes);
+  writeCounter(f, "smc_serial_timeouts_total", "Reads that timed out", stats.serial.timeouts);
+  writeCounter(f, "smc_serial_short_reads_total", "Reads that returned fewer bytes than asked", stats.serial.shortReads);
+  writeCounter(f, "smc_retries_total", "Requests sent again after a failed response", stats.retries);
+
+  int ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if(!ok || rename(tmp.c_str(), path)){
+    remove(tmp.c_str());
+    return 0;
+  }
+  return 1;
+}
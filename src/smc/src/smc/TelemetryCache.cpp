@@ -0,0 +1,259 @@
+#include "smc/TelemetryCache.h"
+
+/**
+ * @param smc controller connection the requests go through
+ */
+TelemetryCache::TelemetryCache(SMC *smc)
+  :_smc(smc),
+   _origin(std::chrono::steady_clock::now()),
+   _background(0),
+   _hits(0),
+   _misses(0),
+   _merged(0),
+   _stale(0),
+   _refreshes(0),
+   _failures(0)
+{
+  for(int i = 0; i < SMC_CACHE_DEVICES; i++)
+    _devices[i] = NULL;
+}
+
+/**
+ * Waits for background refreshes still on the wire
+ */
+TelemetryCache::~TelemetryCache(){
+
+  std::unique_lock<std::mutex> lock(_backgroundLock);
+  _backgroundDone.wait(lock, [this]{ return _background == 0; });
+  lock.unlock();
+
+  for(int i = 0; i < SMC_CACHE_DEVICES; i++)
+    delete _devices[i].load();
+}
+
+/**
+ * @return entries of a device, allocated on first use
+ */
+TelemetryCache::Device* TelemetryCache::device(uint8_t device){
+
+  Device *dev = _devices[device].load(std::memory_order_acquire);
+  if(dev)
+    return dev;
+
+  dev = new Device();
+  for(int i = 0; i < SMC_CACHE_VARS; i++){
+    dev->entries[i] = 0;
+    dev->generations[i] = 0;
+    dev->refreshing[i] = false;
+    dev->failed[i] = false;
+  }
+  Device *expected = NULL;
+  if(!_devices[device].compare_exchange_strong(expected, dev)){
+    // another thread got there first
+    delete dev;
+    return expected;
+  }
+  return dev;
+}
+
+/**
+ * @return us since the cache was made plus one, 0 means never
+ */
+uint64_t TelemetryCache::stamp(std::chrono::steady_clock::time_point at){
+  long long us = std::chrono::duration_cast<std::chrono::microseconds>(at - _origin).count();
+  return us < 0 ? 1 : ((uint64_t)us + 1) & 0xffffffffffffULL;
+}
+
+/**
+ * Stores a value unless a newer one is already there or it was read
+ * before the variable was last invalidated
+ */
+void TelemetryCache::store(Device *dev, uint8_t variableID, uint64_t stamp, uint16_t value){
+
+  if(stamp <= dev->generations[variableID])
+    return;
+  uint64_t entry = (stamp << 16) | value;
+  uint64_t old = dev->entries[variableID].load(std::memory_order_relaxed);
+  while((old >> 16) <= stamp && !dev->entries[variableID].compare_exchange_weak(old, entry)){
+  }
+  // an invalidate that came in meanwhile may have cleared the entry
+  // before the write, take the write back
+  if(stamp <= dev->generations[variableID])
+    dev->entries[variableID].compare_exchange_strong(entry, 0);
+}
+
+/**
+ * Forgets a variable and drops the reads still on their way
+ */
+void TelemetryCache::forget(Device *dev, uint8_t variableID, uint64_t stamp){
+  uint64_t generation = dev->generations[variableID];
+  while(generation < stamp && !dev->generations[variableID].compare_exchange_weak(generation, stamp)){
+  }
+  dev->entries[variableID] = 0;
+}
+
+/**
+ * Ends the request on the wire for a variable and wakes its waiters
+ */
+void TelemetryCache::finish(Device *dev, uint8_t variableID, uint64_t stamp, int status, uint16_t value){
+
+  if(status)
+    store(dev, variableID, stamp, value);
+  else
+    _failures++;
+
+  {
+    std::lock_guard<std::mutex> guard(dev->lock);
+    dev->failed[variableID] = !status;
+    dev->refreshing[variableID] = false;
+  }
+  dev->refreshed.notify_all();
+}
+
+/**
+ * Reads a variable from the device, or waits for the request already
+ * on the wire for it
+ * @param oldest stamp of the oldest value the caller accepts
+ * @return 1 if value was set
+ */
+int TelemetryCache::refresh(uint8_t device, Device *dev, uint8_t variableID, uint64_t oldest, uint16_t &value){
+
+  for(;;){
+    bool expected = false;
+    if(dev->refreshing[variableID].compare_exchange_strong(expected, true)){
+      _misses++;
+      uint64_t start = stamp(std::chrono::steady_clock::now());
+      uint16_t val = 0;
+      int status = _smc->getMotorVariable(device, variableID, val);
+      finish(dev, variableID, start, status, val);
+      if(status)
+        value = val;
+      return status;
+    }
+
+    _merged++;
+    std::unique_lock<std::mutex> lock(dev->lock);
+    dev->refreshed.wait(lock, [dev, variableID]{ return !dev->refreshing[variableID]; });
+
+    uint64_t entry = dev->entries[variableID].load(std::memory_order_acquire);
+    if(entry && (entry >> 16) >= oldest){
+      value = entry & 0xffff;
+      return 1;
+    }
+    // share the failure instead of every waiter trying again
+    if(dev->failed[variableID])
+      return 0;
+    // answered, but sent before this caller asked, go again
+  }
+}
+
+/**
+ * Starts a request for a variable on the I/O thread unless one is
+ * already on the wire
+ * @return 1 if a request is on the wire, 0 if the SMC can't send it in
+ * the background
+ */
+int TelemetryCache::refreshBackground(uint8_t device, Device *dev, uint8_t variableID){
+
+  bool expected = false;
+  if(!dev->refreshing[variableID].compare_exchange_strong(expected, true))
+    return 1;
+
+  uint64_t start = stamp(std::chrono::steady_clock::now());
+  _background++;
+  int queued = _smc->asyncGetMotorVariable(device, variableID,
+    [this, dev, variableID, start](int status, uint16_t val){
+      finish(dev, variableID, start, status, val);
+      std::lock_guard<std::mutex> guard(_backgroundLock);
+      if(--_background == 0)
+        _backgroundDone.notify_all();
+    });
+
+  if(!queued){
+    _background--;
+    std::lock_guard<std::mutex> guard(dev->lock);
+    dev->refreshing[variableID] = false;
+    dev->refreshed.notify_all();
+    return 0;
+  }
+  _refreshes++;
+  return 1;
+}
+
+/**
+ * Reads a variable no older than maxAgeMs
+ * @return 1 if variableVal was set
+ */
+int TelemetryCache::get(uint8_t device, uint8_t variableID, uint32_t maxAgeMs, uint16_t &variableVal,
+                        CACHE_READ mode){
+
+  if(device >= SMC_CACHE_DEVICES || variableID >= SMC_CACHE_VARS)
+    return 0;
+
+  Device *dev = this->device(device);
+  uint64_t now = stamp(std::chrono::steady_clock::now());
+  uint64_t maxAgeUs = (uint64_t)maxAgeMs * 1000;
+  uint64_t oldest = maxAgeMs && now > maxAgeUs ? now - maxAgeUs : maxAgeMs ? 1 : now;
+
+  uint64_t entry = dev->entries[variableID].load(std::memory_order_acquire);
+  if(entry){
+    if(maxAgeMs && (entry >> 16) >= oldest){
+      _hits++;
+      variableVal = entry & 0xffff;
+      return 1;
+    }
+    if(mode == CACHE_READ::STALE && refreshBackground(device, dev, variableID)){
+      _stale++;
+      variableVal = entry & 0xffff;
+      return 1;
+    }
+  }
+  return refresh(device, dev, variableID, oldest, variableVal);
+}
+
+/**
+ * Stores a value read some other way
+ */
+void TelemetryCache::update(uint8_t device, uint8_t variableID, uint16_t variableVal,
+                            std::chrono::steady_clock::time_point readAt){
+
+  if(device >= SMC_CACHE_DEVICES || variableID >= SMC_CACHE_VARS)
+    return;
+  store(this->device(device), variableID, stamp(readAt), variableVal);
+}
+
+/**
+ * Forgets every variable of a device
+ */
+void TelemetryCache::invalidate(uint8_t device){
+
+  if(device >= SMC_CACHE_DEVICES)
+    return;
+  // even before the first read, a poll may be on its way
+  Device *dev = this->device(device);
+  uint64_t now = stamp(std::chrono::steady_clock::now());
+  for(int i = 0; i < SMC_CACHE_VARS; i++)
+    forget(dev, i, now);
+}
+
+/**
+ * Forgets one variable of a device
+ */
+void TelemetryCache::invalidate(uint8_t device, uint8_t variableID){
+
+  if(device >= SMC_CACHE_DEVICES || variableID >= SMC_CACHE_VARS)
+    return;
+  forget(this->device(device), variableID, stamp(std::chrono::steady_clock::now()));
+}
+
+/**
+ * Copies the counters
+ */
+void TelemetryCache::getStats(TelemetryCacheStats &stats){
+  stats.hits = _hits;
+  stats.misses = _misses;
+  stats.merged = _merged;
+  stats.stale = _stale;
+  stats.refreshes = _refreshes;
+  stats.failures = _failures;
+}
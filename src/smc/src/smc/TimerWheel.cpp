@@ -0,0 +1,242 @@
+#include "smc/TimerWheel.h"
+
+#define SMC_WHEEL_MASK (SMC_WHEEL_SLOTS - 1)
+
+/**
+ * @param capacity most timers pending at once
+ */
+TimerWheel::TimerWheel(int capacity)
+  :_nodes(capacity < 1 ? 1 : capacity > 0xffff ? 0xffff : capacity),
+   _free(0),
+   _origin(std::chrono::steady_clock::now()),
+   _tick(0),
+   _pending(0)
+{
+  for(size_t i = 0; i < _nodes.size(); i++){
+    _nodes[i].generation = 1;
+    _nodes[i].pending = false;
+    _nodes[i].linked = false;
+    _nodes[i].next = i + 1 < _nodes.size() ? (int)i + 1 : -1;
+  }
+  for(int i = 0; i < SMC_WHEEL_SLOTS; i++)
+    _slots[i] = -1;
+  for(int i = 0; i < SMC_WHEEL_SLOTS / 64; i++)
+    _occupied[i] = 0;
+  _due.reserve(_nodes.size());
+}
+
+/**
+ * @return first tick at or after a point in time
+ */
+uint64_t TimerWheel::toTick(std::chrono::steady_clock::time_point at){
+  long long us = std::chrono::duration_cast<std::chrono::microseconds>(at - _origin).count();
+  return us <= 0 ? 0 : (us + SMC_WHEEL_TICK_US - 1) / SMC_WHEEL_TICK_US;
+}
+
+void TimerWheel::link(int index){
+  Node &node = _nodes[index];
+  int slot = node.tick & SMC_WHEEL_MASK;
+  node.prev = -1;
+  node.next = _slots[slot];
+  if(node.next >= 0)
+    _nodes[node.next].prev = index;
+  _slots[slot] = index;
+  _occupied[slot / 64] |= 1ULL << (slot % 64);
+  node.linked = true;
+}
+
+void TimerWheel::unlink(int index){
+  Node &node = _nodes[index];
+  int slot = node.tick & SMC_WHEEL_MASK;
+  if(node.prev >= 0)
+    _nodes[node.prev].next = node.next;
+  else
+    _slots[slot] = node.next;
+  if(node.next >= 0)
+    _nodes[node.next].prev = node.prev;
+  if(_slots[slot] < 0)
+    _occupied[slot / 64] &= ~(1ULL << (slot % 64));
+  node.linked = false;
+}
+
+void TimerWheel::release(int index){
+  Node &node = _nodes[index];
+  if(node.linked)
+    unlink(index);
+  node.pending = false;
+  node.generation = node.generation == 0xffff ? 1 : node.generation + 1;
+  node.next = _free;
+  _free = index;
+  _pending--;
+}
+
+uint32_t TimerWheel::add(uint64_t tick, uint64_t periodTicks, SMCTimerFn fn, void *ctx, uint32_t arg){
+
+  if(_free < 0)
+    return 0;
+
+  int index = _free;
+  Node &node = _nodes[index];
+  _free = node.next;
+
+  // already due, fire on the next advance
+  node.tick = tick < _tick ? _tick : tick;
+  node.periodTicks = periodTicks;
+  node.fn = fn;
+  node.ctx = ctx;
+  node.arg = arg;
+  node.pending = true;
+  link(index);
+  _pending++;
+
+  return ((uint32_t)node.generation << 16) | (uint32_t)(index + 1);
+}
+
+/**
+ * Fires a callback once at a point in time
+ * @return timer id, 0 if the wheel is full
+ */
+uint32_t TimerWheel::schedule(std::chrono::steady_clock::time_point at, SMCTimerFn fn, void *ctx, uint32_t arg){
+  return add(toTick(at), 0, fn, ctx, arg);
+}
+
+/**
+ * Fires a callback every period, the first time one period from now
+ * @return timer id, 0 if the wheel is full
+ */
+uint32_t TimerWheel::every(long periodUs, SMCTimerFn fn, void *ctx, uint32_t arg){
+  uint64_t periodTicks = periodUs <= SMC_WHEEL_TICK_US ? 1 : (periodUs + SMC_WHEEL_TICK_US - 1) / SMC_WHEEL_TICK_US;
+  return add(toTick(std::chrono::steady_clock::now()) + periodTicks, periodTicks, fn, ctx, arg);
+}
+
+/**
+ * Stops a timer
+ * @return 1 if the timer was pending
+ */
+int TimerWheel::cancel(uint32_t id){
+
+  int index = (int)(id & 0xffff) - 1;
+  if(index < 0 || index >= (int)_nodes.size())
+    return 0;
+  Node &node = _nodes[index];
+  if(!node.pending || node.generation != id >> 16)
+    return 0;
+  release(index);
+  return 1;
+}
+
+/**
+ * @return slots from the current tick to the next occupied one, -1 if
+ * all are empty
+ */
+int TimerWheel::nextSlot(){
+
+  int start = _tick & SMC_WHEEL_MASK;
+  for(int i = 0; i <= SMC_WHEEL_SLOTS / 64; i++){
+    int word = (start / 64 + i) % (SMC_WHEEL_SLOTS / 64);
+    uint64_t bits = _occupied[word];
+    // bits behind the start in its own word come last, after a full turn
+    if(i == 0)
+      bits &= ~0ULL << (start % 64);
+    else if(i == SMC_WHEEL_SLOTS / 64)
+      bits &= (1ULL << (start % 64)) - 1;
+    if(bits){
+      int slot = word * 64 + __builtin_ctzll(bits);
+      return (slot - start + SMC_WHEEL_SLOTS) & SMC_WHEEL_MASK;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Fires every timer that is due
+ * @return number of callbacks run
+ */
+int TimerWheel::advance(std::chrono::steady_clock::time_point now){
+
+  long long us = std::chrono::duration_cast<std::chrono::microseconds>(now - _origin).count();
+  if(us < 0)
+    return 0;
+  uint64_t nowTick = us / SMC_WHEEL_TICK_US;
+  int fired = 0;
+
+  while(_tick <= nowTick){
+    int skip = nextSlot();
+    // nothing to do on the empty ticks in between, but don't turn past
+    // now or later timers due before the next occupied slot would wait
+    if(skip < 0 || _tick + skip > nowTick){
+      _tick = nowTick + 1;
+      break;
+    }
+    if(skip){
+      _tick += skip;
+      continue;
+    }
+
+    // take the due timers out before firing any, callbacks may unlink
+    // or reuse nodes of this slot
+    uint64_t tick = _tick++;
+    _due.clear();
+    for(int index = _slots[tick & SMC_WHEEL_MASK]; index >= 0;){
+      Node &node = _nodes[index];
+      int next = node.next;
+      if(node.tick <= tick){
+        unlink(index);
+        _due.push_back(((uint32_t)node.generation << 16) | (uint32_t)(index + 1));
+      }
+      index = next;
+    }
+
+    for(size_t i = 0; i < _due.size(); i++){
+      int index = (int)(_due[i] & 0xffff) - 1;
+      Node &node = _nodes[index];
+      // cancelled by an earlier callback
+      if(!node.pending || node.generation != _due[i] >> 16)
+        continue;
+
+      SMCTimerFn fn = node.fn;
+      void *ctx = node.ctx;
+      uint32_t arg = node.arg;
+      if(!node.periodTicks){
+        release(index);
+        fn(ctx, arg);
+      }
+      else{
+        fn(ctx, arg);
+        if(node.pending && node.generation == _due[i] >> 16){
+          // skip expiries that passed while this one was late
+          do
+            node.tick += node.periodTicks;
+          while(node.tick < _tick);
+          link(index);
+        }
+      }
+      fired++;
+    }
+  }
+  return fired;
+}
+
+/**
+ * @return ms until the next occupied slot is due, rounded up, -1 if
+ * no timer is pending
+ */
+int TimerWheel::waitMs(std::chrono::steady_clock::time_point now){
+
+  if(!_pending)
+    return -1;
+  int skip = nextSlot();
+  if(skip < 0)
+    return 0;       // all taken out to fire by an advance that is running
+
+  long long us = (long long)(_tick + skip) * SMC_WHEEL_TICK_US -
+    std::chrono::duration_cast<std::chrono::microseconds>(now - _origin).count();
+  return us <= 0 ? 0 : (int)((us + 999) / 1000);
+}
+
+/**
+ * @return number of pending timers
+ */
+int TimerWheel::pending(){
+  return _pending;
+}
@@ -0,0 +1,243 @@
+#include <math.h>
+
+#include "smc/Trajectory.h"
+
+/**
+ * @param smc controller connection of every motor
+ * @param baud baud rate of the link
+ * @param devices IDs of the motors
+ * @param count number of motors, at most SMC_MAX_FLEET
+ */
+Trajectory::Trajectory(SMC *smc, int baud, const uint8_t *devices, int count)
+  :_smc(smc),
+   _count(0),
+   _budget(1),
+   _loop(SMC_TRAJECTORY_MIN_STEP_US),
+   _stepUs(SMC_TRAJECTORY_MIN_STEP_US),
+   _lastTick(0)
+{
+  char frame[SMC_MAX_FRAME];
+  // 8N1, ten bit times per byte
+  int frameLen = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 0, 0);
+  _frameUs = baud > 0 ? frameLen * 10 * 1000000L / baud : 0;
+
+  if(!devices || count <= 0 || count > SMC_MAX_FLEET)
+    return;
+  for(int i = 0; i < count; i++)
+    if(devices[i] > 127)
+      return;
+
+  for(int i = 0; i < count; i++){
+    Motor &motor = _motors[i];
+    motor.device = devices[i];
+    motor.target = 0;
+    motor.maxAccel = 3200;
+    motor.maxJerk = 0;
+    motor.speed = 0;
+    motor.accel = 0;
+    motor.shownSpeed = 0;
+    motor.shownAccel = 0;
+    motor.sent = 0;
+    motor.sentTick = 0;
+    motor.haveSent = false;
+  }
+  _count = count;
+}
+
+/**
+ * Stops streaming
+ */
+Trajectory::~Trajectory(){
+  stop();
+}
+
+/**
+ * @return index of a motor, -1 if the device is not one
+ */
+int Trajectory::find(uint8_t device){
+  for(int i = 0; i < _count; i++)
+    if(_motors[i].device == device)
+      return i;
+  return -1;
+}
+
+/**
+ * Limits how fast a motor's speed changes
+ * @return 1 if set, 0 if not a motor of the trajectory or maxAccel is
+ * not positive
+ */
+int Trajectory::setLimits(uint8_t device, double maxAccel, double maxJerk){
+  int i = find(device);
+  if(i < 0 || maxAccel <= 0 || maxJerk < 0)
+    return 0;
+  _motors[i].maxAccel = maxAccel;
+  _motors[i].maxJerk = maxJerk;
+  return 1;
+}
+
+/**
+ * @param share part of the link's bytes the stream may use, 0 to 1
+ * @return 1 if set, 0 while streaming
+ */
+int Trajectory::setBudget(double share){
+  if(_loop.isRunning() || share <= 0 || share > 1)
+    return 0;
+  _budget = share;
+  return 1;
+}
+
+/**
+ * Sets the speed a motor moves to
+ * @return 1 if set, 0 if out of range or not a motor of the trajectory
+ */
+int Trajectory::setTarget(uint8_t device, int16_t speed){
+  int i = find(device);
+  if(i < 0 || speed > 3200 || speed < -3200)
+    return 0;
+  _motors[i].target = speed;
+  return 1;
+}
+
+/**
+ * Moves a motor's speed one step toward its target
+ * The acceleration heads for the limit in the direction of the target
+ * until the speed it still gains while the jerk limit brings it back to
+ * 0 would reach the target, then turns around
+ * @return true if the motor is at its target
+ */
+bool Trajectory::step(Motor &motor, double dt){
+
+  double target = motor.target;
+  double maxAccel = motor.maxAccel;
+  double maxJerk = motor.maxJerk;
+  double error = target - motor.speed;
+
+  if(maxJerk <= 0){
+    double change = fmax(-maxAccel * dt, fmin(maxAccel * dt, error));
+    motor.speed += change;
+    motor.accel = change / dt;
+  }
+  else{
+    double braking = motor.accel * fabs(motor.accel) / (2 * maxJerk);
+    double want = error - braking > 0 ? maxAccel : -maxAccel;
+    double accel = motor.accel + fmax(-maxJerk * dt, fmin(maxJerk * dt, want - motor.accel));
+    motor.accel = fmax(-maxAccel, fmin(maxAccel, accel));
+
+    double change = motor.accel * dt;
+    // never past the target, even if a new one came too close to ramp
+    if((error >= 0 && change >= error) || (error <= 0 && change <= error)){
+      motor.speed = target;
+      motor.accel = 0;
+    }
+    else
+      motor.speed += change;
+
+    // near enough that the next jerk step would overshoot
+    if(fabs(target - motor.speed) < 0.5 && fabs(motor.accel) <= maxJerk * dt){
+      motor.speed = target;
+      motor.accel = 0;
+    }
+  }
+
+  motor.shownSpeed = (int16_t)lround(motor.speed);
+  motor.shownAccel = motor.accel;
+  return motor.speed == target && motor.accel == 0;
+}
+
+/**
+ * Computes one step of every motor's profile without sending it
+ * @return 1 if every motor is at its target
+ */
+int Trajectory::advance(double dt){
+  if(dt <= 0)
+    return 0;
+  int settled = 1;
+  for(int i = 0; i < _count; i++)
+    settled &= step(_motors[i], dt);
+  return settled;
+}
+
+/**
+ * Copies the state of a motor
+ * @return 1 if set, 0 if not a motor of the trajectory
+ */
+int Trajectory::getState(uint8_t device, TrajectoryState &state){
+  int i = find(device);
+  if(i < 0)
+    return 0;
+  state.device = device;
+  state.target = _motors[i].target;
+  state.speed = _motors[i].shownSpeed;
+  state.accel = _motors[i].shownAccel;
+  return 1;
+}
+
+/**
+ * @return the loop the stream runs on
+ */
+ControlLoop* Trajectory::getLoop(){
+  return &_loop;
+}
+
+/**
+ * Steps every profile and stages the speeds that changed, loop thread
+ */
+void Trajectory::tick(uint64_t tick){
+
+  // periods left out after an overrun still move the profile
+  uint64_t steps = tick > _lastTick ? tick - _lastTick : 1;
+  _lastTick = tick;
+  double dt = steps * _stepUs / 1e6;
+  uint64_t refresh = (uint64_t)SMC_SETPOINT_REFRESH_MS * 1000 / _stepUs;
+
+  SMCSetpoint setpoints[SMC_MAX_FLEET];
+  int n = 0;
+  for(int i = 0; i < _count; i++){
+    Motor &motor = _motors[i];
+    step(motor, dt);
+    int16_t speed = (int16_t)lround(motor.speed);
+    if(motor.haveSent && speed == motor.sent && tick - motor.sentTick < refresh)
+      continue;
+    motor.sent = speed;
+    motor.sentTick = tick;
+    motor.haveSent = true;
+    setpoints[n].device = motor.device;
+    setpoints[n].speed = speed;
+    n++;
+  }
+  if(n)
+    _loop.stage(setpoints, n);
+}
+
+/**
+ * Starts streaming
+ * @return 1 if streaming
+ */
+int Trajectory::start(){
+
+  if(_loop.isRunning())
+    return 1;
+  if(!_smc || !_count || _frameUs <= 0)
+    return 0;
+
+  // a frame for every motor per step, within the budget
+  _stepUs = (long)(_count * _frameUs / _budget);
+  if(_stepUs < SMC_TRAJECTORY_MIN_STEP_US)
+    _stepUs = SMC_TRAJECTORY_MIN_STEP_US;
+
+  for(int i = 0; i < _count; i++)
+    _motors[i].haveSent = false;
+  _lastTick = 0;
+
+  if(!_loop.setPeriod(_stepUs) || !_loop.setOutput(_smc, 0, FLEET_FORMAT::POLOLU) ||
+     !_loop.setTick([this](uint64_t tick){ this->tick(tick); }))
+    return 0;
+  return _loop.start();
+}
+
+/**
+ * Stops streaming, the motors keep their last speed
+ */
+void Trajectory::stop(){
+  _loop.stop();
+}
@@ -0,0 +1,296 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+
+#include "smc/WireRecorder.h"
+#include "smc/Dispatcher.h"
+
+/**
+ * @return ns of a clock
+ */
+static int64_t clockNs(clockid_t clock){
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+WireRecorder::WireRecorder()
+  :_fd(-1),
+   _mapLen(0),
+   _header(NULL),
+   _records(NULL),
+   _capacity(0),
+   _originNs(0),
+   _haveAnswering(false)
+{
+}
+
+/**
+ * Unmaps the file, the recording stays on disk
+ */
+WireRecorder::~WireRecorder(){
+  close();
+}
+
+/**
+ * Creates a recording file, replacing any at path
+ * @return 1 if open
+ */
+int WireRecorder::open(const std::string &path, size_t records, int baud){
+
+  close();
+  if(!records)
+    return 0;
+
+  size_t len = SMC_WIRE_HEADER_BYTES + records * sizeof(WireRecord);
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+    return 0;
+
+  // blocks are allocated and mapped now, not on the first record
+  // that lands in them
+  void *map = MAP_FAILED;
+  if(!posix_fallocate(fd, 0, len))
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  if(map == MAP_FAILED){
+    ::close(fd);
+    return 0;
+  }
+
+  WireHeader *header = new (map) WireHeader();
+  header->recordSize = sizeof(WireRecord);
+  header->baud = baud > 0 ? baud : 0;
+  header->capacity = records;
+  header->next = 0;
+  header->openedNs = clockNs(CLOCK_REALTIME);
+  // last, a reader seeing the magic sees the rest
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header->magic, SMC_WIRE_MAGIC, sizeof(header->magic));
+
+  _fd = fd;
+  _mapLen = len;
+  _header = header;
+  _records = (WireRecord *)((char *)map + SMC_WIRE_HEADER_BYTES);
+  _capacity = records;
+  _originNs = clockNs(CLOCK_MONOTONIC);
+  resync();
+  return 1;
+}
+
+/**
+ * Unmaps the file
+ */
+void WireRecorder::close(){
+  if(!_header)
+    return;
+  munmap(_header, _mapLen);
+  ::close(_fd);
+  _fd = -1;
+  _header = NULL;
+  _records = NULL;
+  _capacity = 0;
+}
+
+/**
+ * @return 1 if a file is mapped
+ */
+int WireRecorder::isOpen(){
+  return _header != NULL;
+}
+
+/**
+ * @return records appended since open
+ */
+uint64_t WireRecorder::count(){
+  return _header ? _header->next.load() : 0;
+}
+
+/**
+ * @return ns since open
+ */
+uint64_t WireRecorder::now(){
+  return clockNs(CLOCK_MONOTONIC) - _originNs;
+}
+
+/**
+ * Writes one record in the next slot of the ring
+ */
+void WireRecorder::append(WIRE_DIR dir, uint8_t device, uint8_t command, const char *data, int len,
+                          uint64_t timeNs){
+
+  uint64_t slot = _header->next.fetch_add(1, std::memory_order_relaxed);
+  WireRecord &rec = _records[slot % _capacity];
+
+  // readers see the slot empty until it is whole again
+  rec.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  rec.timeNs = timeNs;
+  rec.dir = (uint8_t)dir;
+  rec.device = device;
+  rec.command = command;
+  rec.len = len;
+  memcpy(rec.data, data, len);
+  rec.seq.store(slot + 1, std::memory_order_release);
+}
+
+/**
+ * Writes bytes that are no frame, SMC_WIRE_DATA to a record
+ */
+void WireRecorder::appendRaw(WIRE_DIR dir, const char *data, int len, uint64_t timeNs){
+  for(int i = 0; i < len; i += SMC_WIRE_DATA){
+    int n = len - i < SMC_WIRE_DATA ? len - i : SMC_WIRE_DATA;
+    append(dir, SMC_WIRE_UNKNOWN, SMC_WIRE_UNKNOWN, data + i, n, timeNs);
+  }
+}
+
+/**
+ * Appends bytes written to the port, a record per frame
+ */
+void WireRecorder::sent(const char *data, int len){
+
+  if(!_header || len <= 0)
+    return;
+
+  uint64_t timeNs = now();
+  int i = 0;
+  while(i < len){
+    uint8_t byte = data[i];
+    int frameLen = 0, payload = 0, response = 0;
+    uint8_t device = SMC_WIRE_UNKNOWN;
+    uint8_t command = SMC_WIRE_UNKNOWN;
+
+    if(byte == (uint8_t)POLOLU_COM::HEADER){
+      if(i + 3 <= len && commandSizes(data[i + 2], payload, response)){
+        frameLen = 3 + payload;
+        device = data[i + 1];
+        command = data[i + 2];
+      }
+    }
+    else if(byte == (uint8_t)SSC_COM::SSC_PWM){
+      frameLen = (int)SSC_COM_BYTES::SSC_PWM;
+      if(i + 2 <= len)
+        device = data[i + 1];
+      command = byte;
+    }
+    else if(byte & 0x80 && commandSizes(byte & 0x7F, payload, response)){
+      frameLen = 1 + payload;
+      device = SMC_BROADCAST;
+      command = byte & 0x7F;
+    }
+
+    if(!frameLen || i + frameLen > len){
+      // up to the next byte that could start a frame
+      int end = i + 1;
+      while(end < len && !((uint8_t)data[end] & 0x80))
+        end++;
+      appendRaw(WIRE_DIR::TX, data + i, end - i, timeNs);
+      i = end;
+      continue;
+    }
+
+    append(WIRE_DIR::TX, device, command, data + i, frameLen, timeNs);
+    if(response){
+      Expected expected = {device, command, (uint8_t)response};
+      _expected.push(expected);
+    }
+    i += frameLen;
+  }
+}
+
+/**
+ * Appends bytes read from the port, a record per response
+ */
+void WireRecorder::received(const char *data, int len){
+
+  if(!_header || len <= 0)
+    return;
+
+  uint64_t timeNs = now();
+  int i = 0;
+  while(i < len){
+    if(!_haveAnswering)
+      _haveAnswering = _expected.pop(_answering);
+    if(!_haveAnswering){
+      appendRaw(WIRE_DIR::RX, data + i, len - i, timeNs);
+      return;
+    }
+    int n = len - i < _answering.left ? len - i : _answering.left;
+    append(WIRE_DIR::RX, _answering.device, _answering.command, data + i, n, timeNs);
+    i += n;
+    _answering.left -= n;
+    if(!_answering.left)
+      _haveAnswering = false;
+  }
+}
+
+/**
+ * Forgets the answers still expected
+ */
+void WireRecorder::resync(){
+  Expected expected;
+  while(_expected.pop(expected)){
+  }
+  _haveAnswering = false;
+}
+
+/**
+ * Reads the records still in a recording, oldest first
+ * @return 1 if the file is a recording
+ */
+int WireRecorder::load(const std::string &path, std::vector<WireFrame> &frames, int &baud){
+
+  frames.clear();
+  baud = 0;
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return 0;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if(!fstat(fd, &st) && (size_t)st.st_size >= SMC_WIRE_HEADER_BYTES)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED)
+    return 0;
+
+  const WireHeader *header = (const WireHeader *)map;
+  uint64_t capacity = header->capacity;
+  if(memcmp(header->magic, SMC_WIRE_MAGIC, sizeof(header->magic)) ||
+     header->recordSize != sizeof(WireRecord) || !capacity ||
+     capacity > (st.st_size - SMC_WIRE_HEADER_BYTES) / sizeof(WireRecord)){
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  baud = header->baud;
+  const WireRecord *records = (const WireRecord *)((const char *)map + SMC_WIRE_HEADER_BYTES);
+  uint64_t next = header->next.load();
+  uint64_t first = next > capacity ? next - capacity : 0;
+  frames.reserve(next - first);
+
+  for(uint64_t seq = first; seq < next; seq++){
+    const WireRecord &rec = records[seq % capacity];
+    if(rec.seq.load(std::memory_order_acquire) != seq + 1)
+      continue;
+    WireFrame frame;
+    frame.seq = seq;
+    frame.timeNs = rec.timeNs;
+    frame.dir = (WIRE_DIR)rec.dir;
+    frame.device = rec.device;
+    frame.command = rec.command;
+    frame.len = rec.len <= SMC_WIRE_DATA ? rec.len : SMC_WIRE_DATA;
+    memcpy(frame.data, rec.data, frame.len);
+    // overwritten while copying
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(rec.seq.load(std::memory_order_relaxed) != seq + 1)
+      continue;
+    frames.push_back(frame);
+  }
+
+  munmap(map, st.st_size);
+  return 1;
+}
@@ -1,13 +1,86 @@
+#include <string.h>
+
 #include "smc/smc.h"
 #include "smc/SerialPort.h"
 
+namespace {
+
+/**
+ * Lets a synchronous call wait on requests run by the I/O thread
+ */
+struct SyncWait {
+  std::mutex mutex;
+  std::condition_variable cond;
+  int pending;                  /**< Requests not yet completed */
+  int received;                 /**< Response bytes before the first failure */
+  bool failed;
+};
+
+/**
+ * Completion context of one request in a synchronous call
+ */
+struct SyncSlot {
+  SyncWait *wait;
+  char *response;               /**< Where this request's response goes */
+  int responseLen;
+};
+
+void syncDone(void *ctx, int status, const char *response){
+  SyncSlot *slot = (SyncSlot *)ctx;
+  SyncWait *wait = slot->wait;
+
+  std::lock_guard<std::mutex> lock(wait->mutex);
+  if(status && !wait->failed){
+    memcpy(slot->response, response, slot->responseLen);
+    wait->received += slot->responseLen;
+  }
+  else
+    wait->failed = true;
+  if(--wait->pending == 0)
+    wait->cond.notify_one();
+}
+
+/**
+ * Completion context of an asynchronous call
+ */
+struct AsyncValue {
+  SMCValueCallback done;
+  CommandMetrics *metrics;
+  std::chrono::steady_clock::time_point start;
+};
+
+void variableDone(void *ctx, int status, const char *response){
+  AsyncValue *async = (AsyncValue *)ctx;
+  uint16_t val = 0;
+  if(status)
+    val = ((uint16_t)(uint8_t)response[1] << 8) | (uint8_t)response[0];
+  async->metrics->record((uint8_t)POLOLU_COM::GET_SMC_VAR, status, async->start);
+  async->done(status, val);
+  delete async;
+}
+
+void limitDone(void *ctx, int status, const char *response){
+  AsyncValue *async = (AsyncValue *)ctx;
+  uint16_t code = 0;
+  if(status)
+    code = response[0] & 0x03;
+  async->metrics->record((uint8_t)POLOLU_COM::SET_LIMIT, status, async->start);
+  async->done(status, code);
+  delete async;
+}
+
+}
 
 /**
  * Default Ctor
  */
 SMC::SMC()
-  :_buffer(),
-   _conn()
+  :_conn(),
+   _dispatcher(),
+   _reactor(),
+   _reactorPort(-1),
+   _sscOffset(0),
+   _retries(0)
 {
 }
 
@@ -17,28 +90,275 @@ SMC::SMC()
  */
 SMC::SMC(SerialPort* conn)
   :_conn(conn),
-   _buffer()
+   _dispatcher(),
+   _reactor(),
+   _reactorPort(-1),
+   _sscOffset(0),
+   _retries(0)
 {
 }
 
+/**
+ * Stops the I/O thread if running
+ */
+SMC::~SMC(){
+  delete _dispatcher;
+}
+
 /**
  * Add a serial port 
  * @param conn pointer to an open serial port
  */
 void SMC::setPort(SerialPort* conn){
+  stopIoThread();
+  _reactor = NULL;
   _conn = conn;
 }
 
+/**
+ * Starts a background I/O thread that owns the serial port
+ * @return 1 if the thread is running
+ */
+int SMC::startIoThread(){
+  if(!_dispatcher)
+    _dispatcher = new Dispatcher(_conn);
+  return _dispatcher->start();
+}
+
+/**
+ * @return the I/O thread, NULL if it was never started
+ */
+Dispatcher* SMC::getDispatcher(){
+  return _dispatcher;
+}
+
+/**
+ * Stops the background I/O thread, pending async calls fail
+ */
+void SMC::stopIoThread(){
+  delete _dispatcher;
+  _dispatcher = NULL;
+}
+
+/**
+ * Sends every call through a port of a shared reactor
+ * @param reactor running reactor, NULL to go back to the serial port
+ * @param port index returned by SerialReactor::addPort
+ */
+void SMC::setReactor(SerialReactor* reactor, int port){
+  stopIoThread();
+  _reactor = reactor;
+  _reactorPort = port;
+}
+
+/**
+ * Reads a device's error status every period on the reactor, so the
+ * link is never idle for longer than its serial command timeout
+ * @param uint8_t ID of device
+ * @param periodMs period in milliseconds
+ * @return id for stopKeepAlive, 0 without a reactor
+ */
+int SMC::keepAlive(uint8_t device, size_t periodMs){
+
+  if(!_reactor)
+    return 0;
+
+  SMCRequest req;
+  req.frameLen = encodePololu<POLOLU_COM::GET_SMC_VAR>(req.frame, device, (uint8_t)SMC_VAR::ERROR_STATUS);
+  req.responseLen = Command<POLOLU_COM::GET_SMC_VAR>::responseLen;
+  req.done = NULL;
+  req.ctx = NULL;
+  return _reactor->every(_reactorPort, req, periodMs);
+}
+
+/**
+ * Stops a keepalive
+ * @param id returned by keepAlive
+ */
+void SMC::stopKeepAlive(int id){
+  if(_reactor)
+    _reactor->cancel(id);
+}
+
+/**
+ * @return true if calls go through the reactor or the I/O thread
+ */
+bool SMC::queued(){
+  return _reactor || (_dispatcher && _dispatcher->isRunning());
+}
+
+/**
+ * Queues a request on the reactor or the I/O thread
+ * @return 1 if queued
+ */
+int SMC::submit(const SMCRequest &req){
+  if(_reactor)
+    return _reactor->submit(_reactorPort, req);
+  return _dispatcher && _dispatcher->submit(req);
+}
+
+/**
+ * Queues several requests in order, on a reactor as one run that
+ * nothing else on the port gets between
+ * @return number of requests queued, the first ones
+ */
+int SMC::submit(const SMCRequest *reqs, int count){
+  if(_reactor)
+    return _reactor->submit(_reactorPort, reqs, count) ? count : 0;
+  int n = 0;
+  while(n < count && _dispatcher && _dispatcher->submit(reqs[n]))
+    n++;
+  return n;
+}
+
+/**
+ * Sends count frames of frameLen bytes and reads a responseLen
+ * response to each, once, on the reactor or I/O thread if in use
+ * @return number of response bytes received in order
+ */
+int SMC::exchange(const char *frames, int frameLen, int count, char *response, int responseLen){
+
+  if(queued()){
+    SyncWait wait;
+    SyncSlot slots[SMC_MAX_BATCH_VARS];
+    SMCRequest reqs[SMC_MAX_BATCH_VARS];
+    wait.pending = count;
+    wait.received = 0;
+    wait.failed = false;
+
+    for(int i = 0; i < count; i++){
+      SMCRequest &req = reqs[i];
+      memcpy(req.frame, frames + i * frameLen, frameLen);
+      req.frameLen = frameLen;
+      req.responseLen = responseLen;
+      req.done = syncDone;
+      req.ctx = &slots[i];
+      slots[i].wait = &wait;
+      slots[i].response = response + i * responseLen;
+      slots[i].responseLen = responseLen;
+    }
+
+    int n = submit(reqs, count);
+    if(n < count){
+      std::lock_guard<std::mutex> lock(wait.mutex);
+      wait.failed = true;
+      wait.pending -= count - n;
+    }
+
+    std::unique_lock<std::mutex> lock(wait.mutex);
+    while(wait.pending > 0)
+      wait.cond.wait(lock);
+    if(!responseLen)
+      return wait.failed ? 0 : frameLen * count;
+    return wait.received;
+  }
+
+  int len = frameLen * count;
+  int n = _conn->sendArray((char *)frames, len);
+  if(!responseLen || n != len)
+    return n;
+  return _conn->getArray(response, responseLen * count);
+}
+
+/**
+ * Sends count frames of frameLen bytes and reads a responseLen
+ * response to each, retrying a missing or short response
+ * @return number of response bytes received in order, or of bytes
+ * sent if there is no response
+ */
+int SMC::transfer(const char *frames, int frameLen, int count, char *response, int responseLen){
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int expected = responseLen ? responseLen * count : frameLen * count;
+  int n = exchange(frames, frameLen, count, response, responseLen);
+
+  for(int i = 0; responseLen && n != expected && i < _retries; i++){
+    _metrics.retried();
+    // a late reply must not be taken for the next one, the I/O
+    // thread and the reactor flush on their own
+    if(!queued())
+      _conn->flushPort(SerialPort::flush_receive);
+    n = exchange(frames, frameLen, count, response, responseLen);
+  }
+
+  _metrics.record(CommandMetrics::command(frames), n == expected, start);
+  return n;
+}
+
+/**
+ * Sends a frame that has no response
+ * @return number of bytes sent
+ */
+int SMC::send(const char *frame, int len){
+  return transfer(frame, len, 1, NULL, 0);
+}
+
+/**
+ * Sends a speed frame, through the latest-wins setpoint slot of the
+ * I/O thread if it is running
+ * @param slot ID of device, or SMC_BROADCAST for compact format frames
+ * @return number of bytes sent or stored
+ */
+int SMC::store(uint8_t slot, const char *frame, int len){
+  if(_dispatcher && _dispatcher->isRunning()){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int ok = _dispatcher->setpoint(slot, frame, len);
+    _metrics.record(CommandMetrics::command(frame), ok, start);
+    return ok ? len : 0;
+  }
+  return send(frame, len);
+}
+
+/**
+ * Sends a speed or brake frame that setSpeed did not pick
+ * @param slot ID of device, or SMC_BROADCAST for compact format frames
+ * @return number of bytes sent or stored
+ */
+int SMC::setpoint(uint8_t slot, const char *frame, int len){
+  _encoder.forget(slot);
+  return store(slot, frame, len);
+}
+
+/**
+ * Sends a stop or brake frame, through the priority lane of the
+ * I/O thread if it is running
+ * @param slot ID of device, or SMC_BROADCAST for compact format frames
+ * @return number of bytes sent or stored
+ */
+int SMC::urgent(uint8_t slot, const char *frame, int len){
+  _encoder.forget(slot);
+  if(_dispatcher && _dispatcher->isRunning()){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int ok = _dispatcher->urgent(slot, frame, len);
+    _metrics.record(CommandMetrics::command(frame), ok, start);
+    return ok ? len : 0;
+  }
+  return send(frame, len);
+}
+
+/**
+ * Sends a frame and reads its response
+ * @return number of response bytes received
+ */
+int SMC::request(const char *frame, int len, char *response, int responseLen){
+  return transfer(frame, len, 1, response, responseLen);
+}
+
 /**
  * Sends the exit safe start command to all devices
  * @return 1 if successfully sent
  */
 int SMC::exitSafeStart(){
 
+  char frame[SMC_MAX_FRAME];
+
   //use compact format for broadcast
-  _buffer[0] = (char)COMPACT_COM::EXIT_SS;
+  int len = encodeCompact<POLOLU_COM::EXIT_SS>(frame);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::EXIT_SS);
+  // a motor stopped by an error must get its speed again
+  _encoder.forget(SMC_BROADCAST);
+
+  return send(frame, len);
 }
 
 /**
@@ -48,14 +368,14 @@ int SMC::exitSafeStart(){
  */
 int SMC::exitSafeStart(uint8_t device){
 
+  char frame[SMC_MAX_FRAME];
+
   // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  int len = encodePololu<POLOLU_COM::EXIT_SS>(frame, device);
 
-  //start filling in _buffer at [2]
-  _buffer[2] = (char)POLOLU_COM::EXIT_SS;
+  _encoder.forget(device);
 
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::EXIT_SS);
+  return send(frame, len);
 }
 
 /**
@@ -64,20 +384,17 @@ int SMC::exitSafeStart(uint8_t device){
  */
 int SMC::motorForward(uint16_t pwm){
 
+  char frame[SMC_MAX_FRAME];
+
   // return instead of clamping to 3200 for safety
   if(pwm > 3200)
     return 0;
 
   // use compact format for broadcast
-  _buffer[0] = (char)COMPACT_COM::MOTOR_FORWARD;
-
-  // first byte is lower 5 bits of pwm
-  _buffer[1] = pwm & 0x1F;
-  // second byte is the remaining upper 7 bits
-  _buffer[2] = pwm >> 5;
+  // low 5 bits of pwm, then the remaining upper 7 bits
+  int len = encodeCompact<POLOLU_COM::MOTOR_FORWARD>(frame, pwm);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::MOTOR_FORWARD);
-  
+  return setpoint(SMC_BROADCAST, frame, len);
 }
 
 /**
@@ -87,20 +404,16 @@ int SMC::motorForward(uint16_t pwm){
  */
 int SMC::motorForward(uint8_t device, uint16_t pwm){
 
+  char frame[SMC_MAX_FRAME];
+
   // return instead of clamping to 3200 for safety
   if(pwm > 3200)
     return 0;
 
   // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, device, pwm);
 
-  // start filling in _buffer at [2]
-  _buffer[2] = (char)POLOLU_COM::MOTOR_FORWARD;
-  _buffer[3] = pwm & 0x1F;
-  _buffer[4] = pwm >> 5;
-
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::MOTOR_FORWARD);
+  return setpoint(device, frame, len);
 }
 
 /**
@@ -109,16 +422,16 @@ int SMC::motorForward(uint8_t device, uint16_t pwm){
  */
 int SMC::motorReverse(uint16_t pwm){
 
+  char frame[SMC_MAX_FRAME];
+
   // return instead of clamping to 3200 for safety
   if(pwm > 3200)
     return 0;
 
   //use compact format for broadcast
-  _buffer[0] = (int)COMPACT_COM::MOTOR_REVERSE;
-  _buffer[1] = pwm & 0x1F;
-  _buffer[2] = pwm >> 5;
+  int len = encodeCompact<POLOLU_COM::MOTOR_REVERSE>(frame, pwm);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::MOTOR_REVERSE);
+  return setpoint(SMC_BROADCAST, frame, len);
 }
 
 /**
@@ -128,20 +441,16 @@ int SMC::motorReverse(uint16_t pwm){
  */
 int SMC::motorReverse(uint8_t device, uint16_t pwm){
 
+  char frame[SMC_MAX_FRAME];
+
   // return instead of clamping to 3200 for safety
   if(pwm > 3200)
     return 0;
 
   // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
-
-  _buffer[2] = (char)POLOLU_COM::MOTOR_REVERSE;
-  _buffer[3] = pwm & 0x1F;
-  _buffer[4] = pwm >> 5;
-
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::MOTOR_REVERSE);
+  int len = encodePololu<POLOLU_COM::MOTOR_REVERSE>(frame, device, pwm);
 
+  return setpoint(device, frame, len);
 }
 
 /**
@@ -150,15 +459,16 @@ int SMC::motorReverse(uint8_t device, uint16_t pwm){
  */
 int SMC::motorForward_7Bit(uint8_t pwm ){
 
-  // return instead of clamping to 3200 for safety
+  char frame[SMC_MAX_FRAME];
+
+  // return instead of clamping to 127 for safety
   if(pwm > 127)
     return 0;
 
   //use compact format for broadcast
-  _buffer[0] = (int)COMPACT_COM::MOTOR_FORWARD_7BIT;
-  _buffer[1] = pwm;
+  int len = encodeCompact<POLOLU_COM::MOTOR_FORWARD_7BIT>(frame, pwm);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::MOTOR_FORWARD_7BIT);
+  return setpoint(SMC_BROADCAST, frame, len);
 }
 
 /**
@@ -168,18 +478,16 @@ int SMC::motorForward_7Bit(uint8_t pwm ){
  */
 int SMC::motorForward_7Bit(uint8_t device, uint8_t pwm){
 
-    // return instead of clamping to 3200 for safety
+  char frame[SMC_MAX_FRAME];
+
+  // return instead of clamping to 127 for safety
   if(pwm > 127)
     return 0;
 
   // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD_7BIT>(frame, device, pwm);
 
-  _buffer[2] = (char)POLOLU_COM::MOTOR_FORWARD_7BIT;
-  _buffer[3] = pwm;
-
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::MOTOR_FORWARD_7BIT);
+  return setpoint(device, frame, len);
 }
 
 /**
@@ -188,15 +496,16 @@ int SMC::motorForward_7Bit(uint8_t device, uint8_t pwm){
  */
 int SMC::motorReverse_7Bit(uint8_t pwm){
 
-  // return instead of clamping to 3200 for safety
+  char frame[SMC_MAX_FRAME];
+
+  // return instead of clamping to 127 for safety
   if(pwm > 127)
     return 0;
 
   //use compact format for broadcast
-  _buffer[0] = (int)COMPACT_COM::MOTOR_REVERSE_7BIT;
-  _buffer[1] = pwm;
+  int len = encodeCompact<POLOLU_COM::MOTOR_REVERSE_7BIT>(frame, pwm);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::MOTOR_REVERSE_7BIT);
+  return setpoint(SMC_BROADCAST, frame, len);
 }
 
 /**
@@ -206,18 +515,16 @@ int SMC::motorReverse_7Bit(uint8_t pwm){
  */
 int SMC::motorReverse_7Bit(uint8_t device, uint8_t pwm){
 
-  // return instead of clamping to 3200 for safety
+  char frame[SMC_MAX_FRAME];
+
+  // return instead of clamping to 127 for safety
   if(pwm > 127)
     return 0;
 
   // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
-
-  _buffer[2] = (char)POLOLU_COM::MOTOR_REVERSE_7BIT;
-  _buffer[3] = pwm;
+  int len = encodePololu<POLOLU_COM::MOTOR_REVERSE_7BIT>(frame, device, pwm);
 
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::MOTOR_REVERSE_7BIT);
+  return setpoint(device, frame, len);
 }
 
 /**
@@ -226,15 +533,16 @@ int SMC::motorReverse_7Bit(uint8_t device, uint8_t pwm){
  */
 int SMC::motorBrake(uint8_t duty){
 
-  // return instead of clamping to 3200 for safety
+  char frame[SMC_MAX_FRAME];
+
+  // return instead of clamping to 32 for safety
   if(duty > 32)
     return 0;
 
   //use compact format for broadcast
-  _buffer[0] = (int)COMPACT_COM::MOTOR_BRAKE;
-  _buffer[1] = duty;
+  int len = encodeCompact<POLOLU_COM::MOTOR_BRAKE>(frame, duty);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::MOTOR_BRAKE);
+  return urgent(SMC_BROADCAST, frame, len);
 }
 
 /**
@@ -244,30 +552,44 @@ int SMC::motorBrake(uint8_t duty){
  */
 int SMC::motorBrake(uint8_t device, uint8_t duty){
 
-  // return instead of clamping to 3200 for safety
+  char frame[SMC_MAX_FRAME];
+
+  // return instead of clamping to 32 for safety
   if(duty > 32)
     return 0;
-  
-  // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
 
-  _buffer[2] = (char)POLOLU_COM::MOTOR_BRAKE;
-  _buffer[3] = duty;
+  // use pololu format for single device
+  int len = encodePololu<POLOLU_COM::MOTOR_BRAKE>(frame, device, duty);
 
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::MOTOR_BRAKE);
+  return urgent(device, frame, len);
 }
 
 /**
  * Sends stop command to all devices
  * Enters safe start mode
+ * Preempts and discards pending output
  */
 int SMC::motorStop(){
 
+  _encoder.forget(SMC_BROADCAST);
+
+  if(_dispatcher && _dispatcher->isRunning()){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int ok = _dispatcher->emergencyStop();
+    _metrics.record((uint8_t)POLOLU_COM::MOTOR_STOP, ok, start);
+    return ok;
+  }
+
+  char frame[SMC_MAX_FRAME];
+
   //use compact format for broadcast
-  _buffer[0] = (int)COMPACT_COM::MOTOR_STOP;
+  int len = encodeCompact<POLOLU_COM::MOTOR_STOP>(frame);
+
+  // nothing still in the send buffer may reach a motor after the stop
+  if(!_reactor)
+    _conn->flushPort(SerialPort::flush_send);
 
-  return _conn->sendArray(_buffer, (int)COMPACT_COM_BYTES::MOTOR_STOP);
+  return send(frame, len);
 }
   
 /**
@@ -277,13 +599,153 @@ int SMC::motorStop(){
  */
 int SMC::motorStop(uint8_t device){
 
+  char frame[SMC_MAX_FRAME];
+
   // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  int len = encodePololu<POLOLU_COM::MOTOR_STOP>(frame, device);
 
-  _buffer[2] = (char)POLOLU_COM::MOTOR_STOP;
+  return urgent(device, frame, len);
+}
 
-  return _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::MOTOR_STOP);
+/**
+ * Sets the Mini SSC offset configured on the controllers
+ * @param offset servo number of device 0, 0-254
+ */
+void SMC::setMiniSscOffset(uint8_t offset){
+  _sscOffset = offset;
+}
+
+/**
+ * Sends the speed of several devices back to back in a single write
+ * @param setpoints array of count device and speed pairs
+ * @param count number of setpoints, at most SMC_MAX_FLEET
+ * @param format frame format, MINI_SSC uses the fewest bytes
+ * @return number of bytes sent or stored, 0 if a speed is out of range
+ */
+int SMC::setFleetSpeeds(const SMCSetpoint *setpoints, int count, FLEET_FORMAT format){
+
+  if(count <= 0 || count > SMC_MAX_FLEET)
+    return 0;
+
+  int frameLen = format == FLEET_FORMAT::MINI_SSC ?
+    (int)SSC_COM_BYTES::SSC_PWM : Command<POLOLU_COM::MOTOR_FORWARD>::pololuLen;
+  char frames[SMC_MAX_FLEET * SMC_MAX_FRAME];
+  uint8_t slots[SMC_MAX_FLEET];
+
+  for(int i = 0; i < count; i++){
+    int16_t speed = setpoints[i].speed;
+    char *frame = frames + i * frameLen;
+
+    // return instead of clamping to 3200 for safety
+    if(speed > 3200 || speed < -3200)
+      return 0;
+
+    uint8_t device = setpoints[i].device;
+    if(device > 127)
+      return 0;
+
+    // the Mini SSC servo number of a device is its ID plus the offset,
+    // past 254 it would be the 0xFF command byte and desync the line
+    if(format == FLEET_FORMAT::MINI_SSC && device + _sscOffset > 254)
+      return 0;
+
+    if(format == FLEET_FORMAT::MINI_SSC)
+      encodeSsc(frame, device + _sscOffset, speed);
+    else if(speed >= 0)
+      encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, device, (uint16_t)speed);
+    else
+      encodePololu<POLOLU_COM::MOTOR_REVERSE>(frame, device, (uint16_t)-speed);
+    slots[i] = device;
+  }
+
+  // nothing was sent if a setpoint was rejected above
+  for(int i = 0; i < count; i++)
+    _encoder.forget(slots[i]);
+
+  if(_dispatcher && _dispatcher->isRunning()){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int ok = _dispatcher->group(slots, count, frames, frameLen * count);
+    _metrics.record(CommandMetrics::command(frames), ok, start);
+    return ok ? frameLen * count : 0;
+  }
+
+  // a reactor takes the frames as one run, nothing gets between them
+  return transfer(frames, frameLen, count, NULL, 0);
+}
+
+/**
+ * Sets the speed of every device with the shortest frame
+ * @return 1 if sent, stored or left out, 0 if out of range or failed
+ */
+int SMC::setSpeed(int16_t speed){
+  return setSpeed(NULL, 0, speed);
+}
+
+/**
+ * Sets the speed of a device with the shortest frame
+ * @return 1 if sent, stored or left out, 0 if out of range or failed
+ */
+int SMC::setSpeed(uint8_t device, int16_t speed){
+  return setSpeed(&device, 1, speed);
+}
+
+/**
+ * Sets the speed of several devices with the shortest frames
+ * @return 1 if sent, stored or left out, 0 if out of range or failed
+ */
+int SMC::setSpeed(const uint8_t *devices, int count, int16_t speed){
+
+  char frames[SMC_MAX_SETPOINT_DEVICES * SMC_MAX_FRAME];
+  int lens[SMC_MAX_SETPOINT_DEVICES];
+  uint8_t slots[SMC_MAX_SETPOINT_DEVICES];
+
+  int n = _encoder.encode(devices, count, speed, frames, lens, slots);
+  if(n < 0)
+    return 0;
+
+  if(_dispatcher && _dispatcher->isRunning()){
+    int ok = 1;
+    for(int i = 0; i < n; i++){
+      if(!store(slots[i], frames + i * SMC_MAX_FRAME, lens[i])){
+        // not sent, so the next one must not be left out
+        _encoder.forget(slots[i]);
+        ok = 0;
+      }
+    }
+    return ok;
+  }
+
+  // a reactor request holds one frame
+  if(_reactor){
+    int ok = 1;
+    for(int i = 0; i < n; i++){
+      if(send(frames + i * SMC_MAX_FRAME, lens[i]) != lens[i]){
+        _encoder.forget(slots[i]);
+        ok = 0;
+      }
+    }
+    return ok;
+  }
+
+  // back to back in a single write
+  int len = 0;
+  for(int i = 0; i < n; i++){
+    memmove(frames + len, frames + i * SMC_MAX_FRAME, lens[i]);
+    len += lens[i];
+  }
+  if(n && send(frames, len) != len){
+    for(int i = 0; i < n; i++)
+      _encoder.forget(slots[i]);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @return the encoder setSpeed uses
+ */
+SetpointEncoder* SMC::getSetpointEncoder(){
+  return &_encoder;
 }
 
 /**
@@ -296,25 +758,20 @@ int SMC::motorStop(uint8_t device){
  */
 int SMC::setMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, uint8_t &responseCode){
 
-  // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  char frame[SMC_MAX_FRAME];
+  char response[SMC_MAX_RESPONSE];
 
-  _buffer[2] = (char)POLOLU_COM::SET_LIMIT;
-  _buffer[3] = limitID;
-  //byte 4 is low 7 bits of val
-  _buffer[4] = val & 0x7F;
-  //byte 5 is remaining 7 high bits of val
-  _buffer[5] = val >> 7;
+  // use pololu format for single device
+  // limit ID, then low 7 bits and high 7 bits of val
+  int len = encodePololu<POLOLU_COM::SET_LIMIT>(frame, device, limitID, val);
 
-  int tmp = _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::SET_LIMIT);
+  int tmp = request(frame, len, response, Command<POLOLU_COM::SET_LIMIT>::responseLen);
 
   if(tmp){
-    tmp = _conn->getArray(_buffer, (int)COM_RES_BYTES::SET_LIMIT);
     //get the last 3 bits for response code
-    responseCode = _buffer[0] & 0x03;
+    responseCode = response[0] & 0x03;
   }
-  return tmp == (int)COM_RES_BYTES::SET_LIMIT;
+  return tmp == Command<POLOLU_COM::SET_LIMIT>::responseLen;
 }
 
 /**
@@ -324,22 +781,84 @@ int SMC::setMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, uint8_t &r
  */
  int SMC::getMotorVariable(uint8_t device, uint8_t variableID, uint16_t &variableVal){
 
-  // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  char frame[SMC_MAX_FRAME];
+  char response[SMC_MAX_RESPONSE];
 
-  _buffer[2] = (char)POLOLU_COM::GET_SMC_VAR;
+  // use pololu format for single device
+  int len = encodePololu<POLOLU_COM::GET_SMC_VAR>(frame, device, variableID);
 
-  _buffer[3] = variableID;
-  int tmp = _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::GET_SMC_VAR);
+  int tmp = request(frame, len, response, Command<POLOLU_COM::GET_SMC_VAR>::responseLen);
 
   if(tmp){
-    tmp = _conn->getArray(_buffer, (int)COM_RES_BYTES::GET_SMC_VAR);
     //combine two bytes to form 16 bit value
-    variableVal = ((uint16_t)(_buffer[1]) << 8) | _buffer[0];
-    //variableVal = _buffer[0] + 256*_buffer[1];
+    variableVal = ((uint16_t)(uint8_t)response[1] << 8) | (uint8_t)response[0];
   }
-  return tmp == (int)COM_RES_BYTES::GET_SMC_VAR;
+  return tmp == Command<POLOLU_COM::GET_SMC_VAR>::responseLen;
+}
+
+/**
+ * Reads several variables on a specific device in one round trip
+ * @param uint8_t ID of device
+ * @param variableIDs array of count variable IDs
+ * @param count number of variables, at most SMC_MAX_BATCH_VARS
+ * @param variableVals array of count values, filled in request order
+ * @return 1 if every value was read, 0 otherwise
+ */
+int SMC::getMotorVariables(uint8_t device, const uint8_t *variableIDs, int count, uint16_t *variableVals){
+
+  if(count <= 0 || count > SMC_MAX_BATCH_VARS)
+    return 0;
+
+  typedef Command<POLOLU_COM::GET_SMC_VAR> GetVar;
+  char frames[SMC_MAX_BATCH_VARS * GetVar::pololuLen];
+  char response[SMC_MAX_BATCH_VARS * GetVar::responseLen];
+
+  // back to back pololu format requests, one per variable
+  for(int i = 0; i < count; i++)
+    encodePololu<POLOLU_COM::GET_SMC_VAR>(frames + i * GetVar::pololuLen, device, variableIDs[i]);
+
+  // the device answers in request order, two bytes per variable
+  int expected = count * GetVar::responseLen;
+  int received = transfer(frames, GetVar::pololuLen, count, response, GetVar::responseLen);
+  for(int i = 0; i + 1 < received; i += 2)
+    variableVals[i / 2] = ((uint16_t)(uint8_t)response[i + 1] << 8) | (uint8_t)response[i];
+
+  return received == expected;
+}
+
+/**
+ * Reads the status and diagnostic variables of a specific device
+ * @param uint8_t ID of device
+ * @param SMCTelemetry ref for the snapshot
+ * @return 1 if success
+ */
+int SMC::getTelemetry(uint8_t device, SMCTelemetry &telemetry){
+
+  static const uint8_t ids[] = {
+    (uint8_t)SMC_VAR::ERROR_STATUS,
+    (uint8_t)SMC_VAR::LIMIT_STATUS,
+    (uint8_t)SMC_VAR::TARGET_PWM,
+    (uint8_t)SMC_VAR::CURRENT_PWM,
+    (uint8_t)SMC_VAR::BRAKE_AMOUNT,
+    (uint8_t)SMC_VAR::INPUT_VOLTAGE,
+    (uint8_t)SMC_VAR::TEMPERATURE,
+    (uint8_t)SMC_VAR::SYSTEM_TIME_LOW,
+    (uint8_t)SMC_VAR::SYSTEM_TIME_HIGH
+  };
+  uint16_t vals[sizeof(ids)];
+
+  if(!getMotorVariables(device, ids, sizeof(ids), vals))
+    return 0;
+
+  telemetry.errorStatus = vals[0];
+  telemetry.limitStatus = vals[1];
+  telemetry.targetPwm = (int16_t)vals[2];
+  telemetry.currentPwm = (int16_t)vals[3];
+  telemetry.brakeAmount = vals[4];
+  telemetry.inputVoltage = vals[5];
+  telemetry.temperature = vals[6];
+  telemetry.systemTime = ((uint32_t)vals[8] << 16) | vals[7];
+  return 1;
 }
 
 /**
@@ -352,19 +871,227 @@ int SMC::setMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, uint8_t &r
  */
 int SMC::getFirmwareVersion(uint8_t device, uint16_t &productID, uint8_t &majorVersion, uint8_t &minorVersion){
 
-  // use pololu format for single device
-  // fill in first two bytes
-  initPololuMsg(device);
+  char frame[SMC_MAX_FRAME];
+  char response[SMC_MAX_RESPONSE];
 
-  _buffer[2] = (char)POLOLU_COM::GET_FIRMWARE;
+  // use pololu format for single device
+  int len = encodePololu<POLOLU_COM::GET_FIRMWARE>(frame, device);
 
-  int tmp = _conn->sendArray(_buffer, (int)POLOLU_COM_BYTES::GET_FIRMWARE);
+  int tmp = request(frame, len, response, Command<POLOLU_COM::GET_FIRMWARE>::responseLen);
 
   if(tmp){
-    tmp =_conn->getArray(_buffer, (int)COM_RES_BYTES::GET_FIRMWARE);
-    productID = ((uint16_t)(_buffer[1]) << 8) | _buffer[0];
-    minorVersion = (uint8_t)_buffer[2];
-    majorVersion = (uint8_t)_buffer[3];
+    productID = ((uint16_t)(uint8_t)response[1] << 8) | (uint8_t)response[0];
+    minorVersion = (uint8_t)response[2];
+    majorVersion = (uint8_t)response[3];
+  }
+  return tmp == Command<POLOLU_COM::GET_FIRMWARE>::responseLen;
+}
+
+/**
+ * Sends GET_FIRMWARE to every ID of a range in one write and reads the
+ * answers that arrive until their wire time plus slack has passed
+ * @param answers room for an answer per ID and one byte more
+ * @return answer bytes received, -1 if the write failed
+ */
+int SMC::probe(uint8_t first, uint8_t last, char *answers, long slackUs){
+
+  char frames[128 * SMC_MAX_FRAME];
+  int responseLen = Command<POLOLU_COM::GET_FIRMWARE>::responseLen;
+  int count = last - first + 1;
+  int len = 0;
+  for(int device = first; device <= last; device++)
+    len += encodePololu<POLOLU_COM::GET_FIRMWARE>(frames + len, device);
+
+  // late answers of an earlier range must not count for this one
+  _conn->flushPort(SerialPort::flush_receive);
+  if(_conn->sendArray(frames, len) != len)
+    return -1;
+
+  // 8N1, ten bit times per byte, the last answer starts after the last
+  // probe has gone out
+  int baud = _conn->getBaud();
+  long wireUs = baud > 0 ? (long)(len + responseLen) * 10 * 1000000L / baud : 0;
+  return _conn->getAvailable(answers, count * responseLen + 1, wireUs + slackUs);
+}
+
+/**
+ * Finds the devices of a range whose answers are known
+ * @param answered answer bytes of the range, -1 if not probed yet
+ * @param answers those bytes, NULL if only inferred
+ */
+void SMC::scanRange(uint8_t first, uint8_t last, int answered, const char *answers, Scan &scan){
+
+  int responseLen = Command<POLOLU_COM::GET_FIRMWARE>::responseLen;
+  char own[128 * SMC_MAX_RESPONSE + 1];
+
+  if(answered < 0){
+    answered = probe(first, last, own, scan.slackUs);
+    answers = own;
+  }
+  if(answered <= 0 || scan.count >= scan.room)
+    return;
+
+  if(first == last){
+    for(int i = 0; (!answers || answered != responseLen) && i <= SMC_SCAN_RETRIES; i++){
+      answered = probe(first, last, own, scan.slackUs);
+      answers = own;
+    }
+    if(!answers || answered != responseLen)
+      return;
+    SMCDeviceInfo &info = scan.found[scan.count++];
+    info.device = first;
+    info.productID = ((uint16_t)(uint8_t)answers[1] << 8) | (uint8_t)answers[0];
+    info.version = ((uint16_t)(uint8_t)answers[3] << 8) | (uint8_t)answers[2];
+    return;
+  }
+
+  uint8_t mid = first + (last - first) / 2;
+  char lower[128 * SMC_MAX_RESPONSE + 1];
+  int lowerAnswered = probe(first, mid, lower, scan.slackUs);
+  scanRange(first, mid, lowerAnswered, lower, scan);
+
+  // the upper half gave what the lower half did not, known without a
+  // probe when the lower half gave nothing or the range's only answer
+  if(lowerAnswered == 0)
+    scanRange(mid + 1, last, answered, NULL, scan);
+  else if(answered != responseLen || lowerAnswered != responseLen)
+    scanRange(mid + 1, last, -1, NULL, scan);
+}
+
+/**
+ * Finds the devices on the line
+ * @return number of devices found, -1 if the port is in use or closed
+ */
+int SMC::scan(SMCDeviceInfo *found, int room, uint8_t first, uint8_t last, long slackUs){
+
+  if(queued() || !_conn || !_conn->isOpen() || !found || room <= 0 || first > last || last > 127)
+    return -1;
+
+  Scan scan;
+  scan.found = found;
+  scan.room = room;
+  scan.count = 0;
+  scan.slackUs = slackUs;
+  scanRange(first, last, -1, NULL, scan);
+  return scan.count;
+}
+
+/**
+ * Reads the specified variable on a specific device without blocking
+ * @param uint8_t ID of device
+ * @param uint8_t ID of variable
+ * @param done called on the I/O thread with the status and value
+ * @return 1 if queued, 0 if the I/O thread is not running
+ */
+int SMC::asyncGetMotorVariable(uint8_t device, uint8_t variableID, SMCValueCallback done){
+
+  if(!queued())
+    return 0;
+
+  SMCRequest req;
+  req.frameLen = encodePololu<POLOLU_COM::GET_SMC_VAR>(req.frame, device, variableID);
+  req.responseLen = Command<POLOLU_COM::GET_SMC_VAR>::responseLen;
+  req.done = variableDone;
+  req.ctx = new AsyncValue{done, &_metrics, std::chrono::steady_clock::now()};
+
+  if(!submit(req)){
+    delete (AsyncValue *)req.ctx;
+    return 0;
   }
-  return tmp == (int)COM_RES_BYTES::GET_FIRMWARE;
+  return 1;
+}
+
+/**
+ * Reads the specified variable on a specific device without blocking
+ * @param uint8_t ID of device
+ * @param uint8_t ID of variable
+ * @return future holding the status and value
+ */
+std::future<SMCValue> SMC::asyncGetMotorVariable(uint8_t device, uint8_t variableID){
+
+  std::shared_ptr<std::promise<SMCValue> > result(new std::promise<SMCValue>());
+  std::future<SMCValue> future = result->get_future();
+
+  if(!asyncGetMotorVariable(device, variableID, [result](int status, uint16_t val){
+        result->set_value(SMCValue{status, val});
+      }))
+    result->set_value(SMCValue{0, 0});
+  return future;
+}
+
+/**
+ * Sends a set limit command to a specific device without blocking
+ * @param uint8_t ID of device
+ * @param uint8_t ID of limit
+ * @param limit value
+ * @param done called on the I/O thread with the status and response code
+ * @return 1 if queued, 0 if the I/O thread is not running
+ */
+int SMC::asyncSetMotorLimit(uint8_t device, uint8_t limitID, uint16_t val, SMCValueCallback done){
+
+  if(!queued())
+    return 0;
+
+  SMCRequest req;
+  req.frameLen = encodePololu<POLOLU_COM::SET_LIMIT>(req.frame, device, limitID, val);
+  req.responseLen = Command<POLOLU_COM::SET_LIMIT>::responseLen;
+  req.done = limitDone;
+  req.ctx = new AsyncValue{done, &_metrics, std::chrono::steady_clock::now()};
+
+  if(!submit(req)){
+    delete (AsyncValue *)req.ctx;
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Sends a set limit command to a specific device without blocking
+ * @param uint8_t ID of device
+ * @param uint8_t ID of limit
+ * @param limit value
+ * @return future holding the status and response code
+ */
+std::future<SMCValue> SMC::asyncSetMotorLimit(uint8_t device, uint8_t limitID, uint16_t val){
+
+  std::shared_ptr<std::promise<SMCValue> > result(new std::promise<SMCValue>());
+  std::future<SMCValue> future = result->get_future();
+
+  if(!asyncSetMotorLimit(device, limitID, val, [result](int status, uint16_t code){
+        result->set_value(SMCValue{status, code});
+      }))
+    result->set_value(SMCValue{0, 0});
+  return future;
+}
+
+/**
+ * Sets how many times a request whose response is missing or short
+ * is sent again
+ * @param retries extra attempts per call
+ */
+void SMC::setRetries(int retries){
+  _retries = retries > 0 ? retries : 0;
+}
+
+/**
+ * Copies the counters of this instance and its serial port
+ * @param stats filled with the counters
+ */
+void SMC::getStats(SMCStats &stats){
+  _metrics.snapshot(stats);
+  if(_conn)
+    _conn->getStats(stats.serial);
+  else
+    memset(&stats.serial, 0, sizeof(stats.serial));
+}
+
+/**
+ * Writes the counters in the Prometheus text format
+ * @param path file to replace
+ * @return 1 if written
+ */
+int SMC::writeStats(const std::string &path){
+  SMCStats stats;
+  getStats(stats);
+  return writePrometheus(stats, path.c_str());
 }
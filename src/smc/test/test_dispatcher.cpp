@@ -0,0 +1,207 @@
+/**
+ * Setpoint coalescing and priority lane ordering of the Dispatcher,
+ * against simulated controllers. Every frame that reaches the wire is
+ * recorded and read back, so the tests check what the devices were
+ * sent, not only what they ended up doing.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/Dispatcher.h"
+#include "smc/Simulator.h"
+#include "smc/WireRecorder.h"
+#include "smc/frames.h"
+
+/**
+ * Slow enough that a 5 byte frame keeps the wire busy for about 21 ms
+ */
+#define TEST_BAUD 2400
+
+/**
+ * Polls until check passes or a second is up
+ * @return the last result of check
+ */
+static bool waitFor(std::function<bool()> check){
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  while(!check()){
+    if(std::chrono::steady_clock::now() > end)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+class DispatcherTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+  WireRecorder recorder;
+  Dispatcher *dispatcher;
+  std::string path;
+
+  DispatcherTest() : dispatcher(NULL) {}
+
+  void SetUp(){
+    for(uint8_t device = 1; device <= 3; device++)
+      sim.addDevice(device);
+    sim.setBaud(TEST_BAUD);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), TEST_BAUD, 100));
+
+    path = ::testing::TempDir() + "smc_test_dispatcher_" + std::to_string(getpid()) + ".wire";
+    ASSERT_TRUE(recorder.open(path, 1024, TEST_BAUD));
+    port.setRecorder(&recorder);
+
+    dispatcher = new Dispatcher(&port);
+    ASSERT_TRUE(dispatcher->start());
+  }
+
+  void TearDown(){
+    delete dispatcher;
+    port.setRecorder(NULL);
+    recorder.close();
+    unlink(path.c_str());
+    sim.stop();
+  }
+
+  /**
+   * Parks the writer in the wait for the wire, so whatever is stored
+   * next is still pending when it wakes. Device 3 takes the two frames
+   * that keep the wire busy.
+   */
+  void holdWriter(){
+    char frame[SMC_MAX_FRAME];
+    int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 3, 10);
+    uint64_t before = recorder.count();
+    ASSERT_TRUE(dispatcher->setpoint(3, frame, len));
+    ASSERT_TRUE(waitFor([&]{ return recorder.count() > before; }));
+    len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 3, 20);
+    ASSERT_TRUE(dispatcher->setpoint(3, frame, len));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+
+  /**
+   * @return frames sent to a device with a command, oldest first
+   */
+  std::vector<WireFrame> sent(uint8_t device, POLOLU_COM command){
+    std::vector<WireFrame> frames, matched;
+    int baud = 0;
+    EXPECT_TRUE(WireRecorder::load(path, frames, baud));
+    for(size_t i = 0; i < frames.size(); i++)
+      if(frames[i].dir == WIRE_DIR::TX && frames[i].device == device
+         && frames[i].command == (uint8_t)command)
+        matched.push_back(frames[i]);
+    return matched;
+  }
+
+  int16_t targetPwm(uint8_t device){
+    return (int16_t)sim.getVariable(device, SMC_VAR::TARGET_PWM);
+  }
+};
+
+TEST_F(DispatcherTest, NewestSetpointReplacesPendingOnes){
+  holdWriter();
+  unsigned long before = dispatcher->coalescedCount();
+
+  char frame[SMC_MAX_FRAME];
+  for(int speed = 100; speed <= 1000; speed += 100){
+    int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, speed);
+    ASSERT_TRUE(dispatcher->setpoint(1, frame, len));
+  }
+  EXPECT_EQ(9u, dispatcher->coalescedCount() - before);
+
+  ASSERT_TRUE(waitFor([&]{ return targetPwm(1) == 1000; }));
+  std::vector<WireFrame> forward = sent(1, POLOLU_COM::MOTOR_FORWARD);
+  ASSERT_EQ(1u, forward.size());
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, 1000);
+  ASSERT_EQ(len, forward[0].len);
+  EXPECT_EQ(0, memcmp(frame, forward[0].data, len));
+}
+
+TEST_F(DispatcherTest, SetpointsOfSeveralDevicesLeaveTogether){
+  holdWriter();
+
+  char frame[SMC_MAX_FRAME];
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, 500);
+  ASSERT_TRUE(dispatcher->setpoint(1, frame, len));
+  len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 2, 600);
+  ASSERT_TRUE(dispatcher->setpoint(2, frame, len));
+
+  ASSERT_TRUE(waitFor([&]{ return targetPwm(1) == 500 && targetPwm(2) == 600; }));
+  std::vector<WireFrame> first = sent(1, POLOLU_COM::MOTOR_FORWARD);
+  std::vector<WireFrame> second = sent(2, POLOLU_COM::MOTOR_FORWARD);
+  ASSERT_EQ(1u, first.size());
+  ASSERT_EQ(1u, second.size());
+  // one write, back to back on the wire
+  EXPECT_EQ(first[0].seq + 1, second[0].seq);
+}
+
+TEST_F(DispatcherTest, UrgentFrameDropsTheDevicesPendingSetpoint){
+  holdWriter();
+
+  char frame[SMC_MAX_FRAME];
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, 800);
+  ASSERT_TRUE(dispatcher->setpoint(1, frame, len));
+  len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 2, 800);
+  ASSERT_TRUE(dispatcher->setpoint(2, frame, len));
+  len = encodePololu<POLOLU_COM::MOTOR_BRAKE>(frame, 1, 32);
+  ASSERT_TRUE(dispatcher->urgent(1, frame, len));
+
+  ASSERT_TRUE(waitFor([&]{ return targetPwm(2) == 800
+                                  && sim.getVariable(1, SMC_VAR::BRAKE_AMOUNT) == 32; }));
+  EXPECT_EQ(0, targetPwm(1));
+  EXPECT_TRUE(sent(1, POLOLU_COM::MOTOR_FORWARD).empty());
+
+  // the priority lane goes ahead of the setpoints in the same write
+  std::vector<WireFrame> brake = sent(1, POLOLU_COM::MOTOR_BRAKE);
+  std::vector<WireFrame> forward = sent(2, POLOLU_COM::MOTOR_FORWARD);
+  ASSERT_EQ(1u, brake.size());
+  ASSERT_EQ(1u, forward.size());
+  EXPECT_LT(brake[0].seq, forward[0].seq);
+}
+
+TEST_F(DispatcherTest, BroadcastUrgentFrameDropsEveryPendingSetpoint){
+  holdWriter();
+
+  char frame[SMC_MAX_FRAME];
+  for(uint8_t device = 1; device <= 2; device++){
+    int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, device, 800);
+    ASSERT_TRUE(dispatcher->setpoint(device, frame, len));
+  }
+  int len = encodeCompact<POLOLU_COM::MOTOR_BRAKE>(frame, 32);
+  ASSERT_TRUE(dispatcher->urgent(SMC_BROADCAST, frame, len));
+
+  ASSERT_TRUE(waitFor([&]{ return sim.getVariable(1, SMC_VAR::BRAKE_AMOUNT) == 32
+                                  && sim.getVariable(2, SMC_VAR::BRAKE_AMOUNT) == 32; }));
+  EXPECT_EQ(1u, sent(SMC_BROADCAST, POLOLU_COM::MOTOR_BRAKE).size());
+  EXPECT_TRUE(sent(1, POLOLU_COM::MOTOR_FORWARD).empty());
+  EXPECT_TRUE(sent(2, POLOLU_COM::MOTOR_FORWARD).empty());
+  EXPECT_EQ(0, targetPwm(1));
+  EXPECT_EQ(0, targetPwm(2));
+}
+
+TEST_F(DispatcherTest, BroadcastSetpointDropsPerDeviceOnes){
+  holdWriter();
+
+  char frame[SMC_MAX_FRAME];
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, 800);
+  ASSERT_TRUE(dispatcher->setpoint(1, frame, len));
+  len = encodeCompact<POLOLU_COM::MOTOR_FORWARD>(frame, 300);
+  ASSERT_TRUE(dispatcher->setpoint(SMC_BROADCAST, frame, len));
+
+  ASSERT_TRUE(waitFor([&]{ return targetPwm(1) == 300 && targetPwm(2) == 300; }));
+  EXPECT_TRUE(sent(1, POLOLU_COM::MOTOR_FORWARD).empty());
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,172 @@
+/**
+ * MotorGroup updates against simulated controllers, and that a group's
+ * frames reach the wire back to back while other requests share the
+ * port through a reactor
+ */
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/MotorGroup.h"
+#include "smc/SerialReactor.h"
+#include "smc/Simulator.h"
+#include "smc/WireRecorder.h"
+
+#define TEST_BAUD 115200
+
+class MotorGroupTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+  WireRecorder recorder;
+  std::string path;
+
+  void SetUp(){
+    for(uint8_t device = 1; device <= 4; device++)
+      sim.addDevice(device);
+    sim.setBaud(TEST_BAUD);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), TEST_BAUD, 100));
+
+    path = ::testing::TempDir() + "smc_test_motor_group_" + std::to_string(getpid()) + ".wire";
+    ASSERT_TRUE(recorder.open(path, 8192, TEST_BAUD));
+    port.setRecorder(&recorder);
+  }
+
+  void TearDown(){
+    port.setRecorder(NULL);
+    recorder.close();
+    unlink(path.c_str());
+    sim.stop();
+  }
+
+  int16_t target(uint8_t device){
+    return (int16_t)sim.getVariable(device, SMC_VAR::TARGET_PWM);
+  }
+
+  /**
+   * @return the devices of the recorded speed frames, in wire order
+   */
+  std::vector<uint8_t> speedFrames(){
+    std::vector<WireFrame> frames;
+    int baud = 0;
+    EXPECT_TRUE(WireRecorder::load(path, frames, baud));
+    std::vector<uint8_t> devices;
+    for(size_t i = 0; i < frames.size(); i++)
+      if(frames[i].dir == WIRE_DIR::TX
+         && (frames[i].command == (uint8_t)POLOLU_COM::MOTOR_FORWARD
+             || frames[i].command == (uint8_t)POLOLU_COM::MOTOR_REVERSE))
+        devices.push_back(frames[i].device);
+    return devices;
+  }
+};
+
+TEST_F(MotorGroupTest, SetsEveryMemberInOneWrite){
+  SMC smc(&port);
+  uint8_t devices[2] = {2, 1};
+  MotorGroup group(&smc, TEST_BAUD, devices, 2);
+  ASSERT_EQ(2, group.size());
+
+  ASSERT_TRUE(group.set(1500, -700));
+  uint16_t val = 0;
+  ASSERT_TRUE(smc.getMotorVariable(1, (uint8_t)SMC_VAR::TARGET_PWM, val));
+  EXPECT_EQ(-700, target(1));
+  EXPECT_EQ(1500, target(2));
+
+  EXPECT_FALSE(group.set(3201, 0));
+  MotorGroupStats stats;
+  group.getStats(stats);
+  EXPECT_EQ(1u, stats.updates);
+  EXPECT_EQ(1u, stats.failures);
+  // the second frame waits for the first, 5 bytes at 8N1
+  EXPECT_EQ(5 * 10 * 1000000L / TEST_BAUD, stats.wireSkewUs);
+
+  std::vector<uint8_t> sent = speedFrames();
+  ASSERT_EQ(2u, sent.size());
+  EXPECT_EQ(2, sent[0]);
+  EXPECT_EQ(1, sent[1]);
+}
+
+TEST_F(MotorGroupTest, RejectsBadMembers){
+  SMC smc(&port);
+  uint8_t devices[2] = {1, 128};
+  MotorGroup bad(&smc, TEST_BAUD, devices, 2);
+  EXPECT_EQ(0, bad.size());
+  EXPECT_FALSE(bad.set(0, 0));
+
+  // the pair setter needs a pair
+  MotorGroup single(&smc, TEST_BAUD, devices, 1);
+  EXPECT_EQ(1, single.size());
+  EXPECT_FALSE(single.set(0, 0));
+}
+
+TEST_F(MotorGroupTest, NothingGetsBetweenMembersOnAReactor){
+  SerialReactor reactor;
+  int index = reactor.addPort(&port, 100);
+  ASSERT_GE(index, 0);
+  ASSERT_TRUE(reactor.start());
+  SMC smc(&port);
+  smc.setReactor(&reactor, index);
+
+  // other threads keep keepalive frames queued on the same port
+  std::atomic<bool> running(true);
+  std::vector<std::thread> others;
+  for(int i = 0; i < 4; i++)
+    others.push_back(std::thread([&]{
+      while(running){
+        smc.exitSafeStart(4);
+        std::this_thread::sleep_for(std::chrono::milliseconds(3));
+      }
+    }));
+
+  // paced like a control loop, write-only frames complete once queued
+  // and a flood would hold the read below past its deadline
+  uint8_t devices[3] = {1, 2, 3};
+  MotorGroup group(&smc, TEST_BAUD, devices, 3);
+  for(int16_t i = 0; i < 200; i++){
+    int16_t speeds[3] = {i, (int16_t)-i, (int16_t)(2 * i)};
+    ASSERT_TRUE(group.set(speeds));
+    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+  }
+  running = false;
+  for(size_t i = 0; i < others.size(); i++)
+    others[i].join();
+
+  uint16_t val = 0;
+  ASSERT_TRUE(smc.getMotorVariable(1, (uint8_t)SMC_VAR::TARGET_PWM, val));
+  reactor.stop();
+  EXPECT_EQ(199, target(1));
+  EXPECT_EQ(-199, target(2));
+  EXPECT_EQ(398, target(3));
+
+  std::vector<uint8_t> sent = speedFrames();
+  ASSERT_EQ(600u, sent.size());
+  for(size_t i = 0; i < sent.size(); i++)
+    ASSERT_EQ(1 + i % 3, sent[i]) << "speed frame " << i;
+
+  // and no other frame between them
+  std::vector<WireFrame> frames;
+  int baud = 0;
+  ASSERT_TRUE(WireRecorder::load(path, frames, baud));
+  uint8_t next = 1;
+  for(size_t i = 0; i < frames.size(); i++){
+    if(frames[i].dir != WIRE_DIR::TX)
+      continue;
+    if(next != 1){
+      ASSERT_EQ(next, frames[i].device) << "frame " << frames[i].seq;
+    }
+    if(frames[i].device >= 1 && frames[i].device <= 3)
+      next = frames[i].device % 3 + 1;
+  }
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,138 @@
+/**
+ * PollScheduler rate planning against a simulated controller
+ */
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/PollScheduler.h"
+#include "smc/Simulator.h"
+
+/**
+ * One poll, request and answer, takes about 7.3 ms, so the default half
+ * budget carries about 68 polls per second
+ */
+#define TEST_BAUD 9600
+
+/**
+ * Polls until check passes or the time is up
+ * @return the last result of check
+ */
+static bool waitFor(std::function<bool()> check, int ms){
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  while(!check()){
+    if(std::chrono::steady_clock::now() > end)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return true;
+}
+
+class PollSchedulerTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+
+  void SetUp(){
+    sim.addDevice(1);
+    sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 12000);
+    sim.setVariable(1, SMC_VAR::TEMPERATURE, 250);
+    sim.setBaud(TEST_BAUD);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), TEST_BAUD, 50));
+  }
+
+  void TearDown(){
+    sim.stop();
+  }
+
+  static PollRate rate(PollScheduler &scheduler, SMC_VAR variable){
+    std::vector<PollRate> rates;
+    scheduler.getRates(rates);
+    for(size_t i = 0; i < rates.size(); i++)
+      if(rates[i].variableID == (uint8_t)variable)
+        return rates[i];
+    ADD_FAILURE() << "variable " << (int)variable << " is not polled";
+    return PollRate();
+  }
+};
+
+TEST_F(PollSchedulerTest, PollsIntoTheCacheAndCallbackWithinBudget){
+  SMC smc(&port);
+  TelemetryCache cache(&smc);
+  std::atomic<int> calls(0);
+  std::atomic<uint16_t> voltage(0);
+
+  PollScheduler scheduler(&smc, TEST_BAUD);
+  ASSERT_TRUE(scheduler.setRate(SMC_VAR::INPUT_VOLTAGE, 20, 1));
+  ASSERT_TRUE(scheduler.setRate(SMC_VAR::TEMPERATURE, 10, 0));
+  ASSERT_TRUE(scheduler.addDevice(1));
+  ASSERT_TRUE(scheduler.setCache(&cache));
+  ASSERT_TRUE(scheduler.setCallback([&](uint8_t device, uint8_t variableID, uint16_t value){
+    if(device == 1 && variableID == (uint8_t)SMC_VAR::INPUT_VOLTAGE)
+      voltage = value;
+    calls++;
+  }));
+  ASSERT_TRUE(scheduler.start());
+  EXPECT_FALSE(scheduler.setRate(SMC_VAR::TEMPERATURE, 50, 0));
+
+  // both fit, so both get their rate in full
+  EXPECT_DOUBLE_EQ(20, rate(scheduler, SMC_VAR::INPUT_VOLTAGE).plannedHz);
+  EXPECT_DOUBLE_EQ(10, rate(scheduler, SMC_VAR::TEMPERATURE).plannedHz);
+
+  ASSERT_TRUE(waitFor([&]{ return voltage == 12000
+                                  && rate(scheduler, SMC_VAR::TEMPERATURE).polls > 0; }, 1000));
+  scheduler.stop();
+  EXPECT_FALSE(scheduler.isRunning());
+
+  TelemetryCacheStats before, after;
+  cache.getStats(before);
+  uint16_t value = 0;
+  ASSERT_TRUE(cache.get(1, (uint8_t)SMC_VAR::TEMPERATURE, 60000, value));
+  EXPECT_EQ(250, value);
+  cache.getStats(after);
+  EXPECT_EQ(before.hits + 1, after.hits);
+  EXPECT_GT(calls, 1);
+}
+
+TEST_F(PollSchedulerTest, StarvesALowerPriorityWhileItsPollIsDue){
+  SMC smc(&port);
+  PollScheduler scheduler(&smc, TEST_BAUD);
+  // voltage alone wants more than the budget, temperature gets what
+  // voltage frees once it slows down for not changing
+  ASSERT_TRUE(scheduler.setRate(SMC_VAR::INPUT_VOLTAGE, 100, 2));
+  ASSERT_TRUE(scheduler.setRate(SMC_VAR::TEMPERATURE, 200, 0));
+  ASSERT_TRUE(scheduler.addDevice(1));
+  ASSERT_TRUE(scheduler.start());
+
+  EXPECT_EQ(0, rate(scheduler, SMC_VAR::TEMPERATURE).plannedHz);
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  EXPECT_EQ(0u, rate(scheduler, SMC_VAR::TEMPERATURE).polls);
+
+  ASSERT_TRUE(waitFor([&]{ return rate(scheduler, SMC_VAR::TEMPERATURE).polls > 10; }, 5000));
+  EXPECT_LT(rate(scheduler, SMC_VAR::INPUT_VOLTAGE).wantHz, 100);
+
+  // the change brings voltage back to its full rate, temperature has
+  // its poll due on a saturated link and gets nothing again
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 13000);
+  ASSERT_TRUE(waitFor([&]{ return rate(scheduler, SMC_VAR::TEMPERATURE).plannedHz == 0; }, 1000));
+  EXPECT_EQ(100, rate(scheduler, SMC_VAR::INPUT_VOLTAGE).wantHz);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  uint64_t starved = rate(scheduler, SMC_VAR::TEMPERATURE).polls;
+  uint64_t voltagePolls = rate(scheduler, SMC_VAR::INPUT_VOLTAGE).polls;
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  EXPECT_EQ(starved, rate(scheduler, SMC_VAR::TEMPERATURE).polls);
+  EXPECT_GT(rate(scheduler, SMC_VAR::INPUT_VOLTAGE).polls, voltagePolls + 10);
+  scheduler.stop();
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,111 @@
+/**
+ * SMC::scan against simulated controllers, on both serial backends
+ */
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/smc.h"
+#include "smc/Simulator.h"
+
+/**
+ * Room the simulator's replies need beyond their wire time, microseconds
+ */
+#define TEST_SLACK_US 2000
+
+class ScanTest : public ::testing::TestWithParam<SERIAL_BACKEND> {
+protected:
+  Simulator sim;
+  SerialPort *port;
+
+  ScanTest() : port(NULL) {}
+
+  /**
+   * Adds devices with a product ID and firmware version of their own
+   */
+  void addDevices(const std::vector<uint8_t> &ids){
+    for(size_t i = 0; i < ids.size(); i++)
+      sim.addDevice(ids[i], 0x98 + (i & 1) * 3, 0x01, 0x04 + i);
+  }
+
+  void connect(){
+    sim.setBaud(115200);
+    ASSERT_TRUE(sim.start());
+    port = new SerialPort(GetParam());
+    ASSERT_TRUE(port->connect(sim.getPath(), 115200, 100));
+  }
+
+  void TearDown(){
+    delete port;
+    sim.stop();
+  }
+};
+
+TEST_P(ScanTest, FindsNothingOnAnEmptyLine){
+  connect();
+  SMC smc(port);
+  SMCDeviceInfo found[128];
+  EXPECT_EQ(0, smc.scan(found, 128, 0, 127, TEST_SLACK_US));
+}
+
+TEST_P(ScanTest, FindsEdgeAndNeighbouringIds){
+  std::vector<uint8_t> ids = {0, 5, 6, 7, 13, 127};
+  addDevices(ids);
+  connect();
+  SMC smc(port);
+
+  SMCDeviceInfo found[128];
+  ASSERT_EQ((int)ids.size(), smc.scan(found, 128, 0, 127, TEST_SLACK_US));
+  for(size_t i = 0; i < ids.size(); i++){
+    EXPECT_EQ(ids[i], found[i].device);
+    EXPECT_EQ(0x98 + (i & 1) * 3, found[i].productID);
+    EXPECT_EQ(0x0104 + i, found[i].version);
+  }
+}
+
+TEST_P(ScanTest, StaysInsideTheRangeAndRoom){
+  addDevices({2, 3, 4, 40});
+  connect();
+  SMC smc(port);
+
+  SMCDeviceInfo found[128];
+  ASSERT_EQ(2, smc.scan(found, 128, 3, 39, TEST_SLACK_US));
+  EXPECT_EQ(3, found[0].device);
+  EXPECT_EQ(4, found[1].device);
+
+  ASSERT_EQ(1, smc.scan(found, 1, 0, 127, TEST_SLACK_US));
+  EXPECT_EQ(2, found[0].device);
+}
+
+TEST_P(ScanTest, SurvivesDroppedAndCorruptedAnswers){
+  std::vector<uint8_t> ids = {1, 2, 50, 90};
+  addDevices(ids);
+  sim.setFaults(0.05, 0.05, 7);
+  connect();
+  SMC smc(port);
+
+  SMCDeviceInfo found[128];
+  ASSERT_EQ((int)ids.size(), smc.scan(found, 128, 0, 127, TEST_SLACK_US));
+  for(size_t i = 0; i < ids.size(); i++)
+    EXPECT_EQ(ids[i], found[i].device);
+}
+
+TEST_P(ScanTest, RefusesWhileTheIoThreadRuns){
+  addDevices({1});
+  connect();
+  SMC smc(port);
+  ASSERT_TRUE(smc.startIoThread());
+
+  SMCDeviceInfo found[128];
+  EXPECT_EQ(-1, smc.scan(found, 128, 0, 127, TEST_SLACK_US));
+}
+
+// ASIO falls back to POSIX when it was not built
+INSTANTIATE_TEST_CASE_P(Backends, ScanTest,
+                        ::testing::Values(SERIAL_BACKEND::POSIX, SERIAL_BACKEND::ASIO));
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,154 @@
+/**
+ * SetpointEncoder frame choice, checked against what simulated
+ * controllers make of the frames
+ */
+
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "smc/smc.h"
+#include "smc/SetpointEncoder.h"
+#include "smc/Simulator.h"
+
+class SetpointEncoderTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+  SMC *smc;
+  SetpointEncoder encoder;
+
+  char frames[SMC_MAX_SETPOINT_DEVICES * SMC_MAX_FRAME];
+  int lens[SMC_MAX_SETPOINT_DEVICES];
+  uint8_t slots[SMC_MAX_SETPOINT_DEVICES];
+
+  SetpointEncoderTest() : smc(NULL) {}
+
+  void SetUp(){
+    sim.addDevice(1);
+    sim.addDevice(2);
+    sim.setBaud(115200);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), 115200, 100));
+    smc = new SMC(&port);
+  }
+
+  void TearDown(){
+    delete smc;
+    sim.stop();
+  }
+
+  /**
+   * Encodes a speed for devices and sends the frames
+   * @return number of frames, -1 on a bad argument
+   */
+  int send(const uint8_t *devices, int count, int16_t speed){
+    int n = encoder.encode(devices, count, speed, frames, lens, slots);
+    for(int i = 0; i < n; i++)
+      EXPECT_EQ(lens[i], port.sendArray(frames + i * SMC_MAX_FRAME, lens[i]));
+    return n;
+  }
+
+  /**
+   * @return the speed a device was set to, read over the wire after the
+   * frames sent before
+   */
+  int16_t target(uint8_t device){
+    uint16_t val = 0;
+    EXPECT_TRUE(smc->getMotorVariable(device, (uint8_t)SMC_VAR::TARGET_PWM, val));
+    return (int16_t)val;
+  }
+
+  uint64_t frameCount(SETPOINT_FORMAT format){
+    SetpointEncoderStats stats;
+    encoder.getStats(stats);
+    return stats.formats[(int)format];
+  }
+};
+
+TEST_F(SetpointEncoderTest, ExactSpeedsTakeFullResolutionFrames){
+  uint8_t device = 1;
+  ASSERT_EQ(1, send(&device, 1, 1000));
+  EXPECT_EQ((int)Command<POLOLU_COM::MOTOR_FORWARD>::pololuLen, lens[0]);
+  EXPECT_EQ(1, slots[0]);
+  EXPECT_EQ(1000, target(1));
+
+  ASSERT_EQ(1, send(&device, 1, -1235));
+  EXPECT_EQ(-1235, target(1));
+  EXPECT_EQ(2u, frameCount(SETPOINT_FORMAT::POLOLU));
+}
+
+TEST_F(SetpointEncoderTest, ShorterFramesLandWithinTheTolerance){
+  encoder.setTolerance(30);
+  uint8_t device = 1;
+  for(int16_t speed = -3200; speed <= 3200; speed += 347){
+    ASSERT_EQ(1, send(&device, 1, speed));
+    EXPECT_EQ((int)Command<POLOLU_COM::MOTOR_FORWARD_7BIT>::pololuLen, lens[0]);
+    EXPECT_LE(abs(target(1) - speed), 30) << "speed " << speed;
+  }
+
+  encoder.setMiniSsc(true, 0);
+  for(int16_t speed = -3200; speed <= 3200; speed += 347){
+    ASSERT_EQ(1, send(&device, 1, speed));
+    EXPECT_LE(abs(target(1) - speed), 30) << "speed " << speed;
+  }
+  EXPECT_GT(frameCount(SETPOINT_FORMAT::MINI_SSC), 0u);
+
+  SetpointEncoderStats stats;
+  encoder.getStats(stats);
+  EXPECT_LT(stats.bytes, stats.fullBytes);
+}
+
+TEST_F(SetpointEncoderTest, WholeBusGetsOneCompactFrame){
+  uint8_t bus[2] = {1, 2};
+  ASSERT_TRUE(encoder.setBus(bus, 2));
+
+  uint8_t devices[2] = {2, 1};
+  ASSERT_EQ(1, send(devices, 2, 2000));
+  EXPECT_EQ(SMC_BROADCAST, slots[0]);
+  EXPECT_EQ((int)Command<POLOLU_COM::MOTOR_FORWARD>::compactLen, lens[0]);
+  EXPECT_EQ(2000, target(1));
+  EXPECT_EQ(2000, target(2));
+
+  // part of the bus gets its own frames
+  ASSERT_EQ(1, send(devices, 1, 500));
+  EXPECT_EQ(2, slots[0]);
+  EXPECT_EQ(500, target(2));
+  EXPECT_EQ(2000, target(1));
+}
+
+TEST_F(SetpointEncoderTest, LeavesOutRepeatsUntilTheRefresh){
+  encoder.setRefresh(30);
+  uint8_t device = 1;
+  ASSERT_EQ(1, send(&device, 1, 700));
+  EXPECT_EQ(0, send(&device, 1, 700));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(40));
+  EXPECT_EQ(1, send(&device, 1, 700));
+
+  // something else moved the motor
+  ASSERT_TRUE(smc->motorForward(1, 100));
+  encoder.forget(1);
+  EXPECT_EQ(1, send(&device, 1, 700));
+  EXPECT_EQ(700, target(1));
+
+  SetpointEncoderStats stats;
+  encoder.getStats(stats);
+  EXPECT_EQ(1u, stats.suppressed);
+  EXPECT_EQ(3u, stats.frames);
+}
+
+TEST_F(SetpointEncoderTest, RejectsArgumentsOutOfRange){
+  uint8_t device = 1, bad = 128;
+  EXPECT_EQ(-1, encoder.encode(&device, 1, 3201, frames, lens, slots));
+  EXPECT_EQ(-1, encoder.encode(&bad, 1, 0, frames, lens, slots));
+  EXPECT_EQ(-1, encoder.encode(&device, 0, 0, frames, lens, slots));
+  EXPECT_FALSE(encoder.setBus(&bad, 1));
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
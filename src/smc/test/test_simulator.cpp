@@ -0,0 +1,89 @@
+/**
+ * The simulated controllers themselves, driven through a SerialPort
+ */
+
+#include <gtest/gtest.h>
+
+#include "smc/smc.h"
+#include "smc/Simulator.h"
+
+class SimulatorTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+
+  void SetUp(){
+    sim.addDevice(1, 0x98, 0x01, 0x04);
+    sim.addDevice(2, 0x9B, 0x01, 0x07);
+    sim.setBaud(115200);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), 115200, 100));
+  }
+
+  void TearDown(){
+    sim.stop();
+  }
+};
+
+TEST_F(SimulatorTest, AnswersAsItsDevicesAreSetUp){
+  SMC smc(&port);
+  uint16_t productID = 0;
+  uint8_t major = 0, minor = 0;
+  ASSERT_TRUE(smc.getFirmwareVersion(2, productID, major, minor));
+  EXPECT_EQ(0x9B, productID);
+  EXPECT_EQ(0x01, major);
+  EXPECT_EQ(0x07, minor);
+
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 12000);
+  uint16_t val = 0;
+  ASSERT_TRUE(smc.getMotorVariable(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, val));
+  EXPECT_EQ(12000, val);
+
+  // nobody answers for an ID without a device
+  EXPECT_FALSE(smc.getFirmwareVersion(3, productID, major, minor));
+}
+
+TEST_F(SimulatorTest, FlagsAnInvalidLimitIdAndKeepsAnswering){
+  // SET_LIMIT with limit ID 0x0C, past BRAKE_DURATION_REVERSE
+  char frame[] = {(char)0xAA, 0x01, 0x22, 0x0C, 0x00, 0x00};
+  ASSERT_EQ((int)sizeof(frame), port.sendArray(frame, sizeof(frame)));
+
+  SMC smc(&port);
+  uint16_t productID = 0;
+  uint8_t major = 0, minor = 0;
+  ASSERT_TRUE(smc.getFirmwareVersion(1, productID, major, minor));
+  EXPECT_EQ(0x98, productID);
+
+  EXPECT_EQ(1u, sim.getStats().serialErrors);
+  EXPECT_TRUE(sim.getVariable(1, SMC_VAR::SERIAL_ERRORS) & (uint16_t)SERIAL_ERROR::FORMAT);
+}
+
+TEST_F(SimulatorTest, GivesQueuedAnswersInOrderAheadOfTheVariable){
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 12000);
+  sim.queueAnswer(1, SMC_VAR::INPUT_VOLTAGE, 11000);
+  sim.queueAnswer(1, SMC_VAR::INPUT_VOLTAGE, 11500);
+  sim.queueAnswer(2, SMC_VAR::INPUT_VOLTAGE, 9000);
+
+  // all four go out in one write, before the first answer
+  SMC smc(&port);
+  uint8_t ids[4] = {(uint8_t)SMC_VAR::INPUT_VOLTAGE, (uint8_t)SMC_VAR::INPUT_VOLTAGE,
+                    (uint8_t)SMC_VAR::INPUT_VOLTAGE, (uint8_t)SMC_VAR::TEMPERATURE};
+  uint16_t vals[4] = {0, 0, 0, 0};
+  ASSERT_TRUE(smc.getMotorVariables(1, ids, 4, vals));
+  EXPECT_EQ(11000, vals[0]);
+  EXPECT_EQ(11500, vals[1]);
+  EXPECT_EQ(12000, vals[2]);
+  EXPECT_EQ(300, vals[3]);
+  EXPECT_EQ(12000, sim.getVariable(1, SMC_VAR::INPUT_VOLTAGE));
+
+  uint16_t val = 0;
+  ASSERT_TRUE(smc.getMotorVariable(2, (uint8_t)SMC_VAR::INPUT_VOLTAGE, val));
+  EXPECT_EQ(9000, val);
+  ASSERT_TRUE(smc.getMotorVariable(2, (uint8_t)SMC_VAR::INPUT_VOLTAGE, val));
+  EXPECT_EQ(12000, val);
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,49 @@
+/**
+ * Histogram bucket bounds, which are exported as inclusive Prometheus
+ * le bounds
+ */
+
+#include <gtest/gtest.h>
+
+#include "smc/Stats.h"
+
+/**
+ * @return the bucket a single sample lands in, -1 if none
+ */
+static int bucketOf(uint64_t us){
+  Histogram histogram;
+  histogram.record(us);
+  HistogramSnapshot snapshot;
+  histogram.snapshot(snapshot);
+  for(int i = 0; i < SMC_HISTOGRAM_BUCKETS; i++)
+    if(snapshot.buckets[i])
+      return i;
+  return -1;
+}
+
+TEST(HistogramTest, BucketHoldsSamplesUpToItsBound){
+  EXPECT_EQ(0, bucketOf(0));
+  EXPECT_EQ(0, bucketOf(1));
+  EXPECT_EQ(1, bucketOf(2));
+  EXPECT_EQ(2, bucketOf(3));
+  EXPECT_EQ(2, bucketOf(4));
+  EXPECT_EQ(3, bucketOf(5));
+  EXPECT_EQ(10, bucketOf(1024));
+  EXPECT_EQ(11, bucketOf(1025));
+
+  for(int i = 0; i < SMC_HISTOGRAM_BUCKETS - 1; i++){
+    EXPECT_EQ(i, bucketOf(Histogram::bound(i))) << "bound of bucket " << i;
+    EXPECT_EQ(i + 1, bucketOf(Histogram::bound(i) + 1)) << "past bucket " << i;
+  }
+}
+
+TEST(HistogramTest, LastBucketTakesEverythingSlower){
+  EXPECT_EQ(SMC_HISTOGRAM_BUCKETS - 1, bucketOf(Histogram::bound(SMC_HISTOGRAM_BUCKETS - 2) + 1));
+  EXPECT_EQ(SMC_HISTOGRAM_BUCKETS - 1, bucketOf(UINT64_MAX / 2));
+  EXPECT_EQ(0u, Histogram::bound(SMC_HISTOGRAM_BUCKETS - 1));
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
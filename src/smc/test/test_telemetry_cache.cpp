@@ -0,0 +1,159 @@
+/**
+ * TelemetryCache reads against a simulated controller
+ */
+
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/TelemetryCache.h"
+#include "smc/Simulator.h"
+
+/**
+ * Time the simulated device takes before each answer, long enough for
+ * other callers to find a request on the wire
+ */
+#define TEST_DELAY_US 40000
+
+/**
+ * Polls until check passes or a second is up
+ * @return the last result of check
+ */
+static bool waitFor(std::function<bool()> check){
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  while(!check()){
+    if(std::chrono::steady_clock::now() > end)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+class TelemetryCacheTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+  SMC *smc;
+  TelemetryCache *cache;
+
+  TelemetryCacheTest() : smc(NULL), cache(NULL) {}
+
+  void SetUp(){
+    sim.addDevice(1);
+    sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 12000);
+    sim.setBaud(115200);
+    sim.setResponseDelay(TEST_DELAY_US);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), 115200, 200));
+    smc = new SMC(&port);
+    ASSERT_TRUE(smc->startIoThread());
+    cache = new TelemetryCache(smc);
+  }
+
+  void TearDown(){
+    delete cache;
+    delete smc;
+    sim.stop();
+  }
+
+  TelemetryCacheStats stats(){
+    TelemetryCacheStats s;
+    cache->getStats(s);
+    return s;
+  }
+};
+
+TEST_F(TelemetryCacheTest, ServesYoungValuesFromMemory){
+  uint16_t value = 0;
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value));
+  EXPECT_EQ(12000, value);
+
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 13000);
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value));
+  EXPECT_EQ(12000, value);
+  EXPECT_EQ(1u, stats().misses);
+  EXPECT_EQ(1u, stats().hits);
+
+  // no max age always goes to the device
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 0, value));
+  EXPECT_EQ(13000, value);
+  EXPECT_EQ(2u, stats().misses);
+}
+
+TEST_F(TelemetryCacheTest, CallersShareTheRequestOnTheWire){
+  std::vector<std::thread> readers;
+  uint16_t values[4] = {0, 0, 0, 0};
+  int status[4] = {0, 0, 0, 0};
+  for(int i = 0; i < 4; i++)
+    readers.push_back(std::thread([&, i]{
+      status[i] = cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, values[i]);
+    }));
+  for(size_t i = 0; i < readers.size(); i++)
+    readers[i].join();
+
+  for(int i = 0; i < 4; i++){
+    EXPECT_TRUE(status[i]);
+    EXPECT_EQ(12000, values[i]);
+  }
+  TelemetryCacheStats s = stats();
+  EXPECT_EQ(4u, s.hits + s.misses + s.merged);
+  EXPECT_LT(s.misses, 4u);
+}
+
+TEST_F(TelemetryCacheTest, StaleReadRefreshesInTheBackground){
+  uint16_t value = 0;
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value));
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 13000);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 10, value, CACHE_READ::STALE));
+  EXPECT_EQ(12000, value);
+  EXPECT_EQ(1u, stats().stale);
+  EXPECT_EQ(1u, stats().refreshes);
+
+  ASSERT_TRUE(waitFor([&]{
+    return cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value) && value == 13000; }));
+}
+
+TEST_F(TelemetryCacheTest, InvalidateDropsAReadStillOnTheWire){
+  uint16_t value = 0;
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  // the refresh reads 12000 before the invalidate and answers after it
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 10, value, CACHE_READ::STALE));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  cache->invalidate(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE);
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 13000);
+
+  // once the refresh is in, the next read still goes to the device
+  std::this_thread::sleep_for(std::chrono::milliseconds(3 * TEST_DELAY_US / 1000));
+  uint64_t misses = stats().misses;
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value));
+  EXPECT_EQ(13000, value);
+  EXPECT_EQ(misses + 1, stats().misses);
+}
+
+TEST_F(TelemetryCacheTest, InvalidateDropsAPolledValueReadBeforeIt){
+  std::chrono::steady_clock::time_point readAt = std::chrono::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  cache->invalidate(1);
+  cache->update(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 11000, readAt);
+
+  uint16_t value = 0;
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, 60000, value));
+  EXPECT_EQ(12000, value);
+
+  // a value read after the invalidate is kept
+  cache->update(1, (uint8_t)SMC_VAR::TEMPERATURE, 300, std::chrono::steady_clock::now());
+  ASSERT_TRUE(cache->get(1, (uint8_t)SMC_VAR::TEMPERATURE, 60000, value));
+  EXPECT_EQ(300, value);
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,158 @@
+/**
+ * TimerWheel expiry, cancelling and periodic timers, driven with
+ * explicit points in time
+ */
+
+#include <chrono>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/TimerWheel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Appends the timer's arg to the vector in ctx
+ */
+static void record(void *ctx, uint32_t arg){
+  ((std::vector<uint32_t> *)ctx)->push_back(arg);
+}
+
+class TimerWheelTest : public ::testing::Test {
+protected:
+  Clock::time_point start;
+  TimerWheel *wheel;
+  std::vector<uint32_t> fired;
+
+  TimerWheelTest() : wheel(NULL) {}
+
+  void SetUp(){
+    // the wheel counts its ticks from construction, at or after start
+    start = Clock::now();
+    wheel = new TimerWheel(8);
+  }
+
+  void TearDown(){
+    delete wheel;
+  }
+
+  Clock::time_point at(double ms){
+    return start + std::chrono::microseconds((long)(ms * 1000));
+  }
+};
+
+TEST_F(TimerWheelTest, FiresOnceNeverEarly){
+  ASSERT_NE(0u, wheel->schedule(at(5), record, &fired, 7));
+  EXPECT_EQ(1, wheel->pending());
+
+  EXPECT_EQ(0, wheel->advance(at(4)));
+  EXPECT_TRUE(fired.empty());
+  // at most a tick late, counted from a later origin
+  EXPECT_EQ(1, wheel->advance(at(7)));
+  ASSERT_EQ(1u, fired.size());
+  EXPECT_EQ(7u, fired[0]);
+  EXPECT_EQ(0, wheel->advance(at(20)));
+  EXPECT_EQ(0, wheel->pending());
+}
+
+TEST_F(TimerWheelTest, FiresInExpiryOrderAcrossSlots){
+  wheel->schedule(at(30), record, &fired, 3);
+  wheel->schedule(at(10), record, &fired, 1);
+  wheel->schedule(at(20), record, &fired, 2);
+
+  for(int ms = 0; ms <= 35; ms++)
+    wheel->advance(at(ms));
+  ASSERT_EQ(3u, fired.size());
+  EXPECT_EQ(1u, fired[0]);
+  EXPECT_EQ(2u, fired[1]);
+  EXPECT_EQ(3u, fired[2]);
+}
+
+TEST_F(TimerWheelTest, WaitsOutTimersMoreThanATurnAway){
+  // past SMC_WHEEL_SLOTS ticks, the timer shares its slot with tick 44
+  double ms = SMC_WHEEL_SLOTS * SMC_WHEEL_TICK_US / 1000.0 + 44;
+  wheel->schedule(at(ms), record, &fired, 1);
+
+  EXPECT_EQ(0, wheel->advance(at(50)));
+  EXPECT_EQ(0, wheel->advance(at(ms - 1)));
+  EXPECT_EQ(1, wheel->advance(at(ms + 2)));
+}
+
+TEST_F(TimerWheelTest, CancelledTimersDontFire){
+  uint32_t id = wheel->schedule(at(5), record, &fired, 1);
+  wheel->schedule(at(5), record, &fired, 2);
+  EXPECT_EQ(1, wheel->cancel(id));
+  EXPECT_EQ(0, wheel->cancel(id));
+
+  EXPECT_EQ(1, wheel->advance(at(10)));
+  ASSERT_EQ(1u, fired.size());
+  EXPECT_EQ(2u, fired[0]);
+
+  // a fired one shot is no longer pending, its id is stale
+  uint32_t shot = wheel->schedule(at(12), record, &fired, 3);
+  wheel->advance(at(15));
+  EXPECT_EQ(0, wheel->cancel(shot));
+}
+
+struct CancelOther {
+  TimerWheel *wheel;
+  uint32_t other;
+  int calls;
+};
+
+static void cancelOther(void *ctx, uint32_t){
+  CancelOther *c = (CancelOther *)ctx;
+  c->calls++;
+  c->wheel->cancel(c->other);
+}
+
+TEST_F(TimerWheelTest, CallbackCancelsATimerDueInTheSameTick){
+  CancelOther first = {wheel, 0, 0};
+  CancelOther second = {wheel, 0, 0};
+  uint32_t a = wheel->schedule(at(5), cancelOther, &first, 0);
+  uint32_t b = wheel->schedule(at(5), cancelOther, &second, 0);
+  first.other = b;
+  second.other = a;
+
+  EXPECT_EQ(1, wheel->advance(at(10)));
+  EXPECT_EQ(1, first.calls + second.calls);
+  EXPECT_EQ(0, wheel->pending());
+}
+
+TEST_F(TimerWheelTest, PeriodicTimerKeepsItsSchedule){
+  uint32_t id = wheel->every(10000, record, &fired, 4);
+  ASSERT_NE(0u, id);
+
+  wheel->advance(at(9));
+  EXPECT_TRUE(fired.empty());
+  // a late advance doesn't shift the expiries after it
+  wheel->advance(at(26));
+  for(int ms = 27; ms <= 35; ms++)
+    wheel->advance(at(ms));
+  EXPECT_EQ(3u, fired.size());
+
+  EXPECT_EQ(1, wheel->cancel(id));
+  wheel->advance(at(100));
+  EXPECT_EQ(3u, fired.size());
+}
+
+TEST_F(TimerWheelTest, RefusesTimersPastItsCapacity){
+  for(uint32_t i = 0; i < 8; i++)
+    ASSERT_NE(0u, wheel->schedule(at(50), record, &fired, i));
+  EXPECT_EQ(0u, wheel->schedule(at(50), record, &fired, 8));
+  EXPECT_EQ(8, wheel->pending());
+}
+
+TEST_F(TimerWheelTest, WaitsUntilTheNextOccupiedSlot){
+  EXPECT_EQ(-1, wheel->waitMs(at(0)));
+  wheel->schedule(at(20), record, &fired, 1);
+  int ms = wheel->waitMs(at(0));
+  EXPECT_GT(ms, 0);
+  EXPECT_LE(ms, 22);
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,152 @@
+/**
+ * Trajectory profiles, planned offline and streamed to simulated
+ * controllers
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "smc/Trajectory.h"
+#include "smc/Simulator.h"
+
+class TrajectoryTest : public ::testing::Test {
+protected:
+  Simulator sim;
+  SerialPort port;
+  SMC *smc;
+
+  TrajectoryTest() : smc(NULL) {}
+
+  void SetUp(){
+    sim.addDevice(1);
+    sim.addDevice(2);
+    sim.setBaud(115200);
+    ASSERT_TRUE(sim.start());
+    ASSERT_TRUE(port.connect(sim.getPath(), 115200, 100));
+    smc = new SMC(&port);
+  }
+
+  void TearDown(){
+    delete smc;
+    sim.stop();
+  }
+
+  TrajectoryState state(Trajectory &trajectory, uint8_t device){
+    TrajectoryState s = TrajectoryState();
+    EXPECT_TRUE(trajectory.getState(device, s));
+    return s;
+  }
+};
+
+TEST_F(TrajectoryTest, RampsWithinTheAccelerationLimit){
+  uint8_t devices[1] = {1};
+  Trajectory trajectory(smc, 115200, devices, 1);
+  ASSERT_TRUE(trajectory.setLimits(1, 3200, 0));
+  ASSERT_TRUE(trajectory.setTarget(1, 3200));
+
+  int steps = 0;
+  int16_t last = 0;
+  while(!trajectory.advance(0.01)){
+    TrajectoryState s = state(trajectory, 1);
+    EXPECT_GE(s.speed, last);
+    EXPECT_LE(s.speed - last, 33);
+    last = s.speed;
+    ASSERT_LT(++steps, 200);
+  }
+  // 3200 at 3200 per second is a second of 10 ms steps
+  EXPECT_NEAR(100, steps, 2);
+  EXPECT_EQ(3200, state(trajectory, 1).speed);
+}
+
+TEST_F(TrajectoryTest, JerkLimitBendsTheRampIntoAnSCurve){
+  uint8_t devices[1] = {1};
+  Trajectory trajectory(smc, 115200, devices, 1);
+  ASSERT_TRUE(trajectory.setLimits(1, 3200, 16000));
+  ASSERT_TRUE(trajectory.setTarget(1, 2000));
+
+  double accel = 0;
+  int16_t last = 0;
+  int steps = 0;
+  while(!trajectory.advance(0.01)){
+    TrajectoryState s = state(trajectory, 1);
+    EXPECT_LE(fabs(s.accel - accel), 16000 * 0.01 + 1e-6);
+    EXPECT_LE(fabs(s.accel), 3200 + 1e-6);
+    EXPECT_GE(s.speed, last);
+    EXPECT_LE(s.speed, 2000);
+    accel = s.accel;
+    last = s.speed;
+    ASSERT_LT(++steps, 500);
+  }
+  EXPECT_EQ(2000, state(trajectory, 1).speed);
+  // slower than the plain ramp's 63 steps, it eases in and out
+  EXPECT_GT(steps, 63);
+}
+
+TEST_F(TrajectoryTest, ReversesThroughZero){
+  uint8_t devices[1] = {1};
+  Trajectory trajectory(smc, 115200, devices, 1);
+  ASSERT_TRUE(trajectory.setLimits(1, 6400, 0));
+  ASSERT_TRUE(trajectory.setTarget(1, 1000));
+  while(!trajectory.advance(0.01)){}
+
+  ASSERT_TRUE(trajectory.setTarget(1, -1000));
+  int16_t last = 1000;
+  bool crossed = false;
+  while(!trajectory.advance(0.01)){
+    int16_t speed = state(trajectory, 1).speed;
+    EXPECT_LE(speed, last);
+    crossed |= speed == 0 || (last > 0 && speed < 0);
+    last = speed;
+  }
+  EXPECT_TRUE(crossed);
+  EXPECT_EQ(-1000, state(trajectory, 1).speed);
+}
+
+TEST_F(TrajectoryTest, StreamsTheProfileToTheMotors){
+  ASSERT_TRUE(smc->startIoThread());
+  uint8_t devices[2] = {1, 2};
+  Trajectory trajectory(smc, 115200, devices, 2);
+  ASSERT_TRUE(trajectory.setLimits(1, 6400, 0));
+  ASSERT_TRUE(trajectory.setLimits(2, 6400, 0));
+  ASSERT_TRUE(trajectory.start());
+  ASSERT_TRUE(trajectory.setTarget(1, 1600));
+  ASSERT_TRUE(trajectory.setTarget(2, -800));
+
+  // the motors follow the ramp, they don't jump to the target
+  int16_t last = 0;
+  bool between = false;
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while(std::chrono::steady_clock::now() < end){
+    int16_t speed = (int16_t)sim.getVariable(1, SMC_VAR::TARGET_PWM);
+    EXPECT_GE(speed, last);
+    between |= speed > 0 && speed < 1600;
+    last = speed;
+    if(speed == 1600 && (int16_t)sim.getVariable(2, SMC_VAR::TARGET_PWM) == -800)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  trajectory.stop();
+  EXPECT_TRUE(between);
+  EXPECT_EQ(1600, (int16_t)sim.getVariable(1, SMC_VAR::TARGET_PWM));
+  EXPECT_EQ(-800, (int16_t)sim.getVariable(2, SMC_VAR::TARGET_PWM));
+}
+
+TEST_F(TrajectoryTest, RejectsUnknownMotorsAndBadLimits){
+  uint8_t devices[1] = {1};
+  Trajectory trajectory(smc, 115200, devices, 1);
+  EXPECT_FALSE(trajectory.setTarget(2, 100));
+  EXPECT_FALSE(trajectory.setTarget(1, 3201));
+  EXPECT_FALSE(trajectory.setLimits(1, 0, 0));
+  EXPECT_FALSE(trajectory.setLimits(2, 3200, 0));
+  TrajectoryState s;
+  EXPECT_FALSE(trajectory.getState(2, s));
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
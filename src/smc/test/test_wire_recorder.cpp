@@ -0,0 +1,149 @@
+/**
+ * WireRecorder recordings written through a port to simulated
+ * controllers and read back with WireRecorder::load
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "smc/smc.h"
+#include "smc/Simulator.h"
+#include "smc/WireRecorder.h"
+
+class WireRecorderTest : public ::testing::Test {
+protected:
+  std::string path;
+
+  void SetUp(){
+    path = ::testing::TempDir() + "smc_test_recorder_" + std::to_string(getpid()) + ".wire";
+  }
+
+  void TearDown(){
+    unlink(path.c_str());
+  }
+};
+
+TEST_F(WireRecorderTest, LoadsWhatAPortSentAndReceived){
+  Simulator sim;
+  sim.addDevice(1);
+  sim.setVariable(1, SMC_VAR::INPUT_VOLTAGE, 12345);
+  sim.setBaud(115200);
+  ASSERT_TRUE(sim.start());
+
+  SerialPort port;
+  ASSERT_TRUE(port.connect(sim.getPath(), 115200, 100));
+  WireRecorder recorder;
+  ASSERT_TRUE(recorder.open(path, 256, 115200));
+  port.setRecorder(&recorder);
+
+  SMC smc(&port);
+  ASSERT_TRUE(smc.motorForward(1, 1000));
+  uint16_t val = 0;
+  ASSERT_TRUE(smc.getMotorVariable(1, (uint8_t)SMC_VAR::INPUT_VOLTAGE, val));
+  EXPECT_EQ(12345, val);
+  port.setRecorder(NULL);
+  EXPECT_EQ(3u, recorder.count());
+
+  std::vector<WireFrame> frames;
+  int baud = 0;
+  ASSERT_TRUE(WireRecorder::load(path, frames, baud));
+  EXPECT_EQ(115200, baud);
+  ASSERT_EQ(3u, frames.size());
+
+  char frame[SMC_MAX_FRAME];
+  int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, 1000);
+  EXPECT_EQ(WIRE_DIR::TX, frames[0].dir);
+  EXPECT_EQ(1, frames[0].device);
+  EXPECT_EQ((uint8_t)POLOLU_COM::MOTOR_FORWARD, frames[0].command);
+  ASSERT_EQ(len, frames[0].len);
+  EXPECT_EQ(0, memcmp(frame, frames[0].data, len));
+
+  len = encodePololu<POLOLU_COM::GET_SMC_VAR>(frame, 1, (uint8_t)SMC_VAR::INPUT_VOLTAGE);
+  EXPECT_EQ(WIRE_DIR::TX, frames[1].dir);
+  EXPECT_EQ((uint8_t)POLOLU_COM::GET_SMC_VAR, frames[1].command);
+  ASSERT_EQ(len, frames[1].len);
+  EXPECT_EQ(0, memcmp(frame, frames[1].data, len));
+
+  // the answer is tagged with the request it answers
+  EXPECT_EQ(WIRE_DIR::RX, frames[2].dir);
+  EXPECT_EQ(1, frames[2].device);
+  EXPECT_EQ((uint8_t)POLOLU_COM::GET_SMC_VAR, frames[2].command);
+  ASSERT_EQ(2, frames[2].len);
+  EXPECT_EQ(12345, (uint8_t)frames[2].data[0] | ((uint8_t)frames[2].data[1] << 8));
+
+  for(size_t i = 0; i < frames.size(); i++){
+    EXPECT_EQ(i, frames[i].seq);
+    if(i){
+      EXPECT_LE(frames[i - 1].timeNs, frames[i].timeNs);
+    }
+  }
+  sim.stop();
+}
+
+TEST_F(WireRecorderTest, KeepsTheNewestRecordsOnceTheRingIsFull){
+  WireRecorder recorder;
+  ASSERT_TRUE(recorder.open(path, 4));
+
+  char frame[SMC_MAX_FRAME];
+  for(int speed = 0; speed < 10; speed++){
+    int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, speed);
+    recorder.sent(frame, len);
+  }
+  EXPECT_EQ(10u, recorder.count());
+
+  std::vector<WireFrame> frames;
+  int baud = -1;
+  ASSERT_TRUE(WireRecorder::load(path, frames, baud));
+  EXPECT_EQ(0, baud);
+  ASSERT_EQ(4u, frames.size());
+  for(size_t i = 0; i < frames.size(); i++){
+    int len = encodePololu<POLOLU_COM::MOTOR_FORWARD>(frame, 1, 6 + i);
+    EXPECT_EQ(6 + i, frames[i].seq);
+    ASSERT_EQ(len, frames[i].len);
+    EXPECT_EQ(0, memcmp(frame, frames[i].data, len));
+  }
+}
+
+TEST_F(WireRecorderTest, SplitsRawBytesItCannotDecode){
+  WireRecorder recorder;
+  ASSERT_TRUE(recorder.open(path, 16));
+
+  char junk[20];
+  memset(junk, 0x55, sizeof(junk));
+  recorder.sent(junk, sizeof(junk));
+  recorder.close();
+
+  std::vector<WireFrame> frames;
+  int baud = 0;
+  ASSERT_TRUE(WireRecorder::load(path, frames, baud));
+  int total = 0;
+  for(size_t i = 0; i < frames.size(); i++){
+    EXPECT_EQ(SMC_WIRE_UNKNOWN, frames[i].command);
+    EXPECT_LE(frames[i].len, SMC_WIRE_DATA);
+    EXPECT_EQ(0, memcmp(junk, frames[i].data, frames[i].len));
+    total += frames[i].len;
+  }
+  EXPECT_EQ((int)sizeof(junk), total);
+}
+
+TEST_F(WireRecorderTest, RejectsAFileThatIsNotARecording){
+  FILE *file = fopen(path.c_str(), "w");
+  ASSERT_TRUE(file != NULL);
+  fputs("not a recording", file);
+  fclose(file);
+
+  std::vector<WireFrame> frames;
+  int baud = 0;
+  EXPECT_FALSE(WireRecorder::load(path, frames, baud));
+  EXPECT_FALSE(WireRecorder::load(path + ".missing", frames, baud));
+}
+
+int main(int argc, char **argv){
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
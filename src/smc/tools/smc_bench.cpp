@@ -0,0 +1,357 @@
+/**
+ * Benchmarks the driver against the simulator and prints the results
+ * as one JSON document on stdout, for tracking regressions.
+ *
+ * encode      ns per frame of every command encoder
+ * rtt         p50/p99/p999 round trip of getMotorVariable, setMotorLimit
+ *             and getFirmwareVersion over a pseudo-terminal
+ * throughput  sustained commands per second at each standard baud rate,
+ *             one at a time and pipelined through the I/O thread
+ *
+ * smc_bench [--only encode|rtt|throughput] [--samples N] [--duration S]
+ *           [--rtt-baud N] [--delay US] [--io-thread]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "smc/smc.h"
+#include "smc/frames.h"
+#include "smc/Simulator.h"
+
+#define BENCH_DEVICE 13
+
+typedef std::chrono::steady_clock Clock;
+
+static volatile char sink;
+
+static double elapsedUs(Clock::time_point start){
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+/**
+ * Times an encoder over many frames with varying data
+ * @return ns per frame
+ */
+template <typename Encode>
+static double timeEncoder(Encode encode){
+
+  const long iterations = 10000000;
+  char frame[SMC_MAX_FRAME];
+  char acc = 0;
+
+  Clock::time_point start = Clock::now();
+  for(long i = 0; i < iterations; i++){
+    int len = encode(frame, (uint16_t)(i & 0xFFF));
+    // every frame must reach memory, as it would before a write
+    __asm__ __volatile__("" : : "r"(frame) : "memory");
+    acc ^= frame[len - 1];
+  }
+  double us = elapsedUs(start);
+  sink = acc;
+  return us * 1000.0 / iterations;
+}
+
+#define BENCH_COMPACT(NAME, ...)                                                 \
+  printEncode(first, #NAME, "compact", timeEncoder([](char *f, uint16_t v){      \
+    (void)v; return encodeCompact<POLOLU_COM::NAME>(f, ##__VA_ARGS__); }))
+
+#define BENCH_POLOLU(NAME, ...)                                                  \
+  printEncode(first, #NAME, "pololu", timeEncoder([](char *f, uint16_t v){       \
+    (void)v; return encodePololu<POLOLU_COM::NAME>(f, BENCH_DEVICE, ##__VA_ARGS__); }))
+
+static void printEncode(bool &first, const char *command, const char *format, double ns){
+  printf("%s\n    {\"command\": \"%s\", \"format\": \"%s\", \"ns_per_frame\": %.3f}",
+         first ? "" : ",", command, format, ns);
+  first = false;
+}
+
+static void benchEncode(){
+
+  bool first = true;
+  printf("  \"encode\": [");
+
+  BENCH_COMPACT(EXIT_SS);
+  BENCH_COMPACT(MOTOR_FORWARD, v);
+  BENCH_COMPACT(MOTOR_REVERSE, v);
+  BENCH_COMPACT(MOTOR_FORWARD_7BIT, (uint8_t)v);
+  BENCH_COMPACT(MOTOR_REVERSE_7BIT, (uint8_t)v);
+  BENCH_COMPACT(MOTOR_BRAKE, (uint8_t)v);
+  BENCH_COMPACT(MOTOR_STOP);
+  BENCH_COMPACT(SET_LIMIT, (uint8_t)(v & 0x0B), v);
+  BENCH_COMPACT(GET_SMC_VAR, (uint8_t)v);
+  BENCH_COMPACT(GET_FIRMWARE);
+
+  BENCH_POLOLU(EXIT_SS);
+  BENCH_POLOLU(MOTOR_FORWARD, v);
+  BENCH_POLOLU(MOTOR_REVERSE, v);
+  BENCH_POLOLU(MOTOR_FORWARD_7BIT, (uint8_t)v);
+  BENCH_POLOLU(MOTOR_REVERSE_7BIT, (uint8_t)v);
+  BENCH_POLOLU(MOTOR_BRAKE, (uint8_t)v);
+  BENCH_POLOLU(MOTOR_STOP);
+  BENCH_POLOLU(SET_LIMIT, (uint8_t)(v & 0x0B), v);
+  BENCH_POLOLU(GET_SMC_VAR, (uint8_t)v);
+  BENCH_POLOLU(GET_FIRMWARE);
+
+  printEncode(first, "SSC_PWM", "mini_ssc", timeEncoder([](char *f, uint16_t v){
+    return encodeSsc(f, BENCH_DEVICE, (int16_t)(v - 2048)); }));
+
+  printf("\n  ]");
+}
+
+#undef BENCH_COMPACT
+#undef BENCH_POLOLU
+
+/**
+ * A simulator with one device and a port connected to it
+ */
+struct Bench {
+  Simulator sim;
+  SerialPort port;
+  SMC smc;
+
+  /**
+   * @return 1 if connected
+   */
+  int open(int baud, long delayUs, bool ioThread){
+    sim.addDevice(BENCH_DEVICE);
+    sim.setBaud(baud);
+    sim.setResponseDelay(delayUs);
+    if(!sim.start())
+      return 0;
+    // the pty accepts any rate, it only sets the driver's pacing
+    if(!port.connect(sim.getPath(), baud > 0 ? baud : 115200, 1000))
+      return 0;
+    smc.setPort(&port);
+    if(ioThread && !smc.startIoThread())
+      return 0;
+    return 1;
+  }
+
+  ~Bench(){
+    smc.stopIoThread();
+    port.disconnect();
+    sim.stop();
+  }
+};
+
+static void printRtt(bool &first, const char *command, std::vector<double> &us, int failed){
+
+  std::sort(us.begin(), us.end());
+  size_t n = us.size();
+  double p50 = n ? us[n * 50 / 100] : 0;
+  double p99 = n ? us[n * 99 / 100] : 0;
+  double p999 = n ? us[n * 999 / 1000] : 0;
+
+  printf("%s\n    {\"command\": \"%s\", \"samples\": %zu, \"failed\": %d, "
+         "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+         first ? "" : ",", command, n, failed, p50, p99, p999);
+  first = false;
+}
+
+static int benchRtt(int samples, int baud, long delayUs, bool ioThread){
+
+  Bench bench;
+  if(!bench.open(baud, delayUs, ioThread)){
+    fprintf(stderr, "smc_bench: cannot open simulator\n");
+    return 0;
+  }
+  SMC &smc = bench.smc;
+
+  bool first = true;
+  printf("  \"rtt\": {\"baud\": %d, \"delay_us\": %ld, \"io_thread\": %s, \"commands\": [",
+         baud, delayUs, ioThread ? "true" : "false");
+
+  std::vector<double> us;
+  int failed;
+  us.reserve(samples);
+
+  failed = 0;
+  for(int i = 0; i < samples; i++){
+    uint16_t val;
+    Clock::time_point start = Clock::now();
+    if(smc.getMotorVariable(BENCH_DEVICE, (uint8_t)SMC_VAR::INPUT_VOLTAGE, val))
+      us.push_back(elapsedUs(start));
+    else
+      failed++;
+  }
+  printRtt(first, "GET_SMC_VAR", us, failed);
+
+  us.clear();
+  failed = 0;
+  for(int i = 0; i < samples; i++){
+    uint8_t code;
+    Clock::time_point start = Clock::now();
+    if(smc.setMotorLimit(BENCH_DEVICE, (uint8_t)SOFT_LIMIT::MAX_ACCELERATION_BOTH, i & 0x7F, code))
+      us.push_back(elapsedUs(start));
+    else
+      failed++;
+  }
+  printRtt(first, "SET_LIMIT", us, failed);
+
+  us.clear();
+  failed = 0;
+  for(int i = 0; i < samples; i++){
+    uint16_t productID;
+    uint8_t major, minor;
+    Clock::time_point start = Clock::now();
+    if(smc.getFirmwareVersion(BENCH_DEVICE, productID, major, minor))
+      us.push_back(elapsedUs(start));
+    else
+      failed++;
+  }
+  printRtt(first, "GET_FIRMWARE", us, failed);
+
+  printf("\n  ]}");
+  return 1;
+}
+
+/**
+ * Reads a variable over and over for a while
+ * @param window requests kept in flight, 0 for one blocking call at a time
+ * @return completed reads per second
+ */
+static double sustained(SMC &smc, double seconds, int window){
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + std::chrono::microseconds((long)(seconds * 1e6));
+  long done = 0;
+
+  if(!window){
+    while(Clock::now() < end){
+      uint16_t val;
+      done += smc.getMotorVariable(BENCH_DEVICE, (uint8_t)SMC_VAR::TARGET_PWM, val);
+    }
+  }
+  else{
+    std::vector<std::future<SMCValue> > pending;
+    size_t next = 0;
+    for(int i = 0; i < window; i++)
+      pending.push_back(smc.asyncGetMotorVariable(BENCH_DEVICE, (uint8_t)SMC_VAR::TARGET_PWM));
+    // replace the oldest request as it completes
+    while(Clock::now() < end){
+      done += pending[next].get().status;
+      pending[next] = smc.asyncGetMotorVariable(BENCH_DEVICE, (uint8_t)SMC_VAR::TARGET_PWM);
+      next = (next + 1) % pending.size();
+    }
+    for(size_t i = 0; i < pending.size(); i++)
+      done += pending[i].get().status;
+  }
+
+  return done / (elapsedUs(start) / 1e6);
+}
+
+static int benchThroughput(double seconds, long delayUs){
+
+  static const int bauds[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+  // a GET_SMC_VAR exchange is a 3 byte frame and a 2 byte reply, one
+  // after the other when sync, overlapping on the two lines when pipelined
+  const int requestBytes = Command<POLOLU_COM::GET_SMC_VAR>::pololuLen;
+  const int responseBytes = Command<POLOLU_COM::GET_SMC_VAR>::responseLen;
+
+  bool first = true;
+  printf("  \"throughput\": [");
+
+  for(size_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++){
+    Bench bench;
+    if(!bench.open(bauds[i], delayUs, true)){
+      fprintf(stderr, "smc_bench: cannot open simulator\n");
+      return 0;
+    }
+    double sync = sustained(bench.smc, seconds, 0);
+    double pipelined = sustained(bench.smc, seconds, SMC_MAX_IN_FLIGHT);
+    double syncLimit = bauds[i] / 10.0 / (requestBytes + responseBytes);
+    double pipelinedLimit = bauds[i] / 10.0 / std::max(requestBytes, responseBytes);
+
+    printf("%s\n    {\"baud\": %d, \"command\": \"GET_SMC_VAR\", "
+           "\"sync_per_sec\": %.1f, \"sync_wire_limit\": %.1f, "
+           "\"pipelined_per_sec\": %.1f, \"pipelined_wire_limit\": %.1f}",
+           first ? "" : ",", bauds[i], sync, syncLimit, pipelined, pipelinedLimit);
+    first = false;
+    fflush(stdout);
+  }
+
+  printf("\n  ]");
+  return 1;
+}
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "usage: %s [--only encode|rtt|throughput] [--samples N] [--duration S]\n"
+    "          [--rtt-baud N] [--delay US] [--io-thread]\n"
+    "  --only PART     run a single part (default all)\n"
+    "  --samples N     round trips per command (default 10000)\n"
+    "  --duration S    seconds per baud rate and mode (default 1)\n"
+    "  --rtt-baud N    simulated baud rate of the rtt part, 0 for none (default 0)\n"
+    "  --delay US      simulated response delay in microseconds (default 0)\n"
+    "  --io-thread     run the rtt part through the I/O thread\n", name);
+}
+
+int main(int argc, char **argv){
+
+  std::string only;
+  int samples = 10000;
+  double seconds = 1;
+  int rttBaud = 0;
+  long delayUs = 0;
+  bool ioThread = false;
+
+  for(int i = 1; i < argc; i++){
+    const char *arg = argv[i];
+    if(!strcmp(arg, "--io-thread")){
+      ioThread = true;
+      continue;
+    }
+    if(!strcmp(arg, "--help") || !strcmp(arg, "-h") || i + 1 >= argc){
+      usage(argv[0]);
+      return strcmp(arg, "--help") && strcmp(arg, "-h");
+    }
+    const char *val = argv[++i];
+    if(!strcmp(arg, "--only"))
+      only = val;
+    else if(!strcmp(arg, "--samples"))
+      samples = atoi(val);
+    else if(!strcmp(arg, "--duration"))
+      seconds = atof(val);
+    else if(!strcmp(arg, "--rtt-baud"))
+      rttBaud = atoi(val);
+    else if(!strcmp(arg, "--delay"))
+      delayUs = atol(val);
+    else{
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(!only.empty() && only != "encode" && only != "rtt" && only != "throughput"){
+    usage(argv[0]);
+    return 1;
+  }
+
+  int ok = 1;
+  const char *sep = "";
+  printf("{\n");
+
+  if(only.empty() || only == "encode"){
+    benchEncode();
+    sep = ",\n";
+  }
+  if(ok && (only.empty() || only == "rtt")){
+    printf("%s", sep);
+    ok = benchRtt(samples, rttBaud, delayUs, ioThread);
+    sep = ",\n";
+  }
+  if(ok && (only.empty() || only == "throughput")){
+    printf("%s", sep);
+    ok = benchThroughput(seconds, delayUs);
+  }
+
+  printf("\n}\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,295 @@
+/**
+ * Measures GET_SMC_VAR round trips on a serial port for each serial
+ * backend and low latency setting, to check that a deployed port is
+ * tuned. A USB adapter whose latency timer is still batching shows up
+ * as a p50 near the timer period. The port's serial flags are put back
+ * as they were found when the probe exits.
+ *
+ * smc_latency_probe [--port PATH | --sim] [--baud N] [--device ID]
+ *                   [--samples N] [--timeout MS] [--backend asio|posix|all]
+ *                   [--low-latency off|on|all] [--json]
+ */
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/serial.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "smc/smc.h"
+#include "smc/Simulator.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * @return the adapter's latency timer in ms, -1 if it has none
+ */
+static int latencyTimer(const std::string &path){
+  char real[PATH_MAX];
+  if(!realpath(path.c_str(), real))
+    return -1;
+  std::string sysfs = std::string("/sys/class/tty/") + basename(real) + "/device/latency_timer";
+  FILE *f = fopen(sysfs.c_str(), "r");
+  if(!f)
+    return -1;
+  int ms = -1;
+  if(fscanf(f, "%d", &ms) != 1)
+    ms = -1;
+  fclose(f);
+  return ms;
+}
+
+/**
+ * The probed port's serial flags as found, restored on exit since
+ * ASYNC_LOW_LATENCY outlives the process that set it
+ */
+static char savedPath[PATH_MAX];
+static int savedFlags = -1;
+
+/**
+ * @return the port's serial_struct flags, -1 if it has none, like a pty
+ */
+static int serialFlags(const char *path){
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+    return -1;
+  struct serial_struct serial;
+  int flags = ioctl(fd, TIOCGSERIAL, &serial) ? -1 : serial.flags;
+  close(fd);
+  return flags;
+}
+
+/**
+ * Sets the port's serial_struct flags if they differ, async signal safe
+ */
+static void setSerialFlags(const char *path, int flags){
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+    return;
+  struct serial_struct serial;
+  if(!ioctl(fd, TIOCGSERIAL, &serial) && serial.flags != flags){
+    serial.flags = flags;
+    ioctl(fd, TIOCSSERIAL, &serial);
+  }
+  close(fd);
+}
+
+static void restoreFlags(){
+  if(savedFlags >= 0)
+    setSerialFlags(savedPath, savedFlags);
+}
+
+static void restoreAndRaise(int sig){
+  restoreFlags();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/**
+ * Clears ASYNC_LOW_LATENCY
+ */
+static void clearLowLatency(const std::string &path){
+  int flags = serialFlags(path.c_str());
+  if(flags >= 0 && (flags & ASYNC_LOW_LATENCY))
+    setSerialFlags(path.c_str(), flags & ~ASYNC_LOW_LATENCY);
+}
+
+struct Result {
+  const char *backend;
+  bool requested;
+  int applied;
+  int timerMs;
+  int failed;
+  std::vector<double> us;
+};
+
+static int probe(const std::string &path, int baud, int device, int samples, int timeout,
+                 SERIAL_BACKEND backend, bool lowLatency, Result &result){
+
+  if(!lowLatency)
+    clearLowLatency(path);
+
+  SerialPort port(backend);
+  if(!port.connect(path, baud, timeout, lowLatency)){
+    fprintf(stderr, "smc_latency_probe: cannot open %s\n", path.c_str());
+    return 0;
+  }
+  SMC smc(&port);
+
+  result.backend = port.getBackend() == SERIAL_BACKEND::ASIO ? "asio" : "posix";
+  result.requested = lowLatency;
+  result.applied = port.isLowLatency();
+  result.timerMs = latencyTimer(path);
+  result.failed = 0;
+  result.us.clear();
+  result.us.reserve(samples);
+
+  for(int i = 0; i < samples; i++){
+    uint16_t val;
+    Clock::time_point start = Clock::now();
+    if(smc.getMotorVariable(device, (uint8_t)SMC_VAR::INPUT_VOLTAGE, val))
+      result.us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    else{
+      result.failed++;
+      port.flushPort(SerialPort::flush_receive);
+    }
+  }
+  std::sort(result.us.begin(), result.us.end());
+  port.disconnect();
+  return 1;
+}
+
+static double percentile(const std::vector<double> &us, int perMille){
+  if(us.empty())
+    return 0;
+  size_t i = us.size() * perMille / 1000;
+  return us[i < us.size() ? i : us.size() - 1];
+}
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "usage: %s [--port PATH | --sim] [--baud N] [--device ID] [--samples N]\n"
+    "          [--timeout MS] [--backend asio|posix|all] [--low-latency off|on|all] [--json]\n"
+    "  --port PATH          serial device with a controller on it\n"
+    "  --sim                probe the simulator instead\n"
+    "  --baud N             baud rate (default 115200)\n"
+    "  --device ID          device to read from (default 13)\n"
+    "  --samples N          round trips per setting (default 1000)\n"
+    "  --timeout MS         read deadline (default 100)\n"
+    "  --backend B          serial backend (default all)\n"
+    "  --low-latency L      ASYNC_LOW_LATENCY setting (default all)\n"
+    "  --json               one JSON object per setting\n", name);
+}
+
+int main(int argc, char **argv){
+
+  std::string path;
+  bool sim = false;
+  bool json = false;
+  int baud = 115200;
+  int device = 13;
+  int samples = 1000;
+  int timeout = 100;
+  std::string backends = "all";
+  std::string lowLatency = "all";
+
+  for(int i = 1; i < argc; i++){
+    const char *arg = argv[i];
+    if(!strcmp(arg, "--sim")){
+      sim = true;
+      continue;
+    }
+    if(!strcmp(arg, "--json")){
+      json = true;
+      continue;
+    }
+    if(!strcmp(arg, "--help") || !strcmp(arg, "-h") || i + 1 >= argc){
+      usage(argv[0]);
+      return strcmp(arg, "--help") && strcmp(arg, "-h");
+    }
+    const char *val = argv[++i];
+    if(!strcmp(arg, "--port"))
+      path = val;
+    else if(!strcmp(arg, "--baud"))
+      baud = atoi(val);
+    else if(!strcmp(arg, "--device"))
+      device = atoi(val);
+    else if(!strcmp(arg, "--samples"))
+      samples = atoi(val);
+    else if(!strcmp(arg, "--timeout"))
+      timeout = atoi(val);
+    else if(!strcmp(arg, "--backend"))
+      backends = val;
+    else if(!strcmp(arg, "--low-latency"))
+      lowLatency = val;
+    else{
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(sim == !path.empty() || device < 0 || device > 127){
+    usage(argv[0]);
+    return 1;
+  }
+
+  Simulator simulator;
+  if(sim){
+    simulator.addDevice(device);
+    simulator.setBaud(baud);
+    if(!simulator.start()){
+      fprintf(stderr, "smc_latency_probe: cannot start simulator\n");
+      return 1;
+    }
+    path = simulator.getPath();
+  }
+
+  // probing changes ASYNC_LOW_LATENCY, the deployed setting goes back
+  // on every way out
+  int flags = serialFlags(path.c_str());
+  if(flags >= 0 && path.size() < sizeof(savedPath)){
+    strcpy(savedPath, path.c_str());
+    savedFlags = flags;
+    atexit(restoreFlags);
+    signal(SIGINT, restoreAndRaise);
+    signal(SIGTERM, restoreAndRaise);
+    signal(SIGHUP, restoreAndRaise);
+  }
+
+  std::vector<SERIAL_BACKEND> types;
+  if(backends == "asio" || backends == "all")
+    types.push_back(SERIAL_BACKEND::ASIO);
+  if(backends == "posix" || backends == "all")
+    types.push_back(SERIAL_BACKEND::POSIX);
+  std::vector<bool> settings;
+  if(lowLatency == "off" || lowLatency == "all")
+    settings.push_back(false);
+  if(lowLatency == "on" || lowLatency == "all")
+    settings.push_back(true);
+  if(types.empty() || settings.empty()){
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(!json)
+    printf("%-7s %-4s %-7s %-6s %7s %6s %9s %9s %9s %9s %9s %9s\n",
+           "backend", "low", "applied", "timer", "samples", "failed",
+           "min_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+
+  Result result;
+  for(size_t t = 0; t < types.size(); t++){
+    for(size_t s = 0; s < settings.size(); s++){
+      if(!probe(path, baud, device, samples, timeout, types[t], settings[s], result))
+        return 1;
+
+      double min = result.us.empty() ? 0 : result.us.front();
+      double max = result.us.empty() ? 0 : result.us.back();
+      if(json)
+        printf("{\"port\": \"%s\", \"baud\": %d, \"backend\": \"%s\", \"low_latency\": %s, "
+               "\"applied\": %s, \"latency_timer_ms\": %d, \"samples\": %zu, \"failed\": %d, "
+               "\"min_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+               "\"p999_us\": %.1f, \"max_us\": %.1f}\n",
+               path.c_str(), baud, result.backend, result.requested ? "true" : "false",
+               result.applied ? "true" : "false", result.timerMs, result.us.size(), result.failed,
+               min, percentile(result.us, 500), percentile(result.us, 900),
+               percentile(result.us, 990), percentile(result.us, 999), max);
+      else
+        printf("%-7s %-4s %-7s %-6d %7zu %6d %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               result.backend, result.requested ? "on" : "off", result.applied ? "yes" : "no",
+               result.timerMs, result.us.size(), result.failed,
+               min, percentile(result.us, 500), percentile(result.us, 900),
+               percentile(result.us, 990), percentile(result.us, 999), max);
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
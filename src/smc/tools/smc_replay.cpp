@@ -0,0 +1,402 @@
+/**
+ * Replays a wire recording against the simulator. The sent frames go
+ * out through a Dispatcher at their recorded times, or faster, and the
+ * answers and round trip times the library sees are compared with the
+ * recorded ones, to reproduce a field latency problem or to benchmark a
+ * library change against production traffic.
+ *
+ * Devices that answered in the recording are added to the simulator with
+ * the firmware they reported, and each GET_SMC_VAR is answered with the
+ * value recorded for it, so a mismatch means the answer got lost, late or
+ * out of order, not that the model differs from the hardware. The
+ * recorded answers queue up in the simulator in send order, so reads
+ * still on the wire when later ones are sent, as at --speed 0, each get
+ * their own.
+ *
+ * smc_replay LOG [--speed X] [--baud N] [--timeout MS] [--no-seed] [--json]
+ *
+ * Exits 2 if any answer differs from the recording.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "smc/smc.h"
+#include "smc/Dispatcher.h"
+#include "smc/Simulator.h"
+#include "smc/Stats.h"
+#include "smc/WireRecorder.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * A write of the recording and what came back for it
+ */
+struct Step {
+  uint64_t timeNs;              /**< When it was sent, since the recording was opened */
+  uint8_t device;
+  uint8_t command;
+  char frame[SMC_MAX_FRAME];
+  uint8_t frameLen;
+  uint8_t responseLen;
+  char recorded[SMC_MAX_FRAME];
+  uint8_t recordedLen;
+  double recordedUs;            /**< Send to the last response byte, -1 if none */
+
+  std::atomic<int> status;      /**< Replay, -1 until completed */
+  char replayed[SMC_MAX_FRAME];
+  double replayedUs;
+  Clock::time_point submitted;
+};
+
+/**
+ * Splits the recording into steps and pairs the responses with them
+ * @return number of received records that answered nothing
+ */
+static int buildSteps(const std::vector<WireFrame> &frames, std::deque<Step> &steps){
+
+  std::deque<Step*> waiting;    // sent, answer not complete, in send order
+  int stray = 0;
+
+  for(size_t f = 0; f < frames.size(); f++){
+    const WireFrame &frame = frames[f];
+
+    if(frame.dir == WIRE_DIR::TX){
+      int payload = 0, response = 0;
+      bool known = frame.command != SMC_WIRE_UNKNOWN && frame.device != SMC_WIRE_UNKNOWN;
+      if(known && frame.command != (uint8_t)SSC_COM::SSC_PWM)
+        commandSizes(frame.command, payload, response);
+      // raw bytes go out as they were, in pieces a request holds
+      for(int i = 0; i < frame.len; i += SMC_MAX_FRAME){
+        steps.emplace_back();
+        Step &step = steps.back();
+        step.timeNs = frame.timeNs;
+        step.device = frame.device;
+        step.command = frame.command;
+        step.frameLen = frame.len - i < SMC_MAX_FRAME ? frame.len - i : SMC_MAX_FRAME;
+        memcpy(step.frame, frame.data + i, step.frameLen);
+        step.responseLen = known ? response : 0;
+        step.recordedLen = 0;
+        step.recordedUs = -1;
+        step.status = -1;
+        step.replayedUs = -1;
+        if(step.responseLen)
+          waiting.push_back(&step);
+      }
+      continue;
+    }
+
+    // the first request still waiting for this answer, the ones skipped
+    // went unanswered
+    std::deque<Step*>::iterator it = waiting.begin();
+    while(it != waiting.end() && ((*it)->device != frame.device || (*it)->command != frame.command))
+      ++it;
+    if(frame.command == SMC_WIRE_UNKNOWN || it == waiting.end()){
+      stray++;
+      continue;
+    }
+    waiting.erase(waiting.begin(), it);
+    Step &step = *waiting.front();
+    int n = frame.len < step.responseLen - step.recordedLen ? frame.len : step.responseLen - step.recordedLen;
+    memcpy(step.recorded + step.recordedLen, frame.data, n);
+    step.recordedLen += n;
+    if(step.recordedLen == step.responseLen){
+      step.recordedUs = (frame.timeNs - step.timeNs) / 1e3;
+      waiting.pop_front();
+    }
+  }
+  return stray;
+}
+
+/**
+ * Adds the devices that answered, with the firmware they reported
+ */
+static void addDevices(const std::deque<Step> &steps, Simulator &simulator, std::set<uint8_t> &devices){
+  std::map<uint8_t, const Step*> firmware;
+  for(size_t i = 0; i < steps.size(); i++){
+    const Step &step = steps[i];
+    if(step.recordedUs < 0 || step.device > 127)
+      continue;
+    devices.insert(step.device);
+    if(step.command == (uint8_t)POLOLU_COM::GET_FIRMWARE)
+      firmware[step.device] = &step;
+  }
+  for(std::set<uint8_t>::iterator it = devices.begin(); it != devices.end(); ++it){
+    std::map<uint8_t, const Step*>::iterator fw = firmware.find(*it);
+    if(fw == firmware.end()){
+      simulator.addDevice(*it);
+      continue;
+    }
+    const uint8_t *resp = (const uint8_t *)fw->second->recorded;
+    simulator.addDevice(*it, resp[1] << 8 | resp[0], resp[3], resp[2]);
+  }
+}
+
+/**
+ * Queues the value recorded for a GET_SMC_VAR as the answer to it
+ */
+static void seed(const Step &step, Simulator &simulator, const std::set<uint8_t> &devices){
+  if(step.command != (uint8_t)POLOLU_COM::GET_SMC_VAR || step.recordedUs < 0)
+    return;
+  const uint8_t *resp = (const uint8_t *)step.recorded;
+  uint16_t val = resp[1] << 8 | resp[0];
+  // compact frames carry no device and reach all of them
+  if(step.device == SMC_BROADCAST){
+    for(std::set<uint8_t>::const_iterator it = devices.begin(); it != devices.end(); ++it)
+      simulator.queueAnswer(*it, (SMC_VAR)step.frame[1], val);
+  }
+  else
+    simulator.queueAnswer(step.device, (SMC_VAR)step.frame[3], val);
+}
+
+static void completed(void *ctx, int status, const char *response){
+  Step *step = (Step *)ctx;
+  step->replayedUs = std::chrono::duration<double, std::micro>(Clock::now() - step->submitted).count();
+  if(status && response)
+    memcpy(step->replayed, response, step->responseLen);
+  step->status.store(status ? 1 : 0, std::memory_order_release);
+}
+
+static double percentile(const std::vector<double> &us, int perMille){
+  if(us.empty())
+    return 0;
+  size_t i = us.size() * perMille / 1000;
+  return us[i < us.size() ? i : us.size() - 1];
+}
+
+/**
+ * Round trip times of one command, recorded and replayed
+ */
+struct Timing {
+  std::string name;
+  int match;
+  int mismatch;
+  int missing;                  /**< Answered when recorded, not in the replay */
+  int extra;                    /**< Answered in the replay only */
+  std::vector<double> recorded;
+  std::vector<double> replayed;
+};
+
+static void printTiming(Timing &t, bool json, bool last){
+  std::sort(t.recorded.begin(), t.recorded.end());
+  std::sort(t.replayed.begin(), t.replayed.end());
+  if(json)
+    printf("    {\"command\": \"%s\", \"match\": %d, \"mismatch\": %d, \"missing\": %d, \"extra\": %d, "
+           "\"recorded_p50_us\": %.1f, \"recorded_p99_us\": %.1f, \"recorded_max_us\": %.1f, "
+           "\"replayed_p50_us\": %.1f, \"replayed_p99_us\": %.1f, \"replayed_max_us\": %.1f}%s\n",
+           t.name.c_str(), t.match, t.mismatch, t.missing, t.extra,
+           percentile(t.recorded, 500), percentile(t.recorded, 990), percentile(t.recorded, 1000),
+           percentile(t.replayed, 500), percentile(t.replayed, 990), percentile(t.replayed, 1000),
+           last ? "" : ",");
+  else
+    printf("%-20s %6d %8d %7d %5d %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+           t.name.c_str(), t.match, t.mismatch, t.missing, t.extra,
+           percentile(t.recorded, 500), percentile(t.recorded, 990), percentile(t.recorded, 1000),
+           percentile(t.replayed, 500), percentile(t.replayed, 990), percentile(t.replayed, 1000));
+}
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "usage: %s LOG [--speed X] [--baud N] [--timeout MS] [--no-seed] [--json]\n"
+    "  LOG                  recording written by a WireRecorder\n"
+    "  --speed X            replay X times as fast, 0 sends as fast as possible and\n"
+    "                       round trips include the time queued (default 1)\n"
+    "  --baud N             baud rate (default the recording's, else 115200)\n"
+    "  --timeout MS         read deadline (default 100)\n"
+    "  --no-seed            answer GET_SMC_VAR from the model, not the recording\n"
+    "  --json               one JSON object\n", name);
+}
+
+int main(int argc, char **argv){
+
+  std::string path;
+  double speed = 1;
+  int baud = 0;
+  int timeout = 100;
+  bool seedVars = true;
+  bool json = false;
+
+  for(int i = 1; i < argc; i++){
+    const char *arg = argv[i];
+    if(!strcmp(arg, "--no-seed")){
+      seedVars = false;
+      continue;
+    }
+    if(!strcmp(arg, "--json")){
+      json = true;
+      continue;
+    }
+    if(!strcmp(arg, "--help") || !strcmp(arg, "-h")){
+      usage(argv[0]);
+      return 0;
+    }
+    if(arg[0] != '-' && path.empty()){
+      path = arg;
+      continue;
+    }
+    if(i + 1 >= argc){
+      usage(argv[0]);
+      return 1;
+    }
+    const char *val = argv[++i];
+    if(!strcmp(arg, "--speed"))
+      speed = atof(val);
+    else if(!strcmp(arg, "--baud"))
+      baud = atoi(val);
+    else if(!strcmp(arg, "--timeout"))
+      timeout = atoi(val);
+    else{
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(path.empty() || speed < 0){
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<WireFrame> frames;
+  int recordedBaud = 0;
+  if(!WireRecorder::load(path, frames, recordedBaud)){
+    fprintf(stderr, "smc_replay: %s is no wire recording\n", path.c_str());
+    return 1;
+  }
+  if(!baud)
+    baud = recordedBaud ? recordedBaud : 115200;
+
+  std::deque<Step> steps;
+  int stray = buildSteps(frames, steps);
+  if(steps.empty()){
+    fprintf(stderr, "smc_replay: nothing was sent in %s\n", path.c_str());
+    return 1;
+  }
+
+  Simulator simulator;
+  std::set<uint8_t> devices;
+  addDevices(steps, simulator, devices);
+  simulator.setBaud(baud);
+  if(!simulator.start()){
+    fprintf(stderr, "smc_replay: cannot start simulator\n");
+    return 1;
+  }
+
+  SerialPort port;
+  if(!port.connect(simulator.getPath(), baud, timeout)){
+    fprintf(stderr, "smc_replay: cannot open %s\n", simulator.getPath().c_str());
+    return 1;
+  }
+  Dispatcher dispatcher(&port);
+  if(!dispatcher.start()){
+    fprintf(stderr, "smc_replay: cannot start dispatcher\n");
+    return 1;
+  }
+
+  uint64_t firstNs = steps.front().timeNs;
+  Clock::time_point start = Clock::now();
+  for(size_t i = 0; i < steps.size(); i++){
+    Step &step = steps[i];
+    if(speed > 0)
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds((int64_t)((step.timeNs - firstNs) / speed)));
+    if(seedVars)
+      seed(step, simulator, devices);
+
+    SMCRequest req;
+    memcpy(req.frame, step.frame, step.frameLen);
+    req.frameLen = step.frameLen;
+    req.responseLen = step.responseLen;
+    req.done = completed;
+    req.ctx = &step;
+    step.submitted = Clock::now();
+    while(!dispatcher.submit(req))
+      std::this_thread::yield();
+  }
+
+  // every request completes, by its answer or the read deadline
+  for(size_t i = 0; i < steps.size(); i++)
+    while(steps[i].status.load(std::memory_order_acquire) < 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  double replayedMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  dispatcher.stop();
+  port.disconnect();
+  simulator.stop();
+
+  double recordedMs = 0;
+  for(size_t i = 0; i < steps.size(); i++){
+    const Step &step = steps[i];
+    double end = step.timeNs + (step.recordedUs > 0 ? step.recordedUs * 1e3 : 0);
+    if((end - firstNs) / 1e6 > recordedMs)
+      recordedMs = (end - firstNs) / 1e6;
+  }
+
+  Timing total;
+  total.name = "all";
+  total.match = total.mismatch = total.missing = total.extra = 0;
+  std::map<uint8_t, Timing> byCommand;
+  for(size_t i = 0; i < steps.size(); i++){
+    const Step &step = steps[i];
+    if(!step.responseLen)
+      continue;
+    if(!byCommand.count(step.command)){
+      const char *name = CommandMetrics::name(step.command);
+      Timing &t = byCommand[step.command];
+      t.name = name ? name : "UNKNOWN";
+      t.match = t.mismatch = t.missing = t.extra = 0;
+    }
+    Timing &t = byCommand[step.command];
+    bool recorded = step.recordedUs >= 0;
+    bool replayed = step.status == 1;
+    if(recorded && replayed && !memcmp(step.recorded, step.replayed, step.responseLen))
+      t.match++, total.match++;
+    else if(recorded && replayed)
+      t.mismatch++, total.mismatch++;
+    else if(recorded)
+      t.missing++, total.missing++;
+    else if(replayed)
+      t.extra++, total.extra++;
+    if(recorded){
+      t.recorded.push_back(step.recordedUs);
+      total.recorded.push_back(step.recordedUs);
+    }
+    if(replayed){
+      t.replayed.push_back(step.replayedUs);
+      total.replayed.push_back(step.replayedUs);
+    }
+  }
+
+  if(json){
+    printf("{\"log\": \"%s\", \"baud\": %d, \"speed\": %.3f, \"seeded\": %s, \"frames\": %zu, "
+           "\"steps\": %zu, \"stray_rx\": %d, \"devices\": %zu, \"recorded_ms\": %.1f, "
+           "\"replayed_ms\": %.1f,\n  \"commands\": [\n",
+           path.c_str(), baud, speed, seedVars ? "true" : "false", frames.size(),
+           steps.size(), stray, devices.size(), recordedMs, replayedMs);
+    for(std::map<uint8_t, Timing>::iterator it = byCommand.begin(); it != byCommand.end(); ++it)
+      printTiming(it->second, true, false);
+    printTiming(total, true, true);
+    printf("  ]}\n");
+  }
+  else{
+    printf("%s: %zu records, %zu writes, %d stray received, %zu devices, %d baud\n",
+           path.c_str(), frames.size(), steps.size(), stray, devices.size(), baud);
+    printf("recorded %.1f ms, replayed %.1f ms at speed %g%s\n\n",
+           recordedMs, replayedMs, speed, seedVars ? "" : ", variables not seeded");
+    printf("%-20s %6s %8s %7s %5s %9s %9s %9s %9s %9s %9s\n",
+           "command", "match", "mismatch", "missing", "extra",
+           "rec_p50", "rec_p99", "rec_max", "rep_p50", "rep_p99", "rep_max");
+    for(std::map<uint8_t, Timing>::iterator it = byCommand.begin(); it != byCommand.end(); ++it)
+      printTiming(it->second, false, false);
+    printTiming(total, false, true);
+  }
+
+  return total.mismatch || total.missing || total.extra ? 2 : 0;
+}
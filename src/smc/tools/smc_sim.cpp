@@ -0,0 +1,110 @@
+/**
+ * Serves simulated Simple Motor Controllers on a pseudo-terminal until
+ * interrupted. Point SMC::connect at the printed path.
+ *
+ * smc_sim [--baud N] [--device ID]... [--delay US] [--drop P] [--corrupt P]
+ *         [--ssc-offset N] [--seed N]
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smc/Simulator.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int){
+  interrupted = 1;
+}
+
+static void usage(const char *name){
+  fprintf(stderr,
+    "usage: %s [--baud N] [--device ID]... [--delay US] [--drop P] [--corrupt P]\n"
+    "          [--ssc-offset N] [--seed N]\n"
+    "  --baud N        emulate the wire time of N baud, 0 for none (default 9600)\n"
+    "  --device ID     add a device, repeatable (default 13)\n"
+    "  --delay US      response delay in microseconds (default 0)\n"
+    "  --drop P        probability a response is dropped (default 0)\n"
+    "  --corrupt P     probability a response has a bit flipped (default 0)\n"
+    "  --ssc-offset N  Mini SSC servo number of device 0 (default 0)\n"
+    "  --seed N        fault injection seed (default 1)\n", name);
+}
+
+int main(int argc, char **argv){
+
+  Simulator sim;
+  int baud = 9600;
+  long delay = 0;
+  double drop = 0, corrupt = 0;
+  unsigned seed = 1;
+  int devices = 0;
+
+  for(int i = 1; i < argc; i++){
+    const char *arg = argv[i];
+    if(!strcmp(arg, "--help") || !strcmp(arg, "-h")){
+      usage(argv[0]);
+      return 0;
+    }
+    if(i + 1 >= argc){
+      usage(argv[0]);
+      return 1;
+    }
+    const char *val = argv[++i];
+    if(!strcmp(arg, "--baud"))
+      baud = atoi(val);
+    else if(!strcmp(arg, "--device")){
+      int id = atoi(val);
+      if(id < 0 || id > 127){
+        fprintf(stderr, "device ID must be 0-127\n");
+        return 1;
+      }
+      sim.addDevice(id);
+      devices++;
+    }
+    else if(!strcmp(arg, "--delay"))
+      delay = atol(val);
+    else if(!strcmp(arg, "--drop"))
+      drop = atof(val);
+    else if(!strcmp(arg, "--corrupt"))
+      corrupt = atof(val);
+    else if(!strcmp(arg, "--ssc-offset"))
+      sim.setMiniSscOffset(atoi(val));
+    else if(!strcmp(arg, "--seed"))
+      seed = strtoul(val, NULL, 10);
+    else{
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(!devices)
+    sim.addDevice(13);
+  sim.setBaud(baud);
+  sim.setResponseDelay(delay);
+  sim.setFaults(drop, corrupt, seed);
+
+  if(!sim.start()){
+    perror("smc_sim: cannot open pseudo-terminal");
+    return 1;
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  printf("%s\n", sim.getPath().c_str());
+  fflush(stdout);
+
+  while(!interrupted)
+    usleep(100000);
+
+  sim.stop();
+
+  SimStats stats = sim.getStats();
+  fprintf(stderr, "frames %lu responses %lu dropped %lu corrupted %lu collisions %lu serial errors %lu\n",
+          stats.frames, stats.responses, stats.dropped, stats.corrupted,
+          stats.collisions, stats.serialErrors);
+  return 0;
+}